@@ -0,0 +1,66 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "chunk.h"
+
+/* FastCDC with normalized chunking, a stricter mask is used until the
+ * average length is reached and a looser one after it so the lengths
+ * cluster around the average */
+#define MASK_SMALL 0x0000d9f003530000ULL
+#define MASK_LARGE 0x0000d90003530000ULL
+
+static uint64_t gear[256];
+static bool gear_ready = false;
+
+/* The table only has to be random looking and the same on every run, so
+ * it's generated with splitmix64 from a fixed seed */
+static void init_gear(void)
+{
+    uint64_t state = 0x6b617072696361ULL;
+    for (int i = 0; i < 256; i++)
+    {
+        state += 0x9e3779b97f4a7c15ULL;
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+    gear_ready = true;
+}
+
+size_t find_chunk_boundary(const uint8_t *data, size_t len)
+{
+    if (len <= MIN_CHUNK_LENGTH)
+    {
+        return len;
+    }
+
+    if (!gear_ready)
+    {
+        init_gear();
+    }
+
+    size_t normal = (len < AVERAGE_CHUNK_LENGTH) ? len : AVERAGE_CHUNK_LENGTH;
+    size_t max = (len < MAX_CHUNK_LENGTH) ? len : MAX_CHUNK_LENGTH;
+    uint64_t fingerprint = 0;
+    size_t i = MIN_CHUNK_LENGTH;
+
+    for (; i < normal; i++)
+    {
+        fingerprint = (fingerprint << 1) + gear[data[i]];
+        if (!(fingerprint & MASK_SMALL))
+        {
+            return i;
+        }
+    }
+    for (; i < max; i++)
+    {
+        fingerprint = (fingerprint << 1) + gear[data[i]];
+        if (!(fingerprint & MASK_LARGE))
+        {
+            return i;
+        }
+    }
+
+    return i;
+}
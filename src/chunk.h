@@ -0,0 +1,19 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef CHUNK_H
+#define CHUNK_H
+
+enum chunk_sizes
+{
+    MIN_CHUNK_LENGTH = 2048,
+    AVERAGE_CHUNK_LENGTH = 8192,
+    MAX_CHUNK_LENGTH = 65536
+};
+
+/* Returns the length of the next content-defined chunk at the start of the
+ * data, boundaries only depend on the surrounding bytes so an edit only
+ * changes the chunks around it */
+size_t find_chunk_boundary(const uint8_t *data, size_t len);
+
+#endif
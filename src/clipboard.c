@@ -76,3 +76,36 @@ void clip_destroy(clipboard *clip)
     wl_display_disconnect(clip->display);
     free(clip);
 }
+
+/* Only frees what's held on this side, requests that weren't sent yet are
+ * dropped along with the connection */
+void clip_release(clipboard *clip)
+{
+    source_buffer *src = clip->selection_source;
+    if (src && src->source)
+    {
+        wl_proxy_destroy((struct wl_proxy *)src->source);
+        src->source = NULL;
+    }
+    offer_buffer *ofr = clip->selection_offer;
+    if (ofr && ofr->offer)
+    {
+        wl_proxy_destroy((struct wl_proxy *)ofr->offer);
+        ofr->offer = NULL;
+    }
+    if (src)
+    {
+        source_destroy(src);
+    }
+    if (ofr)
+    {
+        offer_destroy(ofr);
+    }
+
+    wl_proxy_destroy((struct wl_proxy *)clip->cmng);
+    wl_proxy_destroy((struct wl_proxy *)clip->dmng);
+    wl_seat_destroy(clip->seat);
+    wl_registry_destroy(clip->registry);
+    wl_display_disconnect(clip->display);
+    free(clip);
+}
@@ -41,9 +41,15 @@ typedef struct
     char *types[MAX_MIME_TYPES];
     size_t len[MAX_MIME_TYPES];
     char *snippet;
+    /* Normalized text that searches are run against */
+    char *search_text;
     char *data_hash;
     void *thumbnail;
     size_t thumbnail_len;
+    /* The history entry the data is saved as, 0 if it isn't saved */
+    int64_t id;
+    /* Paste requests served since the count was last reset */
+    uint32_t pastes;
     bool offer_once;
     bool expired;
     bool password;
@@ -67,6 +73,9 @@ typedef struct
 /* Clipboard functions | clipboard.c */
 clipboard *clip_init(void);
 void clip_destroy(clipboard *clip);
+/* Frees the clipboard without sending anything to the compositor, for the
+ * parent of a forked process that keeps serving over the same connection */
+void clip_release(clipboard *clip);
 
 /* Offer buffer functions | offer.c */
 offer_buffer *offer_init(void);
@@ -76,6 +85,8 @@ bool clip_get_selection(clipboard *clip);
 void *clip_get_selection_type(clipboard *clip, const char *mime_type,
                               size_t *len);
 void clip_watch(clipboard *clip);
+/* Fills in the snippet, search text, thumbnail and hash from the data */
+void source_prepare(source_buffer *src);
 
 /* Source buffer functions | source.c */
 source_buffer *source_init(void);
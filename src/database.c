@@ -1,36 +1,65 @@
 #define _POSIX_C_SOURCE 200112L
 #include <sqlite3.h>
+#include <ctype.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <threads.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <zstd.h>
+#include <zdict.h>
+#include <xxhash.h>
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
 #include "database.h"
+#include "chunk.h"
 #include "clipboard.h"
+#include "detection.h"
+#include "fuzzy.h"
+#include "query.h"
+#include "trigram.h"
 #include "xmalloc.h"
 
-/* Bootstrapping statements */
-static sqlite3_stmt *create_main_table, *create_content_table;
-/* Pragma statements */
-static sqlite3_stmt *pragma_foreign_keys, *pragma_secure_delete,
-    *pragma_auto_vacuum, *pragma_optimize;
-/* Index statements */
-static sqlite3_stmt *create_data_index, *create_mime_index,
-    *create_snippet_index, *create_thumbnail_index, *create_timestamp_index,
-    *create_hash_index;
-/* Insertion statements */
-static sqlite3_stmt *insert_entry, *insert_entry_content;
-/* Search statements */
-static sqlite3_stmt *find_matching_entries, *find_matching_types,
-    *find_entry_from_snippet, *find_matching_entries_glob;
-/* Retrieval statements */
-static sqlite3_stmt *select_latest_entries, *select_entry, *select_snippet,
-    *select_thumbnail, *total_entries, *select_size;
-/* Deletion statements */
-static sqlite3_stmt *delete_entry, *delete_old_entries, *delete_last_entries,
-    *delete_duplicate_entries, *delete_large_entries, *delete_all_entries;
+/* The tables that reference an entry, renewing it moves their rows over to
+ * its new id one table at a time */
+static const char *const entry_tables[] = {"content", "chunk_ref",
+                                           "search_text", "search_filter",
+                                           "usage"};
+#define NUMBER_OF_ENTRY_TABLES (sizeof(entry_tables) / sizeof(entry_tables[0]))
+
+struct loaded_dictionary
+{
+    int64_t id;
+    ZSTD_DDict *ddict;
+    uint64_t last_used;
+};
+
+/* Fuzzy searches score every entry, so the start of the search text of each
+ * one is kept in memory between searches */
+struct fuzzy_candidate
+{
+    int64_t id;
+    uint64_t character_set;
+    size_t offset;
+    size_t len;
+};
+
+struct fuzzy_candidates
+{
+    struct fuzzy_candidate *list;
+    uint32_t len;
+    uint32_t size;
+    char *text;
+    size_t text_len;
+    size_t text_size;
+    int64_t data_version;
+    int64_t total_changes;
+    bool loaded;
+};
 
 #define FIVE_HUNDRED_MS 5
 struct timespec one_hundred_ms = {.tv_nsec = 100000000};
@@ -39,9 +68,302 @@ enum datatype
 {
     BLOB,
     INT,
+    INT64,
+    DOUBLE,
     TEXT
 };
 
+/* How the data of a content row is stored */
+enum content_encoding
+{
+    ENCODING_RAW,
+    /* No data is stored, it's generated from another image in the entry */
+    ENCODING_TRANSCODED,
+    /* A zstd frame, compressed with the dictionary in content.dictionary */
+    ENCODING_ZSTD,
+    /* A list of little endian chunk ids, the data is in the chunk table */
+    ENCODING_CHUNKED
+};
+
+enum compression_defaults
+{
+    MIN_COMPRESS_LENGTH = 64,
+    DICTIONARY_SIZE = 65536,
+    /* Entries needed before a (new) dictionary is worth training */
+    MIN_DICTIONARY_SAMPLES = 256,
+    RETRAIN_DICTIONARY_SAMPLES = 2048,
+    MAX_SAMPLE_LENGTH = 16384,
+    /* Entries that are rarely pasted can afford slower decompression */
+    COLD_COMPRESSION_LEVEL = 19,
+    /* Higher levels take several seconds per megabyte */
+    COLD_LARGE_COMPRESSION_LEVEL = 9,
+    COLD_LARGE_LENGTH = 1048576,
+    COLD_BATCH_LENGTH = 8388608
+};
+
+enum search_defaults
+{
+    NUMBER_OF_CANDIDATES = 1024,
+    /* Virtual machine instructions between checks for a cancelled search,
+     * a few microseconds worth */
+    CANCEL_CHECK_INTERVAL = 1000,
+    /* Fuzzy candidates scored between checks */
+    CANCEL_CHECK_CANDIDATES = 4096,
+    /* Text of the matches kept to narrow down the next search */
+    MAX_RECORDED_TEXT_SIZE = 16 * 1024 * 1024
+};
+
+enum frecency_defaults
+{
+    /* A use counts half as much after this many days */
+    FRECENCY_HALF_LIFE_DAYS = 3,
+    SECONDS_PER_DAY = 86400
+};
+
+enum reader_defaults
+{
+    /* A reader waits this long for the writer to commit, even when preparing
+     * its statements */
+    READER_BUSY_TIMEOUT_MS = 2000
+};
+
+enum open_defaults
+{
+    /* How long opening a database waits for another process that's
+     * creating or migrating it at the same time */
+    OPEN_BUSY_TIMEOUT_MS = 10000
+};
+
+/* Read only handles of threads other than the one that opened the database,
+ * closed when the thread exits */
+static tss_t readers;
+static once_flag readers_created = ONCE_FLAG_INIT;
+
+/* Set by another thread to stop the search this thread is running. Thread
+ * local so searches on other threads sharing the connection aren't affected */
+static _Thread_local const atomic_bool *search_cancelled;
+
+struct recorded_match
+{
+    int64_t id;
+    size_t offset;
+};
+
+/* Which filters a query uses, each combination compiles to its own statement
+ * that is prepared the first time it's needed and then kept */
+enum query_shape
+{
+    SHAPE_LIKE = 1 << 0,
+    SHAPE_GLOB = 1 << 1,
+    SHAPE_REGEX = 1 << 2,
+    SHAPE_MIME_TYPE = 1 << 3,
+    SHAPE_LARGER = 1 << 4,
+    SHAPE_SMALLER = 1 << 5,
+    SHAPE_AFTER = 1 << 6,
+    SHAPE_BEFORE = 1 << 7,
+    /* Only checks whether a single entry passes the filters */
+    SHAPE_ENTRY = 1 << 8,
+    /* Ordered by frecency instead of newest first */
+    SHAPE_FRECENCY = 1 << 9,
+    NUMBER_OF_SHAPES = 1 << 10
+};
+
+/* Sizes and MIME types are per type of an entry, an entry's size is that of
+ * its largest type */
+static const struct
+{
+    enum query_shape shape;
+    const char *condition;
+} query_conditions[] = {
+    /* A single term so the text isn't read before the filter is tested */
+    {SHAPE_LIKE, "CASE WHEN trigram_match(search_filter.filter, ?1)"
+                 "    THEN search_text.text LIKE '%' || ?1 || '%' END"},
+    {SHAPE_GLOB, "search_text.text GLOB ?1"},
+    {SHAPE_REGEX, "search_text.text REGEXP ?1"},
+    {SHAPE_MIME_TYPE, "EXISTS (SELECT 1 FROM content"
+                      "    WHERE content.entry = history_id"
+                      "    AND content.mime_type LIKE '%' || ?2 || '%')"},
+    {SHAPE_LARGER, "(SELECT MAX(content.length) FROM content"
+                   "    WHERE content.entry = history_id) > ?3"},
+    {SHAPE_SMALLER, "(SELECT MAX(content.length) FROM content"
+                    "    WHERE content.entry = history_id) < ?4"},
+    {SHAPE_AFTER, "timestamp >= date(?5)"},
+    {SHAPE_BEFORE, "timestamp < date(?6)"},
+    {SHAPE_ENTRY, "history_id = ?7"}};
+
+/* The matches of a substring search and their text, newest first */
+struct search_record
+{
+    char *pattern;
+    struct recorded_match *matches;
+    uint32_t len;
+    uint32_t size;
+    /* Every text is followed by a terminator */
+    char *text;
+    size_t text_len;
+    size_t text_size;
+    /* Where the search is up to, 0 once every entry has been searched */
+    int64_t searched_to;
+    int64_t data_version;
+    int64_t total_changes;
+};
+
+/* A connection and everything prepared on it. Nothing is shared between
+ * handles, so each thread can use its own at the same time */
+struct database
+{
+    sqlite3 *conn;
+    /* Bootstrapping statements */
+    sqlite3_stmt *create_main_table, *create_content_table;
+    /* Pragma statements */
+    sqlite3_stmt *pragma_foreign_keys, *pragma_secure_delete,
+        *pragma_auto_vacuum, *pragma_optimize;
+    /* Index statements */
+    sqlite3_stmt *create_mime_index, *create_snippet_index,
+        *create_thumbnail_index, *create_timestamp_index, *create_hash_index;
+    /* Insertion statements */
+    sqlite3_stmt *insert_entry, *insert_entry_content, *insert_search_text,
+        *insert_search_filter;
+    /* Search statements */
+    sqlite3_stmt *find_entry_from_snippet, *find_matching_snippets,
+        *scan_matching_entries, *scan_matching_entries_glob,
+        *scan_matching_entries_regex;
+    /* Retrieval statements */
+    sqlite3_stmt *select_latest_entries, *select_entry, *select_snippet,
+        *select_thumbnail, *total_entries, *select_size;
+    /* Deletion statements */
+    sqlite3_stmt *delete_entry, *delete_old_entries, *delete_last_entries,
+        *delete_duplicate_entries, *delete_large_entries, *delete_all_entries;
+    /* Compression dictionary statements */
+    sqlite3_stmt *insert_dictionary, *select_dictionary,
+        *select_latest_dictionary, *select_dictionary_samples,
+        *count_undictionaried_entries, *delete_unused_dictionaries;
+    /* Cold storage statements */
+    sqlite3_stmt *select_cold_content, *update_cold_content;
+    /* Chunk store statements */
+    sqlite3_stmt *insert_chunk, *insert_chunk_ref, *find_chunk,
+        *select_chunk;
+    /* Search text statements */
+    sqlite3_stmt *select_unindexed_entries, *select_all_search_text,
+        *select_data_version;
+    /* In-memory index statements */
+    sqlite3_stmt *select_index_entries, *select_search_text;
+    /* Usage statements */
+    sqlite3_stmt *select_usage, *select_usage_from_hash, *replace_usage,
+        *select_frecent_entries;
+    /* Renewal statements, one for each of entry_tables */
+    sqlite3_stmt *insert_renewed_entry,
+        *move_entry_rows[NUMBER_OF_ENTRY_TABLES];
+    /* Query statements, by shape */
+    sqlite3_stmt *query_statements[NUMBER_OF_SHAPES];
+
+    /* Compression state, dictionaries are loaded lazily and the most
+     * recently trained one is used for all new entries */
+    ZSTD_CCtx *compress_context;
+    ZSTD_DCtx *decompress_context;
+    ZSTD_CDict *current_dictionary;
+    int64_t current_dictionary_id;
+    int64_t current_dictionary_last_entry;
+    struct loaded_dictionary loaded_dictionaries[4];
+    uint64_t dictionary_clock;
+
+    /* Data at least this long is split into chunks, 0 disables chunking */
+    size_t chunk_threshold;
+
+    struct fuzzy_candidates fuzzy_candidates;
+    /* A search whose pattern contains the last complete one's can only
+     * match the same entries or fewer, so only those have to be looked at
+     * again */
+    struct search_record last_search, current_search;
+};
+
+/* Schema changes applied on top of the bootstrap tables, the database keeps
+ * track of how many have been applied with PRAGMA user_version */
+static const char *const migrations[] = {
+    "ALTER TABLE content ADD COLUMN encoding INTEGER NOT NULL DEFAULT 0;",
+    "ALTER TABLE content ADD COLUMN dictionary INTEGER;",
+    "CREATE TABLE IF NOT EXISTS dictionary ("
+    "    dict_id INTEGER PRIMARY KEY,"
+    "    last_entry INTEGER NOT NULL,"
+    "    data BLOB NOT NULL);",
+    "ALTER TABLE content ADD COLUMN cold INTEGER NOT NULL DEFAULT 0;"
+    "CREATE INDEX IF NOT EXISTS cold_index ON content (entry)"
+    "    WHERE cold = 0;",
+    /* Chunks are shared between entries, chunk_ref keeps track of which
+     * entries use them so they can be removed with the last one */
+    "CREATE TABLE IF NOT EXISTS chunk ("
+    "    chunk_id INTEGER PRIMARY KEY,"
+    "    hash INTEGER NOT NULL,"
+    "    length INTEGER NOT NULL,"
+    "    encoding INTEGER NOT NULL,"
+    "    data BLOB NOT NULL);"
+    "CREATE INDEX IF NOT EXISTS chunk_hash_index ON chunk (hash);"
+    "CREATE TABLE IF NOT EXISTS chunk_ref ("
+    "    entry INTEGER NOT NULL,"
+    "    chunk INTEGER NOT NULL,"
+    "    FOREIGN KEY (entry) REFERENCES clipboard_history(history_id)"
+    "       ON DELETE CASCADE);"
+    "CREATE INDEX IF NOT EXISTS chunk_ref_entry_index ON chunk_ref (entry);"
+    "CREATE INDEX IF NOT EXISTS chunk_ref_chunk_index ON chunk_ref (chunk);"
+    "CREATE TRIGGER IF NOT EXISTS delete_unused_chunks"
+    "    AFTER DELETE ON chunk_ref"
+    "    WHEN NOT EXISTS (SELECT 1 FROM chunk_ref WHERE chunk = OLD.chunk)"
+    "    BEGIN"
+    "        DELETE FROM chunk WHERE chunk_id = OLD.chunk;"
+    "    END;",
+    /* Searches only look at the text extracted from each entry, so the
+     * index over all of the raw data is no longer used */
+    "CREATE TABLE IF NOT EXISTS search_text ("
+    "    entry INTEGER PRIMARY KEY,"
+    "    text TEXT NOT NULL,"
+    "    FOREIGN KEY (entry) REFERENCES clipboard_history(history_id)"
+    "       ON DELETE CASCADE);"
+    "DROP INDEX IF EXISTS data_index;",
+    /* Every copy and paste of an entry adds to its score, see add_use().
+     * Existing entries count as copied once when they were saved, the 3 is
+     * FRECENCY_HALF_LIFE_DAYS */
+    "CREATE TABLE IF NOT EXISTS usage ("
+    "    entry INTEGER PRIMARY KEY,"
+    "    uses INTEGER NOT NULL,"
+    "    score REAL NOT NULL,"
+    "    FOREIGN KEY (entry) REFERENCES clipboard_history(history_id)"
+    "       ON DELETE CASCADE);"
+    "CREATE INDEX IF NOT EXISTS usage_score_index ON usage (score);"
+    "INSERT INTO usage (entry, uses, score)"
+    "    SELECT history_id, 1, (julianday(timestamp) - 2440587.5) / 3"
+    "        FROM clipboard_history;",
+    /* Trigram filters of long search text, substring searches test them
+     * first so most of the text never has to be read */
+    "CREATE TABLE IF NOT EXISTS search_filter ("
+    "    entry INTEGER PRIMARY KEY,"
+    "    filter BLOB NOT NULL,"
+    "    FOREIGN KEY (entry) REFERENCES clipboard_history(history_id)"
+    "       ON DELETE CASCADE);"
+    "INSERT INTO search_filter (entry, filter)"
+    "    SELECT entry, filter FROM ("
+    "        SELECT entry, trigram_filter(text) AS filter FROM search_text)"
+    "    WHERE filter IS NOT NULL;",
+    /* Ids aren't handed out again once their entry is deleted, so kapd's
+     * index and the clients can't mistake a new entry for an old one */
+    "CREATE TABLE clipboard_history_new ("
+    "    history_id INTEGER PRIMARY KEY AUTOINCREMENT,"
+    "    timestamp DATETIME NOT NULL DEFAULT (datetime('now')),"
+    "    snippet TEXT NOT NULL,"
+    "    thumbnail BLOB,"
+    "    hash TEXT NOT NULL);"
+    "INSERT INTO clipboard_history_new"
+    "    SELECT history_id, timestamp, snippet, thumbnail, hash"
+    "        FROM clipboard_history;"
+    "DROP TABLE clipboard_history;"
+    "ALTER TABLE clipboard_history_new RENAME TO clipboard_history;"
+    "CREATE INDEX IF NOT EXISTS timestamp_index"
+    "    ON clipboard_history (timestamp);"
+    "CREATE INDEX IF NOT EXISTS snippet_index ON clipboard_history (snippet);"
+    "CREATE INDEX IF NOT EXISTS thumbnail_index"
+    "    ON clipboard_history (thumbnail);"
+    "CREATE INDEX IF NOT EXISTS hash_index ON clipboard_history (hash);",
+};
+
 /* Insert into clipboard_history table */
 #define SNIPPET_BINDING 1
 #define THUMBNAIL_BINDING 2
@@ -51,38 +373,82 @@ enum datatype
 #define LENGTH_BINDING 2
 #define DATA_BINDING 3
 #define MIME_TYPE_BINDING 4
+#define ENCODING_BINDING 5
+#define DICTIONARY_BINDING 6
+/* Insert into dictionary table */
+#define LAST_ENTRY_BINDING 1
+#define DICTIONARY_DATA_BINDING 2
+/* Update cold content */
+#define COLD_DATA_BINDING 1
+#define COLD_ENCODING_BINDING 2
+#define COLD_DICTIONARY_BINDING 3
+#define COLD_ROWID_BINDING 4
+#define COLD_LENGTH_BINDING 5
+/* Select cold content */
+#define COLD_DAYS_BINDING 1
+#define COLD_LIMIT_BINDING 2
+/* Insert into chunk table */
+#define CHUNK_HASH_BINDING 1
+#define CHUNK_LENGTH_BINDING 2
+#define CHUNK_ENCODING_BINDING 3
+#define CHUNK_DATA_BINDING 4
+/* Insert into search_text table */
+#define SEARCH_TEXT_BINDING 2
+/* Insert into search_filter table */
+#define SEARCH_FILTER_BINDING 2
+/* Insert into chunk_ref table */
+#define CHUNK_REF_ENTRY_BINDING 1
+#define CHUNK_REF_CHUNK_BINDING 2
 /* Search by content */
 #define MATCH_BINDING 1
+#define SCAN_BEFORE_BINDING 2
+#define QUERY_TEXT_BINDING 1
+#define QUERY_MIME_TYPE_BINDING 2
+#define QUERY_LARGER_BINDING 3
+#define QUERY_SMALLER_BINDING 4
+#define QUERY_AFTER_BINDING 5
+#define QUERY_BEFORE_BINDING 6
+#define QUERY_ENTRY_BINDING 7
+#define SCAN_LIMIT_BINDING 3
+/* Replace usage */
+#define USAGE_ENTRY_BINDING 1
+#define USAGE_USES_BINDING 2
+#define USAGE_SCORE_BINDING 3
+#define USAGE_HASH_BINDING 1
+/* Move rows to a renewed entry */
+#define OLD_ENTRY_BINDING 1
+#define NEW_ENTRY_BINDING 2
 /* Search by id */
 #define ID_BINDING 1
 /* Delete old entries binding */
 #define DATE_BINDING 1
 
-static void prepare_statement(sqlite3 *db, const char *s, sqlite3_stmt **stmt)
+static void prepare_statement(struct database *db, const char *s,
+                              sqlite3_stmt **stmt)
 {
-    int ret = sqlite3_prepare_v2(db, s, -1, stmt, NULL);
+    int ret = sqlite3_prepare_v2(db->conn, s, -1, stmt, NULL);
     if (ret != SQLITE_OK)
     {
-        fprintf(stderr, "Database error: %s\n", sqlite3_errmsg(db));
+        fprintf(stderr, "Database error: %s\n", sqlite3_errmsg(db->conn));
         exit(EXIT_FAILURE);
     }
 }
 
 /* Only statements necessary to create and initialize
  * the database if it did not already exist */
-static void prepare_bootstrap_statements(sqlite3 *db)
+static void prepare_bootstrap_statements(struct database *db)
 {
     const char foreign_keys[] = "PRAGMA foreign_keys = ON;";
-    prepare_statement(db, foreign_keys, &pragma_foreign_keys);
+    prepare_statement(db, foreign_keys, &db->pragma_foreign_keys);
 
     const char secure_delete[] = "PRAGMA secure_delete = OFF;";
-    prepare_statement(db, secure_delete, &pragma_secure_delete);
+    prepare_statement(db, secure_delete, &db->pragma_secure_delete);
 
     const char auto_vacuum[] = "PRAGMA auto_vacuum = NONE;";
-    prepare_statement(db, auto_vacuum, &pragma_auto_vacuum);
+    prepare_statement(db, auto_vacuum, &db->pragma_auto_vacuum);
 
     const char optimize[] = "PRAGMA optimize;";
-    prepare_statement(db, optimize, &pragma_optimize);
+    prepare_statement(db, optimize, &db->pragma_optimize);
 
     const char main_table[] =
         "CREATE TABLE IF NOT EXISTS clipboard_history ("
@@ -91,7 +457,7 @@ static void prepare_bootstrap_statements(sqlite3 *db)
         "    snippet TEXT NOT NULL,"
         "    thumbnail BLOB,"
         "    hash TEXT NOT NULL);";
-    prepare_statement(db, main_table, &create_main_table);
+    prepare_statement(db, main_table, &db->create_main_table);
 
     const char content_table[] =
         "CREATE TABLE IF NOT EXISTS content ("
@@ -101,106 +467,125 @@ static void prepare_bootstrap_statements(sqlite3 *db)
         "    mime_type TEXT NOT NULL,"
         "    FOREIGN KEY (entry) REFERENCES clipboard_history(history_id)"
         "       ON DELETE CASCADE);";
-    prepare_statement(db, content_table, &create_content_table);
+    prepare_statement(db, content_table, &db->create_content_table);
 }
 
 /* Prepare all index statements, should only be needed to be called by
  * kapricad when creating the database */
-static void prepare_index_statements(sqlite3 *db)
+static void prepare_index_statements(struct database *db)
 {
-    const char data_index[] = "CREATE INDEX IF NOT EXISTS data_index"
-                              "    ON content (data);";
-    prepare_statement(db, data_index, &create_data_index);
-
     const char mime_index[] = "CREATE INDEX IF NOT EXISTS mime_index"
                               "    ON content (mime_type);";
-    prepare_statement(db, mime_index, &create_mime_index);
+    prepare_statement(db, mime_index, &db->create_mime_index);
 
     const char snippet_index[] = "CREATE INDEX IF NOT EXISTS snippet_index"
                                  "    ON clipboard_history (snippet);";
-    prepare_statement(db, snippet_index, &create_snippet_index);
+    prepare_statement(db, snippet_index, &db->create_snippet_index);
 
     const char thumbnail_index[] = "CREATE INDEX IF NOT EXISTS thumbnail_index"
                                    "    ON clipboard_history (thumbnail);";
-    prepare_statement(db, thumbnail_index, &create_thumbnail_index);
+    prepare_statement(db, thumbnail_index, &db->create_thumbnail_index);
 
     const char timestamp_index[] = "CREATE INDEX IF NOT EXISTS timestamp_index"
                                    "    ON clipboard_history (timestamp);";
-    prepare_statement(db, timestamp_index, &create_timestamp_index);
+    prepare_statement(db, timestamp_index, &db->create_timestamp_index);
 
     const char hash_index[] = "CREATE INDEX IF NOT EXISTS hash_index"
                               "    ON clipboard_history (hash);";
-    prepare_statement(db, hash_index, &create_hash_index);
+    prepare_statement(db, hash_index, &db->create_hash_index);
 }
 
 /* Preparing statements is relatively costly resource wise
  * so we frontload all of them at the start and only
  * finalize them when the program is stopped */
-static void prepare_all_statements(sqlite3 *db)
+static void prepare_all_statements(struct database *db)
 {
     const char insert_entry_history[] =
         "INSERT INTO clipboard_history (snippet, thumbnail, hash)"
         "                       VALUES (?1,      ?2,        ?3);";
-    prepare_statement(db, insert_entry_history, &insert_entry);
+    prepare_statement(db, insert_entry_history, &db->insert_entry);
 
     const char entry_content[] =
-        "INSERT INTO content (entry, length, data, mime_type)"
-        "    VALUES          (?1,    ?2,     ?3,   ?4);";
-    prepare_statement(db, entry_content, &insert_entry_content);
+        "INSERT INTO content (entry, length, data, mime_type, encoding,"
+        "                     dictionary)"
+        "    VALUES          (?1,    ?2,     ?3,   ?4,        ?5,"
+        "                     ?6);";
+    prepare_statement(db, entry_content, &db->insert_entry_content);
 
     const char get_size[] = "SELECT page_count * page_size"
                             "    FROM pragma_page_count,"
                             "         pragma_page_size;";
-    prepare_statement(db, get_size, &select_size);
+    prepare_statement(db, get_size, &db->select_size);
 
     const char get_latest_entries[] = "SELECT history_id FROM clipboard_history"
                                       "    ORDER BY timestamp DESC"
                                       "    LIMIT ?1 OFFSET ?2;";
-    prepare_statement(db, get_latest_entries, &select_latest_entries);
+    prepare_statement(db, get_latest_entries, &db->select_latest_entries);
 
-    const char get_entry[] = "SELECT * FROM content"
-                             "    WHERE entry = ?1;";
-    prepare_statement(db, get_entry, &select_entry);
+    const char get_entry[] =
+        "SELECT entry, length, data, mime_type, encoding, dictionary"
+        "    FROM content"
+        "    WHERE entry = ?1;";
+    prepare_statement(db, get_entry, &db->select_entry);
 
     const char get_snippet[] = "SELECT snippet FROM clipboard_history"
                                "   WHERE history_id = ?1;";
-    prepare_statement(db, get_snippet, &select_snippet);
+    prepare_statement(db, get_snippet, &db->select_snippet);
 
     const char get_thumbnail[] = "SELECT thumbnail FROM clipboard_history"
                                  "   WHERE history_id = ?1;";
-    prepare_statement(db, get_thumbnail, &select_thumbnail);
+    prepare_statement(db, get_thumbnail, &db->select_thumbnail);
 
     const char get_total_entries[] =
         "SELECT COUNT(history_id) FROM clipboard_history;";
-    prepare_statement(db, get_total_entries, &total_entries);
-
-    const char find_entry[] = "SELECT DISTINCT entry FROM content"
-                              "    WHERE data LIKE '%' || ?1 || '%'"
-                              "    ORDER BY entry DESC;";
-    prepare_statement(db, find_entry, &find_matching_entries);
-
-    const char find_entry_type[] = "SELECT DISTINCT entry FROM content"
-                                   "    WHERE mime_type LIKE '%' || ?1 || '%'"
-                                   "    ORDER BY entry DESC;";
-    prepare_statement(db, find_entry_type, &find_matching_types);
+    prepare_statement(db, get_total_entries, &db->total_entries);
 
     const char find_entry_snippet[] = "SELECT history_id FROM clipboard_history"
                                       "    WHERE snippet=?1;";
-    prepare_statement(db, find_entry_snippet, &find_entry_from_snippet);
-
-    const char find_entry_glob[] = "SELECT DISTINCT entry FROM content"
-                                   "    WHERE data GLOB ?1"
-                                   "    ORDER BY entry DESC;";
-    prepare_statement(db, find_entry_glob, &find_matching_entries_glob);
+    prepare_statement(db, find_entry_snippet, &db->find_entry_from_snippet);
+
+    /* Only looks at the short snippets so it's quick enough to show results
+     * straight away, before the full text has been searched */
+    const char find_snippet[] = "SELECT history_id FROM clipboard_history"
+                                "    WHERE snippet LIKE '%' || ?1 || '%'"
+                                "    ORDER BY history_id DESC;";
+    prepare_statement(db, find_snippet, &db->find_matching_snippets);
+
+    /* Scan the search text a batch of entries at a time, returning every row
+     * looked at so the caller knows where to continue from. The text is
+     * only returned for matches, and only read if the filter can't rule the
+     * entry out */
+    const char scan_entry[] =
+        "SELECT search_text.entry,"
+        "       CASE WHEN trigram_match(filter, ?1)"
+        "                 AND text LIKE '%' || ?1 || '%'"
+        "            THEN text END"
+        "    FROM search_text"
+        "    LEFT JOIN search_filter ON search_filter.entry = search_text.entry"
+        "    WHERE search_text.entry < ?2"
+        "    ORDER BY search_text.entry DESC LIMIT ?3;";
+    prepare_statement(db, scan_entry, &db->scan_matching_entries);
+
+    const char scan_entry_glob[] =
+        "SELECT entry, CASE WHEN text GLOB ?1 THEN text END"
+        "    FROM search_text WHERE entry < ?2"
+        "    ORDER BY entry DESC LIMIT ?3;";
+    prepare_statement(db, scan_entry_glob, &db->scan_matching_entries_glob);
+
+    const char scan_entry_regex[] =
+        "SELECT entry, CASE WHEN text REGEXP ?1 THEN text END"
+        "    FROM search_text WHERE entry < ?2"
+        "    ORDER BY entry DESC LIMIT ?3;";
+    prepare_statement(db, scan_entry_regex, &db->scan_matching_entries_regex);
 
     const char remove_entry[] = "DELETE FROM clipboard_history"
                                 "    WHERE history_id = ?1;";
-    prepare_statement(db, remove_entry, &delete_entry);
+    prepare_statement(db, remove_entry, &db->delete_entry);
 
     const char remove_old_entry[] =
         "DELETE FROM clipboard_history"
         "    WHERE timestamp < (date('now', ? || ' days'));";
-    prepare_statement(db, remove_old_entry, &delete_old_entries);
+    prepare_statement(db, remove_old_entry, &db->delete_old_entries);
 
     const char remove_last_entries[] = "DELETE FROM clipboard_history"
                                        "    WHERE history_id IN("
@@ -208,7 +593,7 @@ static void prepare_all_statements(sqlite3 *db)
                                        "            FROM clipboard_history"
                                        "            ORDER BY timestamp DESC"
                                        "            LIMIT ?1);";
-    prepare_statement(db, remove_last_entries, &delete_last_entries);
+    prepare_statement(db, remove_last_entries, &db->delete_last_entries);
 
     const char remove_duplicates[] = "DELETE FROM clipboard_history"
                                      "    WHERE history_id NOT IN("
@@ -217,7 +602,7 @@ static void prepare_all_statements(sqlite3 *db)
                                      "            GROUP BY hash"
                                      "        ORDER BY timestamp DESC"
                                      "    );";
-    prepare_statement(db, remove_duplicates, &delete_duplicate_entries);
+    prepare_statement(db, remove_duplicates, &db->delete_duplicate_entries);
 
     const char remove_large_entries[] =
         "DELETE FROM clipboard_history"
@@ -225,10 +610,173 @@ static void prepare_all_statements(sqlite3 *db)
         "        SELECT DISTINCT entry FROM content"
         "            ORDER BY length DESC"
         "            LIMIT ?1);";
-    prepare_statement(db, remove_large_entries, &delete_large_entries);
+    prepare_statement(db, remove_large_entries, &db->delete_large_entries);
 
     const char remove_all_entries[] = "DELETE FROM clipboard_history;";
-    prepare_statement(db, remove_all_entries, &delete_all_entries);
+    prepare_statement(db, remove_all_entries, &db->delete_all_entries);
+
+    const char add_dictionary[] = "INSERT INTO dictionary (last_entry, data)"
+                                  "    VALUES             (?1,         ?2);";
+    prepare_statement(db, add_dictionary, &db->insert_dictionary);
+
+    const char get_dictionary[] = "SELECT data FROM dictionary"
+                                  "    WHERE dict_id = ?1;";
+    prepare_statement(db, get_dictionary, &db->select_dictionary);
+
+    const char get_latest_dictionary[] =
+        "SELECT dict_id, last_entry, data FROM dictionary"
+        "    ORDER BY dict_id DESC"
+        "    LIMIT 1;";
+    prepare_statement(db, get_latest_dictionary, &db->select_latest_dictionary);
+
+    /* Only take one text type per entry, they're usually the same data */
+    const char get_dictionary_samples[] =
+        "SELECT entry, data, encoding, dictionary, length FROM content"
+        "    WHERE encoding = 2"
+        "       OR (encoding = 0 AND length >= 64 AND"
+        "           (mime_type LIKE 'text/%' OR mime_type = 'UTF8_STRING'))"
+        "    GROUP BY entry"
+        "    ORDER BY entry DESC"
+        "    LIMIT ?1;";
+    prepare_statement(db, get_dictionary_samples,
+                      &db->select_dictionary_samples);
+
+    const char count_new_samples[] = "SELECT COUNT(DISTINCT entry) FROM content"
+                                     "    WHERE encoding = 2 AND entry > ?1;";
+    prepare_statement(db, count_new_samples, &db->count_undictionaried_entries);
+
+    const char remove_unused_dictionaries[] =
+        "DELETE FROM dictionary"
+        "    WHERE dict_id != (SELECT MAX(dict_id) FROM dictionary)"
+        "      AND dict_id NOT IN ("
+        "          SELECT DISTINCT dictionary FROM content"
+        "              WHERE dictionary IS NOT NULL);";
+    prepare_statement(db, remove_unused_dictionaries,
+                      &db->delete_unused_dictionaries);
+
+    /* Oldest entries first so the job can resume where it left off */
+    const char get_cold_content[] =
+        "SELECT content.rowid, data, encoding, dictionary, length, mime_type"
+        "    FROM content INDEXED BY cold_index"
+        "    JOIN clipboard_history ON history_id = entry"
+        "    WHERE cold = 0"
+        "      AND timestamp < datetime('now', ?1 || ' days')"
+        "    ORDER BY entry"
+        "    LIMIT ?2;";
+    prepare_statement(db, get_cold_content, &db->select_cold_content);
+
+    /* A NULL data binding leaves the data as is */
+    const char set_cold_content[] = "UPDATE content"
+                                    "    SET data = COALESCE(?1, data),"
+                                    "        encoding = ?2,"
+                                    "        dictionary = ?3,"
+                                    "        length = ?5,"
+                                    "        cold = 1"
+                                    "    WHERE rowid = ?4;";
+    prepare_statement(db, set_cold_content, &db->update_cold_content);
+
+    const char add_chunk[] =
+        "INSERT INTO chunk (hash, length, encoding, data)"
+        "    VALUES        (?1,   ?2,     ?3,       ?4);";
+    prepare_statement(db, add_chunk, &db->insert_chunk);
+
+    const char add_chunk_ref[] = "INSERT INTO chunk_ref (entry, chunk)"
+                                 "    VALUES            (?1,    ?2);";
+    prepare_statement(db, add_chunk_ref, &db->insert_chunk_ref);
+
+    const char get_chunk_from_hash[] =
+        "SELECT chunk_id, length, encoding, data FROM chunk"
+        "    WHERE hash = ?1;";
+    prepare_statement(db, get_chunk_from_hash, &db->find_chunk);
+
+    const char get_chunk[] = "SELECT length, encoding, data FROM chunk"
+                             "    WHERE chunk_id = ?1;";
+    prepare_statement(db, get_chunk, &db->select_chunk);
+
+    const char add_search_text[] = "INSERT INTO search_text (entry, text)"
+                                   "    VALUES              (?1,    ?2);";
+    prepare_statement(db, add_search_text, &db->insert_search_text);
+
+    const char add_search_filter[] =
+        "INSERT OR REPLACE INTO search_filter (entry, filter)"
+        "    VALUES                           (?1,    ?2);";
+    prepare_statement(db, add_search_filter, &db->insert_search_filter);
+
+    /* Entries saved before search text was extracted at capture time */
+    const char get_unindexed_entries[] =
+        "SELECT history_id FROM clipboard_history"
+        "    WHERE history_id NOT IN (SELECT entry FROM search_text)"
+        "    ORDER BY history_id DESC"
+        "    LIMIT ?1;";
+    prepare_statement(db, get_unindexed_entries, &db->select_unindexed_entries);
+
+    const char get_all_search_text[] = "SELECT entry, text FROM search_text"
+                                       "    WHERE text != ''"
+                                       "    ORDER BY entry;";
+    prepare_statement(db, get_all_search_text, &db->select_all_search_text);
+
+    /* Changes when another connection commits to the database */
+    const char get_data_version[] = "PRAGMA data_version;";
+    prepare_statement(db, get_data_version, &db->select_data_version);
+
+    const char get_usage[] = "SELECT uses, score FROM usage"
+                             "    WHERE entry = ?1;";
+    prepare_statement(db, get_usage, &db->select_usage);
+
+    /* Copying an entry again saves it as a new entry and deletes the old
+     * one, which takes its usage with it */
+    const char get_usage_from_hash[] =
+        "SELECT uses, score FROM usage"
+        "    JOIN clipboard_history ON history_id = entry"
+        "    WHERE hash = ?1"
+        "    ORDER BY entry DESC"
+        "    LIMIT 1;";
+    prepare_statement(db, get_usage_from_hash, &db->select_usage_from_hash);
+
+    /* The entry may have been deleted since it was used */
+    const char set_usage[] =
+        "INSERT OR REPLACE INTO usage (entry, uses, score)"
+        "    SELECT ?1, ?2, ?3"
+        "    WHERE EXISTS (SELECT 1 FROM clipboard_history"
+        "                      WHERE history_id = ?1);";
+    prepare_statement(db, set_usage, &db->replace_usage);
+
+    /* Everything kapd keeps in memory to answer searches without the
+     * database, the types are separated by newlines */
+    const char get_index_entries[] =
+        "SELECT history_id, timestamp, snippet, search_text.text,"
+        "       (SELECT group_concat(mime_type, char(10)) FROM content"
+        "            WHERE content.entry = history_id),"
+        "       (SELECT MAX(length) FROM content"
+        "            WHERE content.entry = history_id)"
+        "    FROM clipboard_history"
+        "    LEFT JOIN search_text ON search_text.entry = history_id"
+        "    WHERE history_id > ?1"
+        "    ORDER BY history_id;";
+    prepare_statement(db, get_index_entries, &db->select_index_entries);
+
+    const char get_search_text[] = "SELECT text FROM search_text"
+                                   "    WHERE entry = ?1;";
+    prepare_statement(db, get_search_text, &db->select_search_text);
+
+    const char get_frecent_entries[] = "SELECT entry FROM usage"
+                                       "    ORDER BY score DESC"
+                                       "    LIMIT ?1 OFFSET ?2;";
+    prepare_statement(db, get_frecent_entries, &db->select_frecent_entries);
+
+    const char renew_entry[] =
+        "INSERT INTO clipboard_history (snippet, thumbnail, hash)"
+        "    SELECT snippet, thumbnail, hash FROM clipboard_history"
+        "        WHERE history_id = ?1;";
+    prepare_statement(db, renew_entry, &db->insert_renewed_entry);
+
+    for (int i = 0; i < NUMBER_OF_ENTRY_TABLES; i++)
+    {
+        char move_rows[64];
+        snprintf(move_rows, sizeof(move_rows),
+                 "UPDATE %s SET entry = ?2 WHERE entry = ?1;", entry_tables[i]);
+        prepare_statement(db, move_rows, &db->move_entry_rows[i]);
+    }
 }
 
 static int execute_statement(sqlite3_stmt *stmt)
@@ -265,6 +813,12 @@ static void bind_statement(sqlite3_stmt *stmt, uint16_t literal, void *data,
     case INT:
         ret = sqlite3_bind_int(stmt, literal, *(int *)data);
         break;
+    case INT64:
+        ret = sqlite3_bind_int64(stmt, literal, *(int64_t *)data);
+        break;
+    case DOUBLE:
+        ret = sqlite3_bind_double(stmt, literal, *(double *)data);
+        break;
     case BLOB:
         ret = sqlite3_bind_blob64(stmt, literal, data, length, SQLITE_STATIC);
         break;
@@ -281,448 +835,2348 @@ static void bind_statement(sqlite3_stmt *stmt, uint16_t literal, void *data,
     }
 }
 
-void database_delete_entry(sqlite3 *db, int64_t id)
+/* Dictionaries are only ever needed for a few entries at a time so they're
+ * kept in a small LRU cache instead of all being loaded */
+static ZSTD_DDict *find_dictionary(struct database *db, int64_t id)
 {
-    bind_statement(delete_entry, ID_BINDING, &id, 0, INT);
-    execute_statement(delete_entry);
-
-    sqlite3_reset(delete_entry);
-    sqlite3_clear_bindings(delete_entry);
-}
-
-uint32_t database_delete_duplicate_entries(sqlite3 *db)
-{
-    execute_statement(delete_duplicate_entries);
-    sqlite3_reset(delete_duplicate_entries);
-
-    return sqlite3_changes(db);
-}
+    struct loaded_dictionary *slot = &db->loaded_dictionaries[0];
+    int num_of_slots =
+        sizeof(db->loaded_dictionaries) / sizeof(db->loaded_dictionaries[0]);
+    for (int i = 0; i < num_of_slots; i++)
+    {
+        if (db->loaded_dictionaries[i].ddict &&
+            db->loaded_dictionaries[i].id == id)
+        {
+            db->loaded_dictionaries[i].last_used = ++db->dictionary_clock;
+            return db->loaded_dictionaries[i].ddict;
+        }
+        if (db->loaded_dictionaries[i].last_used < slot->last_used)
+        {
+            slot = &db->loaded_dictionaries[i];
+        }
+    }
 
-uint32_t database_delete_old_entries(sqlite3 *db, int32_t days)
-{
-    bind_statement(delete_old_entries, DATE_BINDING, &days, 0, INT);
-    execute_statement(delete_old_entries);
-    sqlite3_reset(delete_old_entries);
-    sqlite3_clear_bindings(delete_old_entries);
+    ZSTD_DDict *ddict = NULL;
+    bind_statement(db->select_dictionary, ID_BINDING, &id, 0, INT);
+    if (execute_statement(db->select_dictionary) != SQLITE_DONE)
+    {
+        ddict =
+            ZSTD_createDDict(sqlite3_column_blob(db->select_dictionary, 0),
+                             sqlite3_column_bytes(db->select_dictionary, 0));
+    }
+    sqlite3_reset(db->select_dictionary);
+    sqlite3_clear_bindings(db->select_dictionary);
 
-    return sqlite3_changes(db);
-}
+    if (!ddict)
+    {
+        fprintf(stderr, "Missing compression dictionary %ld\n", id);
+        return NULL;
+    }
 
-uint32_t database_delete_last_entries(sqlite3 *db, uint32_t num_of_entries)
-{
-    bind_statement(delete_last_entries, ENTRY_BINDING, &num_of_entries, 0, INT);
-    execute_statement(delete_last_entries);
-    sqlite3_reset(delete_last_entries);
-    sqlite3_clear_bindings(delete_last_entries);
+    if (slot->ddict)
+    {
+        ZSTD_freeDDict(slot->ddict);
+    }
+    slot->id = id;
+    slot->ddict = ddict;
+    slot->last_used = ++db->dictionary_clock;
 
-    return sqlite3_changes(db);
+    return ddict;
 }
 
-uint32_t database_delete_largest_entries(sqlite3 *db, uint32_t num_of_entries)
+static void load_current_dictionary(struct database *db)
 {
-    bind_statement(delete_large_entries, ENTRY_BINDING, &num_of_entries, 0,
-                   INT);
-    execute_statement(delete_large_entries);
-    sqlite3_reset(delete_large_entries);
-    sqlite3_clear_bindings(delete_large_entries);
-
-    /* Get number of changes before we vacuum */
-    int ret = sqlite3_changes(db);
-
-    sqlite3_exec(db, "VACUUM;", NULL, NULL, NULL);
-
-    return ret;
+    if (execute_statement(db->select_latest_dictionary) != SQLITE_DONE)
+    {
+        if (db->current_dictionary)
+        {
+            ZSTD_freeCDict(db->current_dictionary);
+        }
+        db->current_dictionary_id =
+            sqlite3_column_int64(db->select_latest_dictionary, 0);
+        db->current_dictionary_last_entry =
+            sqlite3_column_int64(db->select_latest_dictionary, 1);
+        db->current_dictionary = ZSTD_createCDict(
+            sqlite3_column_blob(db->select_latest_dictionary, 2),
+            sqlite3_column_bytes(db->select_latest_dictionary, 2),
+            ZSTD_CLEVEL_DEFAULT);
+    }
+    sqlite3_reset(db->select_latest_dictionary);
 }
 
-void database_insert_entry(sqlite3 *db, source_buffer *src)
+/* Returns NULL if compressing the data isn't worth it */
+static void *compress_data(struct database *db, const void *data, size_t len,
+                           size_t *compressed_len)
 {
-    bind_statement(insert_entry, SNIPPET_BINDING, src->snippet,
-                   strlen(src->snippet), TEXT);
-    bind_statement(insert_entry, THUMBNAIL_BINDING, src->thumbnail,
-                   src->thumbnail_len, BLOB);
-    bind_statement(insert_entry, HASH_BINDING, src->data_hash,
-                   strlen(src->data_hash), TEXT);
-
-    execute_statement(insert_entry);
+    size_t bound = ZSTD_compressBound(len);
+    void *compressed = xmalloc(bound);
 
-    sqlite3_reset(insert_entry);
-    sqlite3_clear_bindings(insert_entry);
-
-    uint32_t rowid = sqlite3_last_insert_rowid(db);
-    for (int i = 0; i < src->num_types; i++)
+    size_t ret;
+    if (db->current_dictionary)
     {
-        bind_statement(insert_entry_content, ENTRY_BINDING, &rowid, 0, INT);
-        bind_statement(insert_entry_content, LENGTH_BINDING, &src->len[i], 0,
-                       INT);
-        bind_statement(insert_entry_content, DATA_BINDING, src->data[i],
-                       src->len[i], BLOB);
-        bind_statement(insert_entry_content, MIME_TYPE_BINDING, src->types[i],
-                       strlen(src->types[i]), TEXT);
-
-        execute_statement(insert_entry_content);
+        ret = ZSTD_compress_usingCDict(db->compress_context, compressed, bound,
+                                       data, len, db->current_dictionary);
+    }
+    else
+    {
+        ret = ZSTD_compressCCtx(db->compress_context, compressed, bound, data,
+                                len, ZSTD_CLEVEL_DEFAULT);
+    }
 
-        sqlite3_reset(insert_entry_content);
-        sqlite3_clear_bindings(insert_entry_content);
+    if (ZSTD_isError(ret) || ret >= len)
+    {
+        free(compressed);
+        return NULL;
     }
 
-    database_delete_duplicate_entries(db);
+    *compressed_len = ret;
+    return compressed;
 }
-uint32_t database_find_matching_entries(sqlite3 *db, void *match, size_t length,
-                                        uint32_t num_of_entries,
-                                        int64_t *list_of_ids,
-                                        enum search_type type)
-{
-    sqlite3_stmt *search;
 
-    if (type == MIME_TYPE)
-    {
-        search = find_matching_types;
-    }
-    else if (type == CONTENT)
+/* The original length is stored alongside the data so the frame can be
+ * decompressed straight into a buffer of the right size */
+static void *decompress_data(struct database *db, const void *data,
+                             size_t compressed_len, int64_t dictionary,
+                             size_t len)
+{
+    ZSTD_DDict *ddict = NULL;
+    if (dictionary)
     {
-        search = find_matching_entries;
+        ddict = find_dictionary(db, dictionary);
+        if (!ddict)
+        {
+            return NULL;
+        }
     }
-    else if (type == GLOB)
+
+    void *decompressed = xmalloc(len);
+    size_t ret;
+    if (ddict)
     {
-        search = find_matching_entries_glob;
+        ret = ZSTD_decompress_usingDDict(db->decompress_context, decompressed,
+                                         len, data, compressed_len, ddict);
     }
     else
     {
-        fprintf(stderr, "Invalid search type\n");
-        exit(EXIT_FAILURE);
+        ret = ZSTD_decompressDCtx(db->decompress_context, decompressed, len,
+                                  data, compressed_len);
     }
 
-    bind_statement(search, MATCH_BINDING, match, length, BLOB);
-
-    int counter = 0;
-    while (execute_statement(search) != SQLITE_DONE)
+    if (ZSTD_isError(ret) || ret != len)
     {
-        list_of_ids[counter] = sqlite3_column_int(search, 0);
-        counter++;
-        if (counter >= num_of_entries)
-        {
-            break;
-        }
+        fprintf(stderr, "Failed to decompress entry: %s\n",
+                ZSTD_isError(ret) ? ZSTD_getErrorName(ret) : "bad length");
+        free(decompressed);
+        return NULL;
     }
 
-    sqlite3_reset(search);
-    sqlite3_clear_bindings(search);
-
-    return counter;
+    return decompressed;
 }
 
-int64_t database_find_entry_from_snippet(sqlite3 *db, char *snippet,
-                                         size_t length)
+/* Decodes a chunk into a buffer of exactly its length */
+static bool decode_chunk(struct database *db, int encoding, const void *blob,
+                         size_t blob_len, void *buffer, size_t len)
 {
-    bind_statement(find_entry_from_snippet, MATCH_BINDING, snippet, length,
-                   TEXT);
-
-    int64_t id = 0;
-    if (execute_statement(find_entry_from_snippet) != SQLITE_DONE)
+    if (encoding == ENCODING_ZSTD)
     {
-        id = sqlite3_column_int(find_entry_from_snippet, 0);
+        size_t ret = ZSTD_decompressDCtx(db->decompress_context, buffer, len,
+                                         blob, blob_len);
+        return !ZSTD_isError(ret) && ret == len;
     }
 
-    sqlite3_reset(find_entry_from_snippet);
-    sqlite3_clear_bindings(find_entry_from_snippet);
-
-    return id;
+    if (blob_len != len)
+    {
+        return false;
+    }
+    memcpy(buffer, blob, len);
+    return true;
 }
 
-uint64_t database_get_size(sqlite3 *db)
+/* Returns the id of a stored chunk with the same data, adding it if there
+ * isn't one. The hash only narrows down the candidates, the data is still
+ * compared before a chunk is shared */
+static int64_t store_chunk(struct database *db, const void *data, size_t len,
+                           bool compress)
 {
-    execute_statement(select_size);
-    uint64_t size = sqlite3_column_int(select_size, 0);
-    sqlite3_reset(select_size);
+    int64_t hash = (int64_t)XXH3_64bits(data, len);
+    int64_t id = 0;
+    void *candidate = NULL;
 
-    return size;
-}
+    bind_statement(db->find_chunk, ID_BINDING, &hash, 0, INT64);
+    while (!id && execute_statement(db->find_chunk) != SQLITE_DONE)
+    {
+        if ((size_t)sqlite3_column_int64(db->find_chunk, 1) != len)
+        {
+            continue;
+        }
 
-uint32_t database_get_latest_entries(sqlite3 *db, uint32_t num_of_entries,
-                                     uint32_t offset, int64_t *list_of_ids)
-{
-    bind_statement(select_latest_entries, ENTRY_BINDING, &num_of_entries, 0,
-                   INT);
-    bind_statement(select_latest_entries, LENGTH_BINDING, &offset, 0, INT);
+        candidate = candidate ? candidate : xmalloc(len);
+        if (decode_chunk(db, sqlite3_column_int(db->find_chunk, 2),
+                         sqlite3_column_blob(db->find_chunk, 3),
+                         sqlite3_column_bytes(db->find_chunk, 3), candidate,
+                         len) &&
+            !memcmp(candidate, data, len))
+        {
+            id = sqlite3_column_int64(db->find_chunk, 0);
+        }
+    }
+    sqlite3_reset(db->find_chunk);
+    sqlite3_clear_bindings(db->find_chunk);
+    free(candidate);
 
-    int counter = 0;
-    while (execute_statement(select_latest_entries) != SQLITE_DONE)
+    if (id)
     {
-        list_of_ids[counter] = sqlite3_column_int(select_latest_entries, 0);
-        counter++;
+        return id;
     }
 
-    sqlite3_reset(select_latest_entries);
-    sqlite3_clear_bindings(select_latest_entries);
+    int encoding = ENCODING_RAW;
+    const void *blob = data;
+    size_t blob_len = len;
+    void *compressed = NULL;
+    if (compress)
+    {
+        size_t bound = ZSTD_compressBound(len);
+        compressed = xmalloc(bound);
+        size_t ret = ZSTD_compressCCtx(db->compress_context, compressed, bound,
+                                       data, len, ZSTD_CLEVEL_DEFAULT);
+        if (!ZSTD_isError(ret) && ret < len)
+        {
+            encoding = ENCODING_ZSTD;
+            blob = compressed;
+            blob_len = ret;
+        }
+    }
 
-    return counter;
+    bind_statement(db->insert_chunk, CHUNK_HASH_BINDING, &hash, 0, INT64);
+    bind_statement(db->insert_chunk, CHUNK_LENGTH_BINDING, &len, 0, INT);
+    bind_statement(db->insert_chunk, CHUNK_ENCODING_BINDING, &encoding, 0, INT);
+    bind_statement(db->insert_chunk, CHUNK_DATA_BINDING, (void *)blob, blob_len,
+                   BLOB);
+    execute_statement(db->insert_chunk);
+    sqlite3_reset(db->insert_chunk);
+    sqlite3_clear_bindings(db->insert_chunk);
+    free(compressed);
+
+    return sqlite3_last_insert_rowid(db->conn);
 }
 
-uint32_t database_get_total_entries(sqlite3 *db)
+/* Splits the data into content-defined chunks and stores the ones that
+ * aren't in the database yet, returns the list of chunk ids */
+static void *write_chunked_data(struct database *db, int64_t entry,
+                                const char *mime_type, const uint8_t *data,
+                                size_t len, size_t *list_len)
 {
-    int ret = execute_statement(total_entries);
-    if (ret == SQLITE_DONE)
+    /* Every chunk but the last is at least MIN_CHUNK_LENGTH long */
+    uint8_t *list = xmalloc((len / MIN_CHUNK_LENGTH + 1) * sizeof(int64_t));
+    /* Images are already compressed */
+    bool compress = strncmp(mime_type, "image/", strlen("image/"));
+    size_t num_of_chunks = 0, offset = 0;
+
+    while (offset < len)
     {
-        return 0;
-    }
+        size_t chunk_len = find_chunk_boundary(data + offset, len - offset);
+        int64_t id = store_chunk(db, data + offset, chunk_len, compress);
 
-    uint32_t total = sqlite3_column_int(total_entries, 0);
-    sqlite3_reset(total_entries);
+        for (int i = 0; i < sizeof(int64_t); i++)
+        {
+            list[num_of_chunks * sizeof(int64_t) + i] = (uint64_t)id >> (i * 8);
+        }
 
-    return total;
+        bind_statement(db->insert_chunk_ref, CHUNK_REF_ENTRY_BINDING, &entry, 0,
+                       INT64);
+        bind_statement(db->insert_chunk_ref, CHUNK_REF_CHUNK_BINDING, &id, 0,
+                       INT64);
+        execute_statement(db->insert_chunk_ref);
+        sqlite3_reset(db->insert_chunk_ref);
+        sqlite3_clear_bindings(db->insert_chunk_ref);
+
+        num_of_chunks++;
+        offset += chunk_len;
+    }
+
+    *list_len = num_of_chunks * sizeof(int64_t);
+    return list;
 }
 
-char *database_get_snippet(sqlite3 *db, int64_t id)
+/* Each chunk is decoded straight into its place in the output, so only the
+ * reassembled data is ever held in memory */
+static void *read_chunked_data(struct database *db, const uint8_t *list,
+                               size_t list_len, size_t len)
 {
-    bind_statement(select_snippet, ID_BINDING, &id, 0, INT);
-    int ret = execute_statement(select_snippet);
-    if (ret == SQLITE_DONE)
+    uint8_t *data = xmalloc(len ? len : 1);
+    size_t offset = 0;
+    bool failed = false;
+
+    for (size_t i = 0; i + sizeof(int64_t) <= list_len && !failed;
+         i += sizeof(int64_t))
     {
-        sqlite3_reset(select_snippet);
-        sqlite3_clear_bindings(select_snippet);
-        return NULL;
+        uint64_t id = 0;
+        for (int j = 0; j < sizeof(int64_t); j++)
+        {
+            id |= (uint64_t)list[i + j] << (j * 8);
+        }
+
+        bind_statement(db->select_chunk, ID_BINDING, &id, 0, INT64);
+        failed = execute_statement(db->select_chunk) == SQLITE_DONE;
+        if (!failed)
+        {
+            size_t chunk_len = sqlite3_column_int64(db->select_chunk, 0);
+            failed = chunk_len > len - offset ||
+                     !decode_chunk(db, sqlite3_column_int(db->select_chunk, 1),
+                                   sqlite3_column_blob(db->select_chunk, 2),
+                                   sqlite3_column_bytes(db->select_chunk, 2),
+                                   data + offset, chunk_len);
+            offset += chunk_len;
+        }
+        sqlite3_reset(db->select_chunk);
+        sqlite3_clear_bindings(db->select_chunk);
     }
 
-    const char *tmp_snippet =
-        (char *)sqlite3_column_text(select_snippet, (SNIPPET_BINDING - 1));
-    if (!tmp_snippet)
+    if (failed || offset != len)
     {
-        perror("Failed to allocate memory");
-        exit(EXIT_FAILURE);
+        fprintf(stderr, "Failed to reassemble entry from its chunks\n");
+        free(data);
+        return NULL;
     }
-    char *snippet = xstrdup(tmp_snippet);
 
-    sqlite3_reset(select_snippet);
-    sqlite3_clear_bindings(select_snippet);
+    return data;
+}
 
-    return snippet;
+static bool is_search_cancelled(void)
+{
+    return search_cancelled && atomic_load(search_cancelled);
 }
 
-void *database_get_thumbnail(sqlite3 *db, int64_t id, size_t *len)
+/* Interrupts whatever statement the thread is running, which returns
+ * SQLITE_INTERRUPT */
+static int check_search_cancelled(void *user_data)
 {
-    bind_statement(select_thumbnail, ID_BINDING, &id, 0, INT);
-    execute_statement(select_thumbnail);
+    return is_search_cancelled();
+}
 
-    const void *tmp_blob = sqlite3_column_blob(select_thumbnail, 0);
-    *len = sqlite3_column_bytes(select_thumbnail, 0);
-    void *thumbnail = xmalloc(*len);
-    thumbnail = memcpy(thumbnail, tmp_blob, *len);
+void database_set_search_cancellation(const atomic_bool *cancelled)
+{
+    search_cancelled = cancelled;
+}
 
-    sqlite3_reset(select_thumbnail);
-    sqlite3_clear_bindings(select_thumbnail);
+struct compiled_regex
+{
+    pcre2_code *code;
+    pcre2_match_data *match_data;
+};
 
-    return thumbnail;
+static void free_compiled_regex(void *data)
+{
+    struct compiled_regex *regex = data;
+    pcre2_match_data_free(regex->match_data);
+    pcre2_code_free(regex->code);
+    free(regex);
 }
 
-bool database_get_entry(sqlite3 *db, int64_t id, source_buffer *src)
+/* The search text is already case folded, but the pattern may not be */
+static pcre2_code *compile_regex(const char *pattern, size_t len,
+                                 char *error, size_t error_len)
 {
-    src->snippet = database_get_snippet(db, id);
-    if (!src->snippet)
+    int error_code;
+    PCRE2_SIZE error_offset;
+    pcre2_code *code = pcre2_compile(
+        (PCRE2_SPTR)pattern, len,
+        PCRE2_UTF | PCRE2_MATCH_INVALID_UTF | PCRE2_CASELESS, &error_code,
+        &error_offset, NULL);
+    if (!code)
     {
-        return false;
+        pcre2_get_error_message(error_code, (PCRE2_UCHAR *)error, error_len);
+        return NULL;
     }
 
-    src->thumbnail = database_get_thumbnail(db, id, &src->thumbnail_len);
+    /* Falls back to the interpreter if JIT isn't available */
+    pcre2_jit_compile(code, PCRE2_JIT_COMPLETE);
+    return code;
+}
 
-    bind_statement(select_entry, ID_BINDING, &id, 0, INT);
-    while (execute_statement(select_entry) != SQLITE_DONE &&
-           src->num_types < MAX_MIME_TYPES)
+/* regexp(pattern, text) is what SQLite calls for text REGEXP pattern. The
+ * compiled pattern is kept as auxiliary data, so it's only compiled once
+ * per statement while the pattern binding stays the same */
+static void regexp(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    struct compiled_regex *regex = sqlite3_get_auxdata(context, 0);
+    if (!regex)
     {
-        src->len[src->num_types] =
-            sqlite3_column_int(select_entry, (LENGTH_BINDING - 1));
-
-        const void *tmp_blob =
-            sqlite3_column_blob(select_entry, (DATA_BINDING - 1));
-        if (!tmp_blob)
+        char error[256];
+        pcre2_code *code = compile_regex(
+            (const char *)sqlite3_value_text(argv[0]),
+            sqlite3_value_bytes(argv[0]), error, sizeof(error));
+        if (!code)
         {
-            perror("Failed to allocate memory");
-            exit(EXIT_FAILURE);
+            sqlite3_result_error(context, error, -1);
+            return;
         }
-        src->data[src->num_types] = xmalloc(src->len[src->num_types]);
-        memcpy(src->data[src->num_types], tmp_blob, src->len[src->num_types]);
-
-        const char *tmp_text =
-            (char *)sqlite3_column_text(select_entry, (MIME_TYPE_BINDING - 1));
 
-        if (!tmp_text)
+        regex = xmalloc(sizeof(struct compiled_regex));
+        regex->code = code;
+        regex->match_data = pcre2_match_data_create_from_pattern(code, NULL);
+        sqlite3_set_auxdata(context, 0, regex, free_compiled_regex);
+        /* SQLite may have freed it straight away */
+        regex = sqlite3_get_auxdata(context, 0);
+        if (!regex)
         {
-            perror("Failed to allocate memory");
-            exit(EXIT_FAILURE);
+            sqlite3_result_error_nomem(context);
+            return;
         }
-        src->types[src->num_types] = xstrdup(tmp_text);
-
-        src->num_types++;
     }
 
-    sqlite3_reset(select_entry);
-    sqlite3_clear_bindings(select_entry);
+    /* A single match can take a while, so skip the rest once cancelled until
+     * the progress handler interrupts the statement */
+    const char *text = (const char *)sqlite3_value_text(argv[1]);
+    if (!text || is_search_cancelled())
+    {
+        sqlite3_result_int(context, 0);
+        return;
+    }
 
-    return true;
+    int ret = pcre2_match(regex->code, (PCRE2_SPTR)text,
+                          sqlite3_value_bytes(argv[1]), 0, 0,
+                          regex->match_data, NULL);
+    sqlite3_result_int(context, ret >= 0);
 }
 
-static void create_database_directory()
+/* trigram_filter(text) builds the filter stored for the text, NULL if it's
+ * too short to need one */
+static void trigram_filter(sqlite3_context *context, int argc,
+                           sqlite3_value **argv)
 {
-    char *data_home = getenv("XDG_DATA_HOME");
-    if (data_home)
-    {
-        char *dir = xmalloc(strlen(data_home) + strlen("/kaprica") + 1);
-        strcpy(dir, data_home);
-        strcat(dir, "/kaprica");
-        mkdir(dir, 0777);
-        free(dir);
-    }
-    else
+    const char *text = (const char *)sqlite3_value_text(argv[0]);
+    size_t len = sqlite3_value_bytes(argv[0]);
+    size_t size = trigram_filter_size(len);
+    if (!text || !size)
     {
-        data_home = getenv("HOME");
-        char *dir =
-            xmalloc(strlen(data_home) + strlen("/.local/share/kaprica") + 1);
-        strcpy(dir, data_home);
-        strcat(dir, "/.local/share/kaprica");
-        mkdir(dir, 0777);
-        free(dir);
+        sqlite3_result_null(context);
+        return;
     }
+
+    uint8_t *filter = xmalloc(size);
+    trigram_filter_build(text, len, filter, size);
+    sqlite3_result_blob(context, filter, size, free);
 }
 
-/* Find $XDG_DATA_HOME/kaprica/history.db or
- * $HOME/.local/share/kaprica/history.db */
-static char *find_database_path()
+/* trigram_match(filter, pattern) is false if the text the filter was built
+ * from can't contain the LIKE pattern, entries without a filter always pass */
+static void trigram_match(sqlite3_context *context, int argc,
+                          sqlite3_value **argv)
 {
-    create_database_directory();
-
-    char *data_path = NULL;
-    char *data_home = getenv("XDG_DATA_HOME");
-    if (data_home)
-    {
-        data_path =
-            xmalloc(strlen(data_home) + strlen("/kaprica/history.db") + 1);
-        strcpy(data_path, data_home);
-        strcat(data_path, "/kaprica/history.db");
-    }
-    else
+    const uint8_t *filter = sqlite3_value_blob(argv[0]);
+    size_t size = sqlite3_value_bytes(argv[0]);
+    const char *pattern = (const char *)sqlite3_value_text(argv[1]);
+    if (!filter || !pattern)
     {
-        data_home = getenv("HOME");
-        data_path = xmalloc(strlen(data_home) +
-                            strlen("/.local/share/kaprica/history.db") + 1);
-        strcpy(data_path, data_home);
-        strcat(data_path, "/.local/share/kaprica/history.db");
+        sqlite3_result_int(context, 1);
+        return;
     }
 
-    return data_path;
+    size_t len = sqlite3_value_bytes(argv[1]);
+    sqlite3_result_int(context,
+                       trigram_filter_may_contain(filter, size, pattern, len));
 }
 
-/* Create a new database if one does not already exist */
-sqlite3 *database_init(char *filepath)
+/* Functions used by migrations and the prepared statements, must be
+ * registered before either of them */
+static void register_functions(struct database *db)
 {
-    filepath = (filepath != NULL) ? filepath : find_database_path();
+    sqlite3_create_function(db->conn, "regexp", 2,
+                            SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, regexp,
+                            NULL, NULL);
+    sqlite3_create_function(db->conn, "trigram_filter", 1,
+                            SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                            trigram_filter, NULL, NULL);
+    sqlite3_create_function(db->conn, "trigram_match", 2,
+                            SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                            trigram_match, NULL, NULL);
+    sqlite3_progress_handler(db->conn, CANCEL_CHECK_INTERVAL,
+                             check_search_cancelled, NULL);
+}
 
-    sqlite3 *db;
-    // Put database in a proper location, probably ~/.kaprica/history.db
-    sqlite3_open(filepath, &db);
-    if (!db)
+static void create_compression_contexts(struct database *db)
+{
+    db->compress_context = ZSTD_createCCtx();
+    db->decompress_context = ZSTD_createDCtx();
+    if (!db->compress_context || !db->decompress_context)
     {
-        fprintf(stderr, "Failed to create database: %s\n", sqlite3_errmsg(db));
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void database_set_chunk_threshold(struct database *db, size_t threshold)
+{
+    db->chunk_threshold = threshold;
+}
+
+void database_delete_entry(struct database *db, int64_t id)
+{
+    bind_statement(db->delete_entry, ID_BINDING, &id, 0, INT);
+    execute_statement(db->delete_entry);
+
+    sqlite3_reset(db->delete_entry);
+    sqlite3_clear_bindings(db->delete_entry);
+}
+
+uint32_t database_delete_duplicate_entries(struct database *db)
+{
+    execute_statement(db->delete_duplicate_entries);
+    sqlite3_reset(db->delete_duplicate_entries);
+
+    return sqlite3_changes(db->conn);
+}
+
+uint32_t database_delete_old_entries(struct database *db, int32_t days)
+{
+    bind_statement(db->delete_old_entries, DATE_BINDING, &days, 0, INT);
+    execute_statement(db->delete_old_entries);
+    sqlite3_reset(db->delete_old_entries);
+    sqlite3_clear_bindings(db->delete_old_entries);
+
+    return sqlite3_changes(db->conn);
+}
+
+uint32_t database_delete_last_entries(struct database *db,
+                                      uint32_t num_of_entries)
+{
+    bind_statement(db->delete_last_entries, ENTRY_BINDING, &num_of_entries, 0,
+                   INT);
+    execute_statement(db->delete_last_entries);
+    sqlite3_reset(db->delete_last_entries);
+    sqlite3_clear_bindings(db->delete_last_entries);
+
+    return sqlite3_changes(db->conn);
+}
+
+uint32_t database_delete_largest_entries(struct database *db,
+                                         uint32_t num_of_entries)
+{
+    bind_statement(db->delete_large_entries, ENTRY_BINDING, &num_of_entries, 0,
+                   INT);
+    execute_statement(db->delete_large_entries);
+    sqlite3_reset(db->delete_large_entries);
+    sqlite3_clear_bindings(db->delete_large_entries);
+
+    /* Get number of changes before we vacuum */
+    int ret = sqlite3_changes(db->conn);
+
+    sqlite3_exec(db->conn, "VACUUM;", NULL, NULL, NULL);
+
+    return ret;
+}
+
+/* Scores are the log2 of the sum of 2^(t / half-life) over the time t of
+ * every use. Older uses never have to be decayed since all scores would go
+ * down by the same amount, so the order is kept up to date by the index on
+ * the score alone */
+static double add_use(double score, int64_t uses)
+{
+    double now =
+        (double)time(NULL) / SECONDS_PER_DAY / FRECENCY_HALF_LIFE_DAYS;
+    if (!uses)
+    {
+        return now;
+    }
+
+    double high = fmax(score, now);
+    double low = fmin(score, now);
+    return high + log2(1 + exp2(low - high));
+}
+
+/* Counts a use of entry on top of the usage found by previous, which has
+ * its bindings set by the caller */
+static void record_use(struct database *db, sqlite3_stmt *previous,
+                       int64_t entry)
+{
+    int64_t uses = 0;
+    double score = 0;
+    if (execute_statement(previous) == SQLITE_ROW)
+    {
+        uses = sqlite3_column_int64(previous, 0);
+        score = sqlite3_column_double(previous, 1);
+    }
+    sqlite3_reset(previous);
+    sqlite3_clear_bindings(previous);
+
+    score = add_use(score, uses);
+    uses++;
+    bind_statement(db->replace_usage, USAGE_ENTRY_BINDING, &entry, 0, INT64);
+    bind_statement(db->replace_usage, USAGE_USES_BINDING, &uses, 0, INT64);
+    bind_statement(db->replace_usage, USAGE_SCORE_BINDING, &score, 0, DOUBLE);
+    execute_statement(db->replace_usage);
+    sqlite3_reset(db->replace_usage);
+    sqlite3_clear_bindings(db->replace_usage);
+}
+
+void database_record_use(struct database *db, int64_t id)
+{
+    bind_statement(db->select_usage, ID_BINDING, &id, 0, INT64);
+    record_use(db, db->select_usage, id);
+}
+
+/* The same as copying the entry again, it's moved to the top and counts as
+ * a use, except the data is kept as it is instead of being stored again */
+int64_t database_renew_entry(struct database *db, int64_t id)
+{
+    sqlite3_exec(db->conn, "BEGIN;", NULL, NULL, NULL);
+    bind_statement(db->insert_renewed_entry, ID_BINDING, &id, 0, INT64);
+    execute_statement(db->insert_renewed_entry);
+    sqlite3_reset(db->insert_renewed_entry);
+    sqlite3_clear_bindings(db->insert_renewed_entry);
+    if (!sqlite3_changes(db->conn))
+    {
+        sqlite3_exec(db->conn, "COMMIT;", NULL, NULL, NULL);
+        return 0;
+    }
+
+    int64_t renewed = sqlite3_last_insert_rowid(db->conn);
+    for (int i = 0; i < NUMBER_OF_ENTRY_TABLES; i++)
+    {
+        bind_statement(db->move_entry_rows[i], OLD_ENTRY_BINDING, &id, 0,
+                       INT64);
+        bind_statement(db->move_entry_rows[i], NEW_ENTRY_BINDING, &renewed, 0,
+                       INT64);
+        execute_statement(db->move_entry_rows[i]);
+        sqlite3_reset(db->move_entry_rows[i]);
+        sqlite3_clear_bindings(db->move_entry_rows[i]);
+    }
+    database_record_use(db, renewed);
+
+    /* Nothing references the old entry any more */
+    bind_statement(db->delete_entry, ID_BINDING, &id, 0, INT64);
+    execute_statement(db->delete_entry);
+    sqlite3_reset(db->delete_entry);
+    sqlite3_clear_bindings(db->delete_entry);
+    sqlite3_exec(db->conn, "COMMIT;", NULL, NULL, NULL);
+
+    return renewed;
+}
+
+/* Only long text gets a filter, a short one is quicker to search */
+static void insert_trigram_filter(struct database *db, int64_t entry,
+                                  const char *text)
+{
+    size_t len = strlen(text);
+    size_t size = trigram_filter_size(len);
+    if (!size)
+    {
+        return;
+    }
+
+    uint8_t *filter = xmalloc(size);
+    trigram_filter_build(text, len, filter, size);
+    bind_statement(db->insert_search_filter, ENTRY_BINDING, &entry, 0, INT64);
+    bind_statement(db->insert_search_filter, SEARCH_FILTER_BINDING, filter,
+                   size, BLOB);
+    execute_statement(db->insert_search_filter);
+    sqlite3_reset(db->insert_search_filter);
+    sqlite3_clear_bindings(db->insert_search_filter);
+    free(filter);
+}
+
+void database_insert_entry(struct database *db, source_buffer *src)
+{
+    bind_statement(db->insert_entry, SNIPPET_BINDING, src->snippet,
+                   strlen(src->snippet), TEXT);
+    bind_statement(db->insert_entry, THUMBNAIL_BINDING, src->thumbnail,
+                   src->thumbnail_len, BLOB);
+    bind_statement(db->insert_entry, HASH_BINDING, src->data_hash,
+                   strlen(src->data_hash), TEXT);
+
+    /* Committed as a whole, so readers never see an entry without its
+     * content, and a chunked entry can add hundreds of rows */
+    sqlite3_exec(db->conn, "BEGIN;", NULL, NULL, NULL);
+    execute_statement(db->insert_entry);
+
+    sqlite3_reset(db->insert_entry);
+    sqlite3_clear_bindings(db->insert_entry);
+
+    int64_t rowid = sqlite3_last_insert_rowid(db->conn);
+
+    /* Text is usually offered under several types with the same data, so
+     * the last compressed type is reused when the data matches */
+    void *compressed = NULL;
+    size_t compressed_len = 0;
+    int8_t compressed_type = -1;
+
+    for (int i = 0; i < src->num_types; i++)
+    {
+        /* Types dropped by collapse_image_types() are stored as an empty
+         * blob so the original list of types can still be offered */
+        int encoding = src->data[i] ? ENCODING_RAW : ENCODING_TRANSCODED;
+        void *data = src->data[i] ? src->data[i] : "";
+        size_t data_len = src->len[i];
+        void *chunk_list = NULL;
+
+        if (src->data[i] && db->chunk_threshold &&
+            src->len[i] >= db->chunk_threshold)
+        {
+            chunk_list = write_chunked_data(db, rowid, src->types[i],
+                                            src->data[i], src->len[i],
+                                            &data_len);
+            encoding = ENCODING_CHUNKED;
+            data = chunk_list;
+        }
+        else if (src->data[i] && src->len[i] >= MIN_COMPRESS_LENGTH &&
+                 is_text_type(src->types[i]))
+        {
+            if (compressed_type == -1 ||
+                src->len[i] != src->len[compressed_type] ||
+                memcmp(src->data[i], src->data[compressed_type],
+                       src->len[i]))
+            {
+                free(compressed);
+                compressed = compress_data(db, src->data[i], src->len[i],
+                                           &compressed_len);
+                compressed_type = i;
+            }
+            if (compressed)
+            {
+                encoding = ENCODING_ZSTD;
+                data = compressed;
+                data_len = compressed_len;
+            }
+        }
+
+        bind_statement(db->insert_entry_content, ENTRY_BINDING, &rowid, 0,
+                       INT64);
+        bind_statement(db->insert_entry_content, LENGTH_BINDING, &src->len[i],
+                       0, INT);
+        bind_statement(db->insert_entry_content, DATA_BINDING, data, data_len,
+                       BLOB);
+        bind_statement(db->insert_entry_content, MIME_TYPE_BINDING,
+                       src->types[i], strlen(src->types[i]), TEXT);
+        bind_statement(db->insert_entry_content, ENCODING_BINDING, &encoding, 0,
+                       INT);
+        if (encoding == ENCODING_ZSTD && db->current_dictionary)
+        {
+            bind_statement(db->insert_entry_content, DICTIONARY_BINDING,
+                           &db->current_dictionary_id, 0, INT);
+        }
+
+        execute_statement(db->insert_entry_content);
+
+        sqlite3_reset(db->insert_entry_content);
+        sqlite3_clear_bindings(db->insert_entry_content);
+        free(chunk_list);
+    }
+    /* Entries without any text still get a row so they aren't picked up
+     * by database_index_search_text() */
+    const char *search_text = src->search_text ? src->search_text : "";
+    bind_statement(db->insert_search_text, ENTRY_BINDING, &rowid, 0, INT64);
+    bind_statement(db->insert_search_text, SEARCH_TEXT_BINDING,
+                   (void *)search_text, strlen(search_text), TEXT);
+    execute_statement(db->insert_search_text);
+    sqlite3_reset(db->insert_search_text);
+    sqlite3_clear_bindings(db->insert_search_text);
+    insert_trigram_filter(db, rowid, search_text);
+
+    bind_statement(db->select_usage_from_hash, USAGE_HASH_BINDING,
+                   src->data_hash, strlen(src->data_hash), TEXT);
+    record_use(db, db->select_usage_from_hash, rowid);
+
+    sqlite3_exec(db->conn, "COMMIT;", NULL, NULL, NULL);
+    free(compressed);
+    src->id = rowid;
+
+    database_delete_duplicate_entries(db);
+}
+
+static int64_t get_data_version(struct database *db)
+{
+    execute_statement(db->select_data_version);
+    int64_t data_version = sqlite3_column_int64(db->select_data_version, 0);
+    sqlite3_reset(db->select_data_version);
+
+    return data_version;
+}
+
+int64_t database_get_data_version(struct database *db)
+{
+    return get_data_version(db);
+}
+
+/* Reloads the fuzzy search candidates if anything has changed since they
+ * were last loaded, by this connection or any other */
+static void load_fuzzy_candidates(struct database *db)
+{
+    struct fuzzy_candidates *candidates = &db->fuzzy_candidates;
+    int64_t data_version = get_data_version(db);
+    int64_t total_changes = sqlite3_total_changes64(db->conn);
+
+    if (candidates->loaded && candidates->data_version == data_version &&
+        candidates->total_changes == total_changes)
+    {
+        return;
+    }
+
+    int ret;
+    candidates->len = 0;
+    candidates->text_len = 0;
+    candidates->loaded = false;
+    while ((ret = execute_statement(db->select_all_search_text)) == SQLITE_ROW)
+    {
+        const void *text = sqlite3_column_text(db->select_all_search_text, 1);
+        size_t len = sqlite3_column_bytes(db->select_all_search_text, 1);
+        len = (len < MAX_FUZZY_TEXT_LENGTH) ? len : MAX_FUZZY_TEXT_LENGTH;
+
+        if (candidates->len == candidates->size)
+        {
+            candidates->size = candidates->size ? candidates->size * 2
+                                                : NUMBER_OF_CANDIDATES;
+            candidates->list =
+                xrealloc(candidates->list,
+                         sizeof(struct fuzzy_candidate) * candidates->size);
+        }
+        if (candidates->text_len + len > candidates->text_size)
+        {
+            candidates->text_size = (candidates->text_len + len) * 2;
+            candidates->text =
+                xrealloc(candidates->text, candidates->text_size);
+        }
+
+        struct fuzzy_candidate *candidate =
+            &candidates->list[candidates->len++];
+        candidate->id = sqlite3_column_int64(db->select_all_search_text, 0);
+        candidate->character_set = fuzzy_character_set(text, len);
+        candidate->offset = candidates->text_len;
+        candidate->len = len;
+        memcpy(candidates->text + candidates->text_len, text, len);
+        candidates->text_len += len;
+    }
+    sqlite3_reset(db->select_all_search_text);
+
+    /* Only part of them were loaded if the search was cancelled */
+    candidates->data_version = data_version;
+    candidates->total_changes = total_changes;
+    candidates->loaded = (ret == SQLITE_DONE);
+}
+
+static void free_fuzzy_candidates(struct database *db)
+{
+    free(db->fuzzy_candidates.list);
+    free(db->fuzzy_candidates.text);
+    memset(&db->fuzzy_candidates, 0, sizeof(db->fuzzy_candidates));
+}
+
+/* Keeps the best num_of_entries matches while going through every entry,
+ * 0 keeps all of them */
+static void find_fuzzy_matches(struct database *db, const char *pattern,
+                               uint32_t num_of_entries,
+                               struct fuzzy_results *results)
+{
+    load_fuzzy_candidates(db);
+
+    uint64_t character_set = fuzzy_character_set(pattern, strlen(pattern));
+    fuzzy_results_init(results, num_of_entries ? num_of_entries
+                                               : db->fuzzy_candidates.len);
+    for (uint32_t i = 0; i < db->fuzzy_candidates.len; i++)
+    {
+        if (i % CANCEL_CHECK_CANDIDATES == 0 && is_search_cancelled())
+        {
+            break;
+        }
+
+        struct fuzzy_candidate *candidate = &db->fuzzy_candidates.list[i];
+        if ((candidate->character_set & character_set) != character_set)
+        {
+            continue;
+        }
+
+        int32_t score =
+            fuzzy_score(pattern, db->fuzzy_candidates.text + candidate->offset,
+                        candidate->len);
+        if (score >= 0)
+        {
+            fuzzy_results_add(results, candidate->id, score);
+        }
+    }
+    fuzzy_results_sort(results);
+}
+
+/* The search text is normalized so the query has to be as well. Returns NULL
+ * if the pattern can't be used */
+static char *prepare_search_pattern(void *match, size_t *length,
+                                    enum search_type type)
+{
+    if (type == CONTENT || type == GLOB)
+    {
+        char *normalized = normalize_search_text(match, *length);
+        *length = strlen(normalized);
+        return normalized;
+    }
+
+    if (type == REGEX)
+    {
+        /* Check the pattern first so a typo isn't treated as a database
+         * error */
+        char error[256];
+        pcre2_code *code = compile_regex(match, *length, error, sizeof(error));
+        if (!code)
+        {
+            fprintf(stderr, "Invalid regular expression: %s\n", error);
+            return NULL;
+        }
+        pcre2_code_free(code);
+    }
+
+    char *pattern = xmalloc(*length + 1);
+    memcpy(pattern, match, *length);
+    pattern[*length] = '\0';
+    return pattern;
+}
+
+static uint32_t get_query_shape(const struct query *query)
+{
+    uint32_t shape = 0;
+    if (query->text && query->type == CONTENT)
+    {
+        shape |= SHAPE_LIKE;
+    }
+    else if (query->text && query->type == GLOB)
+    {
+        shape |= SHAPE_GLOB;
+    }
+    else if (query->text && query->type == REGEX)
+    {
+        shape |= SHAPE_REGEX;
+    }
+    shape |= query->mime_type ? SHAPE_MIME_TYPE : 0;
+    shape |= (query->larger_than >= 0) ? SHAPE_LARGER : 0;
+    shape |= (query->smaller_than >= 0) ? SHAPE_SMALLER : 0;
+    shape |= query->after ? SHAPE_AFTER : 0;
+    shape |= query->before ? SHAPE_BEFORE : 0;
+    shape |= query->frecency ? SHAPE_FRECENCY : 0;
+
+    return shape;
+}
+
+/* Builds a single statement with every filter the query uses, so SQLite can
+ * pick the best index for the combination */
+static sqlite3_stmt *compile_query(struct database *db, uint32_t shape)
+{
+    if (db->query_statements[shape])
+    {
+        return db->query_statements[shape];
+    }
+
+    char sql[2048] = "SELECT history_id, snippet FROM clipboard_history";
+    /* Every entry has a usage row, so the score index can be walked */
+    if (shape & SHAPE_FRECENCY)
+    {
+        strcpy(sql, "SELECT history_id, snippet FROM usage"
+                    " JOIN clipboard_history ON history_id = usage.entry");
+    }
+    if (shape & (SHAPE_LIKE | SHAPE_GLOB | SHAPE_REGEX))
+    {
+        strcat(sql, " JOIN search_text ON search_text.entry = history_id");
+    }
+    if (shape & SHAPE_LIKE)
+    {
+        strcat(sql, " LEFT JOIN search_filter"
+                    " ON search_filter.entry = search_text.entry");
+    }
+    strcat(sql, " WHERE 1");
+    for (int i = 0; i < sizeof(query_conditions) / sizeof(query_conditions[0]);
+         i++)
+    {
+        if (shape & query_conditions[i].shape)
+        {
+            strcat(sql, " AND ");
+            strcat(sql, query_conditions[i].condition);
+        }
+    }
+    strcat(sql, (shape & SHAPE_FRECENCY) ? " ORDER BY usage.score DESC;"
+                                         : " ORDER BY history_id DESC;");
+
+    prepare_statement(db, sql, &db->query_statements[shape]);
+    return db->query_statements[shape];
+}
+
+static void bind_query_filters(sqlite3_stmt *search, const struct query *query)
+{
+    if (query->mime_type)
+    {
+        bind_statement(search, QUERY_MIME_TYPE_BINDING, query->mime_type,
+                       strlen(query->mime_type), TEXT);
+    }
+    if (query->larger_than >= 0)
+    {
+        bind_statement(search, QUERY_LARGER_BINDING,
+                       (void *)&query->larger_than, 0, INT64);
+    }
+    if (query->smaller_than >= 0)
+    {
+        bind_statement(search, QUERY_SMALLER_BINDING,
+                       (void *)&query->smaller_than, 0, INT64);
+    }
+    if (query->after)
+    {
+        bind_statement(search, QUERY_AFTER_BINDING, query->after,
+                       strlen(query->after), TEXT);
+    }
+    if (query->before)
+    {
+        bind_statement(search, QUERY_BEFORE_BINDING, query->before,
+                       strlen(query->before), TEXT);
+    }
+}
+
+bool database_query_matches(struct database *db, const struct query *query,
+                            int64_t id)
+{
+    sqlite3_stmt *check =
+        compile_query(db, get_query_shape(query) | SHAPE_ENTRY);
+    char *pattern = NULL;
+    if (query->text && query->type != FUZZY)
+    {
+        size_t length = strlen(query->text);
+        pattern = prepare_search_pattern(query->text, &length, query->type);
+        if (!pattern)
+        {
+            return false;
+        }
+        bind_statement(check, QUERY_TEXT_BINDING, pattern, length, TEXT);
+    }
+    bind_query_filters(check, query);
+    bind_statement(check, QUERY_ENTRY_BINDING, &id, 0, INT64);
+    bool matches = (execute_statement(check) == SQLITE_ROW);
+    sqlite3_reset(check);
+    sqlite3_clear_bindings(check);
+    free(pattern);
+
+    return matches;
+}
+
+/* Fuzzy matches are only known once every entry has been scored, so they're
+ * handed out best first at the end */
+static uint32_t query_fuzzy(struct database *db, const struct query *query,
+                            uint32_t limit, search_callback callback,
+                            void *user_data)
+{
+    /* Any of the best matches could be filtered out, so keep all of them */
+    bool filtered = get_query_shape(query);
+    char *pattern = normalize_search_text(query->text, strlen(query->text));
+    struct fuzzy_results results;
+    find_fuzzy_matches(db, pattern, filtered ? 0 : limit, &results);
+    free(pattern);
+
+    uint32_t found = 0;
+    for (int i = 0; i < results.len && (!limit || found < limit); i++)
+    {
+        int64_t id = results.matches[i].id;
+        if (filtered && !database_query_matches(db, query, id))
+        {
+            continue;
+        }
+
+        char *snippet = database_get_snippet(db, id);
+        struct search_match result = {.id = id,
+                                      .snippet = snippet ? snippet : "",
+                                      .score = results.matches[i].score};
+        bool more = callback(&result, user_data);
+        free(snippet);
+        found++;
+        if (!more)
+        {
+            break;
+        }
+    }
+    fuzzy_results_free(&results);
+
+    return found;
+}
+
+bool database_collect_match(const struct search_match *match, void *user_data)
+{
+    struct id_list *list = user_data;
+    if (list->len == list->size)
+    {
+        list->size = list->size ? list->size * 2 : 16;
+        list->ids = xrealloc(list->ids, sizeof(int64_t) * list->size);
+    }
+    list->ids[list->len++] = match->id;
+
+    return true;
+}
+
+uint32_t database_query(struct database *db, const struct query *query,
+                        uint32_t limit, search_callback callback,
+                        void *user_data)
+{
+    if (query->text && query->type == FUZZY)
+    {
+        return query_fuzzy(db, query, limit, callback, user_data);
+    }
+
+    sqlite3_stmt *search = compile_query(db, get_query_shape(query));
+    char *pattern = NULL;
+    if (query->text)
+    {
+        size_t length = strlen(query->text);
+        pattern = prepare_search_pattern(query->text, &length, query->type);
+        if (!pattern)
+        {
+            return 0;
+        }
+        bind_statement(search, QUERY_TEXT_BINDING, pattern, length, TEXT);
+    }
+    bind_query_filters(search, query);
+
+    /* Stops early with SQLITE_INTERRUPT if the search is cancelled */
+    uint32_t found = 0;
+    while ((!limit || found < limit) &&
+           execute_statement(search) == SQLITE_ROW)
+    {
+        const char *snippet = (const char *)sqlite3_column_text(search, 1);
+        struct search_match result = {.id = sqlite3_column_int64(search, 0),
+                                      .snippet = snippet ? snippet : "",
+                                      .score = 0};
+        found++;
+        if (!callback(&result, user_data))
+        {
+            break;
+        }
+    }
+
+    sqlite3_reset(search);
+    sqlite3_clear_bindings(search);
+    free(pattern);
+
+    return found;
+}
+
+uint32_t database_search(struct database *db, void *match, size_t length,
+                         uint32_t limit, enum search_type type,
+                         search_callback callback, void *user_data)
+{
+    struct query *query = query_from_search(match, length, type);
+    uint32_t found = database_query(db, query, limit, callback, user_data);
+    query_free(query);
+
+    return found;
+}
+
+uint32_t database_find_matching_snippets(struct database *db, void *match,
+                                         size_t length,
+                                         uint32_t num_of_entries,
+                                         int64_t *list_of_ids)
+{
+    char *pattern = prepare_search_pattern(match, &length, CONTENT);
+    bind_statement(db->find_matching_snippets, MATCH_BINDING, pattern, length,
+                   TEXT);
+
+    int counter = 0;
+    while (counter < num_of_entries &&
+           execute_statement(db->find_matching_snippets) == SQLITE_ROW)
+    {
+        list_of_ids[counter] =
+            sqlite3_column_int64(db->find_matching_snippets, 0);
+        counter++;
+    }
+
+    sqlite3_reset(db->find_matching_snippets);
+    sqlite3_clear_bindings(db->find_matching_snippets);
+    free(pattern);
+
+    return counter;
+}
+
+static void free_search_record(struct search_record *record)
+{
+    free(record->pattern);
+    free(record->matches);
+    free(record->text);
+    memset(record, 0, sizeof(struct search_record));
+}
+
+static bool can_refine_search(struct database *db, const char *pattern)
+{
+    return db->last_search.pattern && db->last_search.searched_to == 0 &&
+           db->last_search.data_version == get_data_version(db) &&
+           db->last_search.total_changes == sqlite3_total_changes64(db->conn) &&
+           strstr(pattern, db->last_search.pattern);
+}
+
+/* Returns true if the step of the search that starts at started_at should be
+ * added to the current record */
+static bool begin_search_step(struct database *db, const char *pattern,
+                              int64_t started_at)
+{
+    struct search_record *current = &db->current_search;
+    if (started_at == INT64_MAX)
+    {
+        free_search_record(current);
+        current->pattern = xstrdup(pattern);
+        current->searched_to = INT64_MAX;
+        current->data_version = get_data_version(db);
+        current->total_changes = sqlite3_total_changes64(db->conn);
+    }
+
+    /* Part of a different search, or something changed since it began */
+    if (!current->pattern || strcmp(current->pattern, pattern) ||
+        current->searched_to != started_at ||
+        current->data_version != get_data_version(db) ||
+        current->total_changes != sqlite3_total_changes64(db->conn))
+    {
+        free_search_record(current);
+        return false;
+    }
+
+    return true;
+}
+
+/* Returns false once the matches take up too much memory to keep */
+static bool record_search_match(struct database *db, int64_t id,
+                                const char *text, size_t len)
+{
+    struct search_record *current = &db->current_search;
+    if (current->text_len + len + 1 > MAX_RECORDED_TEXT_SIZE)
+    {
+        free_search_record(current);
+        return false;
+    }
+
+    if (current->len == current->size)
+    {
+        current->size =
+            current->size ? current->size * 2 : NUMBER_OF_CANDIDATES;
+        current->matches = xrealloc(
+            current->matches, sizeof(struct recorded_match) * current->size);
+    }
+    if (current->text_len + len + 1 > current->text_size)
+    {
+        current->text_size = (current->text_len + len + 1) * 2;
+        current->text = xrealloc(current->text, current->text_size);
+    }
+
+    current->matches[current->len].id = id;
+    current->matches[current->len].offset = current->text_len;
+    current->len++;
+    memcpy(current->text + current->text_len, text, len);
+    current->text_len += len;
+    current->text[current->text_len++] = '\0';
+
+    return true;
+}
+
+/* The record replaces the last search once it has been run to the end */
+static void end_search_step(struct database *db, int64_t searched_to)
+{
+    db->current_search.searched_to = searched_to;
+    if (searched_to == 0 && !is_search_cancelled())
+    {
+        free_search_record(&db->last_search);
+        db->last_search = db->current_search;
+        memset(&db->current_search, 0, sizeof(struct search_record));
+    }
+}
+
+/* Only looks at the matches of the last search, in memory, instead of every
+ * entry in the database */
+static uint32_t refine_search(struct database *db, const char *pattern,
+                              int64_t *before, uint32_t num_of_entries,
+                              int64_t *list_of_ids)
+{
+    struct search_record *last = &db->last_search;
+    bool record = begin_search_step(db, pattern, *before);
+
+    /* The same as the LIKE used for a full search */
+    char *like = xmalloc(strlen(pattern) + 3);
+    sprintf(like, "%%%s%%", pattern);
+
+    /* Find where to continue from, the matches are newest first */
+    uint32_t low = 0, high = last->len;
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        if (last->matches[middle].id >= *before)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    uint32_t found = 0, checked = 0;
+    for (uint32_t i = low; i < last->len && checked < num_of_entries;
+         i++, checked++)
+    {
+        const char *text = last->text + last->matches[i].offset;
+        *before = last->matches[i].id;
+        if (sqlite3_strlike(like, text, 0) == 0)
+        {
+            list_of_ids[found] = *before;
+            found++;
+            record = record &&
+                     record_search_match(db, *before, text, strlen(text));
+        }
+    }
+
+    /* Reached the oldest match */
+    if (checked < num_of_entries)
+    {
+        *before = 0;
+    }
+    if (record)
+    {
+        end_search_step(db, *before);
+    }
+    free(like);
+
+    return found;
+}
+
+bool database_can_refine_search(struct database *db, void *match, size_t length,
+                                enum search_type type)
+{
+    if (type != CONTENT)
+    {
+        return false;
+    }
+
+    char *pattern = prepare_search_pattern(match, &length, type);
+    bool refine = can_refine_search(db, pattern);
+    free(pattern);
+
+    return refine;
+}
+
+uint32_t database_find_matching_entries_before(struct database *db, void *match,
+                                               size_t length, int64_t *before,
+                                               uint32_t num_of_entries,
+                                               int64_t *list_of_ids,
+                                               enum search_type type)
+{
+    sqlite3_stmt *search;
+
+    if (type == CONTENT)
+    {
+        search = db->scan_matching_entries;
+    }
+    else if (type == GLOB)
+    {
+        search = db->scan_matching_entries_glob;
+    }
+    else if (type == REGEX)
+    {
+        search = db->scan_matching_entries_regex;
+    }
+    else
+    {
+        fprintf(stderr, "Invalid search type\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char *pattern = prepare_search_pattern(match, &length, type);
+    if (!pattern)
+    {
+        *before = 0;
+        return 0;
+    }
+
+    /* Glob and regex patterns don't narrow down like substrings do */
+    if (type == CONTENT && can_refine_search(db, pattern))
+    {
+        uint32_t found =
+            refine_search(db, pattern, before, num_of_entries, list_of_ids);
+        free(pattern);
+        return found;
+    }
+    bool record = (type == CONTENT) && begin_search_step(db, pattern, *before);
+
+    bind_statement(search, MATCH_BINDING, pattern, length, TEXT);
+    bind_statement(search, SCAN_BEFORE_BINDING, before, 0, INT64);
+    bind_statement(search, SCAN_LIMIT_BINDING, &num_of_entries, 0, INT);
+
+    uint32_t scanned = 0, found = 0;
+    while (execute_statement(search) == SQLITE_ROW)
+    {
+        *before = sqlite3_column_int64(search, 0);
+        if (sqlite3_column_type(search, 1) != SQLITE_NULL)
+        {
+            list_of_ids[found] = *before;
+            found++;
+            record = record &&
+                     record_search_match(
+                         db, *before,
+                         (const char *)sqlite3_column_text(search, 1),
+                         sqlite3_column_bytes(search, 1));
+        }
+        scanned++;
+    }
+
+    /* Reached the oldest entry, or the search was cancelled */
+    if (scanned < num_of_entries)
+    {
+        *before = 0;
+    }
+    if (record)
+    {
+        end_search_step(db, *before);
+    }
+
+    sqlite3_reset(search);
+    sqlite3_clear_bindings(search);
+    free(pattern);
+
+    return found;
+}
+
+int64_t database_find_entry_from_snippet(struct database *db, char *snippet,
+                                         size_t length)
+{
+    bind_statement(db->find_entry_from_snippet, MATCH_BINDING, snippet, length,
+                   TEXT);
+
+    int64_t id = 0;
+    if (execute_statement(db->find_entry_from_snippet) != SQLITE_DONE)
+    {
+        id = sqlite3_column_int(db->find_entry_from_snippet, 0);
+    }
+
+    sqlite3_reset(db->find_entry_from_snippet);
+    sqlite3_clear_bindings(db->find_entry_from_snippet);
+
+    return id;
+}
+
+uint64_t database_get_size(struct database *db)
+{
+    execute_statement(db->select_size);
+    uint64_t size = sqlite3_column_int(db->select_size, 0);
+    sqlite3_reset(db->select_size);
+
+    return size;
+}
+
+uint32_t database_get_latest_entries(struct database *db,
+                                     uint32_t num_of_entries, uint32_t offset,
+                                     int64_t *list_of_ids)
+{
+    bind_statement(db->select_latest_entries, ENTRY_BINDING, &num_of_entries, 0,
+                   INT);
+    bind_statement(db->select_latest_entries, LENGTH_BINDING, &offset, 0, INT);
+
+    int counter = 0;
+    while (execute_statement(db->select_latest_entries) != SQLITE_DONE)
+    {
+        list_of_ids[counter] = sqlite3_column_int(db->select_latest_entries, 0);
+        counter++;
+    }
+
+    sqlite3_reset(db->select_latest_entries);
+    sqlite3_clear_bindings(db->select_latest_entries);
+
+    return counter;
+}
+
+uint32_t database_get_frecent_entries(struct database *db,
+                                      uint32_t num_of_entries, uint32_t offset,
+                                      int64_t *list_of_ids)
+{
+    bind_statement(db->select_frecent_entries, ENTRY_BINDING, &num_of_entries,
+                   0, INT);
+    bind_statement(db->select_frecent_entries, LENGTH_BINDING, &offset, 0,
+                   INT);
+
+    int counter = 0;
+    while (execute_statement(db->select_frecent_entries) == SQLITE_ROW)
+    {
+        list_of_ids[counter] =
+            sqlite3_column_int64(db->select_frecent_entries, 0);
+        counter++;
+    }
+
+    sqlite3_reset(db->select_frecent_entries);
+    sqlite3_clear_bindings(db->select_frecent_entries);
+
+    return counter;
+}
+
+void database_get_index_entries(struct database *db, int64_t after,
+                                index_callback callback, void *user_data)
+{
+    bind_statement(db->select_index_entries, ID_BINDING, &after, 0, INT64);
+    while (execute_statement(db->select_index_entries) == SQLITE_ROW)
+    {
+        const char *text =
+            (const char *)sqlite3_column_text(db->select_index_entries, 3);
+        const char *mime_types =
+            (const char *)sqlite3_column_text(db->select_index_entries, 4);
+        struct index_entry entry = {
+            .id = sqlite3_column_int64(db->select_index_entries, 0),
+            .timestamp =
+                (const char *)sqlite3_column_text(db->select_index_entries, 1),
+            .snippet =
+                (const char *)sqlite3_column_text(db->select_index_entries, 2),
+            .text = text,
+            .text_len = sqlite3_column_bytes(db->select_index_entries, 3),
+            .mime_types = mime_types ? mime_types : "",
+            .size = sqlite3_column_int64(db->select_index_entries, 5)};
+        callback(&entry, user_data);
+    }
+
+    sqlite3_reset(db->select_index_entries);
+    sqlite3_clear_bindings(db->select_index_entries);
+}
+
+char *database_get_search_text(struct database *db, int64_t id,
+                               size_t *len)
+{
+    char *text = NULL;
+    bind_statement(db->select_search_text, ID_BINDING, &id, 0, INT64);
+    if (execute_statement(db->select_search_text) == SQLITE_ROW)
+    {
+        const char *tmp_text =
+            (const char *)sqlite3_column_text(db->select_search_text, 0);
+        *len = sqlite3_column_bytes(db->select_search_text, 0);
+        text = xstrdup(tmp_text ? tmp_text : "");
+    }
+    sqlite3_reset(db->select_search_text);
+    sqlite3_clear_bindings(db->select_search_text);
+
+    return text;
+}
+
+uint32_t database_get_total_entries(struct database *db)
+{
+    int ret = execute_statement(db->total_entries);
+    if (ret == SQLITE_DONE)
+    {
+        return 0;
+    }
+
+    uint32_t total = sqlite3_column_int(db->total_entries, 0);
+    sqlite3_reset(db->total_entries);
+
+    return total;
+}
+
+char *database_get_snippet(struct database *db, int64_t id)
+{
+    bind_statement(db->select_snippet, ID_BINDING, &id, 0, INT);
+    int ret = execute_statement(db->select_snippet);
+    if (ret == SQLITE_DONE)
+    {
+        sqlite3_reset(db->select_snippet);
+        sqlite3_clear_bindings(db->select_snippet);
+        return NULL;
+    }
+
+    const char *tmp_snippet =
+        (char *)sqlite3_column_text(db->select_snippet, (SNIPPET_BINDING - 1));
+    if (!tmp_snippet)
+    {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    char *snippet = xstrdup(tmp_snippet);
+
+    sqlite3_reset(db->select_snippet);
+    sqlite3_clear_bindings(db->select_snippet);
+
+    return snippet;
+}
+
+void *database_get_thumbnail(struct database *db, int64_t id, size_t *len)
+{
+    bind_statement(db->select_thumbnail, ID_BINDING, &id, 0, INT);
+    execute_statement(db->select_thumbnail);
+
+    const void *tmp_blob = sqlite3_column_blob(db->select_thumbnail, 0);
+    *len = sqlite3_column_bytes(db->select_thumbnail, 0);
+    void *thumbnail = xmalloc(*len);
+    thumbnail = memcpy(thumbnail, tmp_blob, *len);
+
+    sqlite3_reset(db->select_thumbnail);
+    sqlite3_clear_bindings(db->select_thumbnail);
+
+    return thumbnail;
+}
+
+bool database_get_entry(struct database *db, int64_t id, source_buffer *src)
+{
+    src->snippet = database_get_snippet(db, id);
+    if (!src->snippet)
+    {
+        return false;
+    }
+    src->id = id;
+
+    src->thumbnail = database_get_thumbnail(db, id, &src->thumbnail_len);
+
+    bind_statement(db->select_entry, ID_BINDING, &id, 0, INT);
+    while (execute_statement(db->select_entry) != SQLITE_DONE &&
+           src->num_types < MAX_MIME_TYPES)
+    {
+        size_t len = sqlite3_column_int(db->select_entry, (LENGTH_BINDING - 1));
+        int encoding =
+            sqlite3_column_int(db->select_entry, (ENCODING_BINDING - 1));
+        const void *tmp_blob =
+            sqlite3_column_blob(db->select_entry, (DATA_BINDING - 1));
+        void *data = NULL;
+
+        if (encoding == ENCODING_TRANSCODED)
+        {
+            len = 0;
+        }
+        else if (!tmp_blob)
+        {
+            perror("Failed to allocate memory");
+            exit(EXIT_FAILURE);
+        }
+        else if (encoding == ENCODING_ZSTD)
+        {
+            data = decompress_data(
+                db, tmp_blob,
+                sqlite3_column_bytes(db->select_entry, DATA_BINDING - 1),
+                sqlite3_column_int64(db->select_entry, DICTIONARY_BINDING - 1),
+                len);
+            if (!data)
+            {
+                continue;
+            }
+        }
+        else if (encoding == ENCODING_CHUNKED)
+        {
+            data = read_chunked_data(
+                db, tmp_blob,
+                sqlite3_column_bytes(db->select_entry, DATA_BINDING - 1), len);
+            if (!data)
+            {
+                continue;
+            }
+        }
+        else
+        {
+            data = xmalloc(len);
+            memcpy(data, tmp_blob, len);
+        }
+
+        const char *tmp_text = (char *)sqlite3_column_text(
+            db->select_entry, (MIME_TYPE_BINDING - 1));
+
+        if (!tmp_text)
+        {
+            perror("Failed to allocate memory");
+            exit(EXIT_FAILURE);
+        }
+        src->types[src->num_types] = xstrdup(tmp_text);
+        src->data[src->num_types] = data;
+        src->len[src->num_types] = len;
+
+        src->num_types++;
+    }
+
+    sqlite3_reset(db->select_entry);
+    sqlite3_clear_bindings(db->select_entry);
+
+    return true;
+}
+
+static void create_database_directory()
+{
+    char *data_home = getenv("XDG_DATA_HOME");
+    if (data_home)
+    {
+        char *dir = xmalloc(strlen(data_home) + strlen("/kaprica") + 1);
+        strcpy(dir, data_home);
+        strcat(dir, "/kaprica");
+        mkdir(dir, 0777);
+        free(dir);
+    }
+    else
+    {
+        data_home = getenv("HOME");
+        char *dir =
+            xmalloc(strlen(data_home) + strlen("/.local/share/kaprica") + 1);
+        strcpy(dir, data_home);
+        strcat(dir, "/.local/share/kaprica");
+        mkdir(dir, 0777);
+        free(dir);
+    }
+}
+
+/* Find $XDG_DATA_HOME/kaprica/history.db or
+ * $HOME/.local/share/kaprica/history.db */
+char *database_default_path(void)
+{
+    create_database_directory();
+
+    char *data_path = NULL;
+    char *data_home = getenv("XDG_DATA_HOME");
+    if (data_home)
+    {
+        data_path =
+            xmalloc(strlen(data_home) + strlen("/kaprica/history.db") + 1);
+        strcpy(data_path, data_home);
+        strcat(data_path, "/kaprica/history.db");
+    }
+    else
+    {
+        data_home = getenv("HOME");
+        data_path = xmalloc(strlen(data_home) +
+                            strlen("/.local/share/kaprica/history.db") + 1);
+        strcpy(data_path, data_home);
+        strcat(data_path, "/.local/share/kaprica/history.db");
+    }
+
+    return data_path;
+}
+
+/* Compares the files themselves, so a relative path or one through a symlink
+ * is still the same database */
+bool database_is_file(struct database *db, const char *filepath)
+{
+    char *path = filepath ? xstrdup(filepath) : database_default_path();
+    const char *open_path = sqlite3_db_filename(db->conn, "main");
+    struct stat requested, current;
+    bool same = open_path && !stat(path, &requested) &&
+                !stat(open_path, &current) &&
+                requested.st_dev == current.st_dev &&
+                requested.st_ino == current.st_ino;
+    free(path);
+
+    return same;
+}
+
+/* Everything starts out unprepared and unloaded */
+static struct database *new_handle(void)
+{
+    struct database *db = xmalloc(sizeof(struct database));
+    memset(db, 0, sizeof(struct database));
+
+    return db;
+}
+
+static void close_reader(void *data)
+{
+    database_close(data);
+}
+
+static void create_readers(void)
+{
+    if (tss_create(&readers, close_reader) != thrd_success)
+    {
+        fprintf(stderr, "Failed to create database readers\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Readers never write, so they skip the migrations and can't take the write
+ * lock from the thread that opened the database */
+struct database *database_get_reader(const char *filepath)
+{
+    call_once(&readers_created, create_readers);
+    struct database *db = tss_get(readers);
+    if (db)
+    {
+        return db;
+    }
+
+    db = new_handle();
+    char *path = filepath ? xstrdup(filepath) : database_default_path();
+    if (sqlite3_open_v2(path, &db->conn, SQLITE_OPEN_READONLY, NULL) !=
+        SQLITE_OK)
+    {
+        fprintf(stderr, "Failed to open database: %s\n",
+                sqlite3_errmsg(db->conn));
+        exit(EXIT_FAILURE);
+    }
+    free(path);
+
+    sqlite3_busy_timeout(db->conn, READER_BUSY_TIMEOUT_MS);
+    register_functions(db);
+    create_compression_contexts(db);
+    prepare_all_statements(db);
+    tss_set(readers, db);
+
+    return db;
+}
+
+const char *database_get_path(struct database *db)
+{
+    return sqlite3_db_filename(db->conn, "main");
+}
+
+bool database_read_row(struct database *db, int64_t id,
+                       struct entry_row *row)
+{
+    char *snippet = database_get_snippet(db, id);
+    if (!snippet)
+    {
+        return false;
+    }
+
+    row->id = id;
+    row->snippet = snippet;
+    row->thumbnail = database_get_thumbnail(db, id, &row->thumbnail_len);
+    if (!row->thumbnail_len)
+    {
+        free(row->thumbnail);
+        row->thumbnail = NULL;
+    }
+
+    return true;
+}
+
+void database_free_row(struct entry_row *row)
+{
+    free(row->snippet);
+    free(row->thumbnail);
+}
+
+bool database_train_dictionary(struct database *db)
+{
+    bind_statement(db->count_undictionaried_entries, ID_BINDING,
+                   &db->current_dictionary_last_entry, 0, INT);
+    execute_statement(db->count_undictionaried_entries);
+    uint32_t new_samples =
+        sqlite3_column_int(db->count_undictionaried_entries, 0);
+    sqlite3_reset(db->count_undictionaried_entries);
+    sqlite3_clear_bindings(db->count_undictionaried_entries);
+
+    uint32_t needed = db->current_dictionary ? RETRAIN_DICTIONARY_SAMPLES
+                                         : MIN_DICTIONARY_SAMPLES;
+    if (new_samples < needed)
+    {
+        return false;
+    }
+
+    uint32_t limit = RETRAIN_DICTIONARY_SAMPLES;
+    size_t *sample_lengths = xmalloc(sizeof(size_t) * limit);
+    char *samples = NULL;
+    size_t total_length = 0;
+    uint32_t num_of_samples = 0;
+    int64_t last_entry = 0;
+
+    bind_statement(db->select_dictionary_samples, ID_BINDING, &limit, 0, INT);
+    while (execute_statement(db->select_dictionary_samples) != SQLITE_DONE)
+    {
+        sqlite3_stmt *sample = db->select_dictionary_samples;
+        int64_t entry = sqlite3_column_int64(sample, 0);
+        const void *blob = sqlite3_column_blob(sample, 1);
+        size_t blob_len = sqlite3_column_bytes(sample, 1);
+        int encoding = sqlite3_column_int(sample, 2);
+        int64_t dictionary = sqlite3_column_int64(sample, 3);
+        size_t len = sqlite3_column_int64(sample, 4);
+
+        void *data = NULL;
+        if (encoding == ENCODING_ZSTD)
+        {
+            data = decompress_data(db, blob, blob_len, dictionary, len);
+            if (!data)
+            {
+                continue;
+            }
+            blob = data;
+        }
+
+        last_entry = (entry > last_entry) ? entry : last_entry;
+        len = (len < MAX_SAMPLE_LENGTH) ? len : MAX_SAMPLE_LENGTH;
+        samples = xrealloc(samples, total_length + len);
+        memcpy(samples + total_length, blob, len);
+        sample_lengths[num_of_samples] = len;
+        total_length += len;
+        num_of_samples++;
+
+        free(data);
+    }
+    sqlite3_reset(db->select_dictionary_samples);
+    sqlite3_clear_bindings(db->select_dictionary_samples);
+
+    void *dictionary = xmalloc(DICTIONARY_SIZE);
+    size_t dictionary_len = ZDICT_trainFromBuffer(
+        dictionary, DICTIONARY_SIZE, samples, sample_lengths, num_of_samples);
+    free(samples);
+    free(sample_lengths);
+
+    if (ZDICT_isError(dictionary_len))
+    {
+        fprintf(stderr, "Failed to train compression dictionary: %s\n",
+                ZDICT_getErrorName(dictionary_len));
+        /* Wait for more entries before trying again */
+        db->current_dictionary_last_entry = last_entry;
+        free(dictionary);
+        return false;
+    }
+
+    bind_statement(db->insert_dictionary, LAST_ENTRY_BINDING, &last_entry, 0,
+                   INT);
+    bind_statement(db->insert_dictionary, DICTIONARY_DATA_BINDING, dictionary,
+                   dictionary_len, BLOB);
+    execute_statement(db->insert_dictionary);
+    sqlite3_reset(db->insert_dictionary);
+    sqlite3_clear_bindings(db->insert_dictionary);
+    free(dictionary);
+
+    load_current_dictionary(db);
+
+    /* Dictionaries of entries that have since been deleted */
+    execute_statement(db->delete_unused_dictionaries);
+    sqlite3_reset(db->delete_unused_dictionaries);
+
+    return true;
+}
+
+/* Compresses with the raw dictionary rather than a cached one as cold
+ * storage uses a different level than new entries */
+static void *recompress_data(struct database *db, const void *data,
+                             size_t len, int64_t dictionary,
+                             size_t *compressed_len)
+{
+    int level = (len > COLD_LARGE_LENGTH) ? COLD_LARGE_COMPRESSION_LEVEL
+                                          : COLD_COMPRESSION_LEVEL;
+    size_t bound = ZSTD_compressBound(len);
+    void *compressed = xmalloc(bound);
+    size_t ret;
+
+    if (dictionary)
+    {
+        bind_statement(db->select_dictionary, ID_BINDING, &dictionary, 0, INT);
+        if (execute_statement(db->select_dictionary) != SQLITE_DONE)
+        {
+            ret = ZSTD_compress_usingDict(
+                db->compress_context, compressed, bound, data, len,
+                sqlite3_column_blob(db->select_dictionary, 0),
+                sqlite3_column_bytes(db->select_dictionary, 0), level);
+        }
+        else
+        {
+            ret = ZSTD_compressCCtx(db->compress_context, compressed, bound,
+                                    data, len, level);
+            dictionary = 0;
+        }
+        sqlite3_reset(db->select_dictionary);
+        sqlite3_clear_bindings(db->select_dictionary);
+    }
+    else
+    {
+        ret = ZSTD_compressCCtx(db->compress_context, compressed, bound, data,
+                                len, level);
+    }
+
+    if (ZSTD_isError(ret) || ret >= len)
+    {
+        free(compressed);
+        return NULL;
+    }
+
+    *compressed_len = ret;
+    return compressed;
+}
+
+struct cold_content
+{
+    int64_t rowid;
+    void *data;
+    size_t data_len;
+    size_t len;
+    int encoding;
+    int64_t dictionary;
+    char *mime_type;
+};
+
+uint32_t database_recompress_cold_entries(struct database *db, int32_t days,
+                                          uint32_t num_of_rows)
+{
+    /* Copy the batch out first as the rows are modified afterwards */
+    struct cold_content *batch =
+        xmalloc(sizeof(struct cold_content) * num_of_rows);
+    uint32_t found = 0;
+    size_t batch_length = 0;
+
+    bind_statement(db->select_cold_content, COLD_DAYS_BINDING, &days, 0, INT);
+    bind_statement(db->select_cold_content, COLD_LIMIT_BINDING, &num_of_rows, 0,
+                   INT);
+    while (found < num_of_rows && batch_length < COLD_BATCH_LENGTH &&
+           execute_statement(db->select_cold_content) != SQLITE_DONE)
+    {
+        struct cold_content *row = &batch[found];
+        row->rowid = sqlite3_column_int64(db->select_cold_content, 0);
+        const void *blob = sqlite3_column_blob(db->select_cold_content, 1);
+        row->data_len = sqlite3_column_bytes(db->select_cold_content, 1);
+        row->encoding = sqlite3_column_int(db->select_cold_content, 2);
+        row->dictionary = sqlite3_column_int64(db->select_cold_content, 3);
+        row->len = sqlite3_column_int64(db->select_cold_content, 4);
+        row->mime_type =
+            xstrdup((char *)sqlite3_column_text(db->select_cold_content, 5));
+        row->data = xmalloc(row->data_len ? row->data_len : 1);
+        memcpy(row->data, blob, row->data_len);
+
+        batch_length += row->len;
+        found++;
+    }
+    sqlite3_reset(db->select_cold_content);
+    sqlite3_clear_bindings(db->select_cold_content);
+
+    sqlite3_exec(db->conn, "BEGIN;", NULL, NULL, NULL);
+    for (int i = 0; i < found; i++)
+    {
+        struct cold_content *row = &batch[i];
+        void *data = NULL, *recompressed = NULL;
+        size_t recompressed_len = 0;
+        int encoding = row->encoding;
+        int64_t dictionary = row->dictionary;
+        size_t length = row->len;
+
+        if (row->encoding == ENCODING_ZSTD)
+        {
+            data = decompress_data(db, row->data, row->data_len,
+                                   row->dictionary, row->len);
+            if (data)
+            {
+                recompressed = recompress_data(db, data, row->len,
+                                               row->dictionary,
+                                               &recompressed_len);
+            }
+        }
+        else if (row->encoding == ENCODING_RAW &&
+                 !strcmp(row->mime_type, "image/png"))
+        {
+            recompressed =
+                optimize_png(row->data, row->data_len, &recompressed_len);
+            if (recompressed)
+            {
+                length = recompressed_len;
+            }
+        }
+        else if (row->encoding == ENCODING_RAW &&
+                 strncmp(row->mime_type, "image/", strlen("image/")) &&
+                 row->len >= MIN_COMPRESS_LENGTH)
+        {
+            /* Other images are already compressed, anything else might
+             * still be worth it at a higher level */
+            recompressed =
+                recompress_data(db, row->data, row->len, 0, &recompressed_len);
+            if (recompressed)
+            {
+                encoding = ENCODING_ZSTD;
+                dictionary = 0;
+            }
+        }
+
+        /* Only keep the result if it's smaller than what's stored */
+        if (recompressed && recompressed_len >= row->data_len)
+        {
+            free(recompressed);
+            recompressed = NULL;
+            encoding = row->encoding;
+            dictionary = row->dictionary;
+            length = row->len;
+        }
+
+        if (recompressed)
+        {
+            bind_statement(db->update_cold_content, COLD_DATA_BINDING,
+                           recompressed, recompressed_len, BLOB);
+        }
+        bind_statement(db->update_cold_content, COLD_ENCODING_BINDING,
+                       &encoding, 0, INT);
+        if (dictionary)
+        {
+            bind_statement(db->update_cold_content, COLD_DICTIONARY_BINDING,
+                           &dictionary, 0, INT);
+        }
+        bind_statement(db->update_cold_content, COLD_ROWID_BINDING, &row->rowid,
+                       0, INT);
+        bind_statement(db->update_cold_content, COLD_LENGTH_BINDING, &length, 0,
+                       INT);
+        execute_statement(db->update_cold_content);
+        sqlite3_reset(db->update_cold_content);
+        sqlite3_clear_bindings(db->update_cold_content);
+
+        free(recompressed);
+        free(data);
+        free(row->data);
+        free(row->mime_type);
+    }
+    sqlite3_exec(db->conn, "COMMIT;", NULL, NULL, NULL);
+    free(batch);
+
+    return found;
+}
+
+uint32_t database_index_search_text(struct database *db,
+                                    uint32_t num_of_entries, int64_t *ids)
+{
+    /* Collect the ids first as database_get_entry() runs its own queries */
+    uint32_t found = 0;
+    bind_statement(db->select_unindexed_entries, ID_BINDING, &num_of_entries, 0,
+                   INT);
+    while (found < num_of_entries &&
+           execute_statement(db->select_unindexed_entries) != SQLITE_DONE)
+    {
+        ids[found] = sqlite3_column_int64(db->select_unindexed_entries, 0);
+        found++;
+    }
+    sqlite3_reset(db->select_unindexed_entries);
+    sqlite3_clear_bindings(db->select_unindexed_entries);
+
+    sqlite3_exec(db->conn, "BEGIN;", NULL, NULL, NULL);
+    for (int i = 0; i < found; i++)
+    {
+        source_buffer *src = source_init();
+        if (database_get_entry(db, ids[i], src))
+        {
+            get_search_text(src);
+            bind_statement(db->insert_search_text, ENTRY_BINDING, &ids[i], 0,
+                           INT64);
+            bind_statement(db->insert_search_text, SEARCH_TEXT_BINDING,
+                           src->search_text, strlen(src->search_text), TEXT);
+            execute_statement(db->insert_search_text);
+            sqlite3_reset(db->insert_search_text);
+            sqlite3_clear_bindings(db->insert_search_text);
+            insert_trigram_filter(db, ids[i], src->search_text);
+        }
+        source_destroy(src);
+    }
+    sqlite3_exec(db->conn, "COMMIT;", NULL, NULL, NULL);
+
+    return found;
+}
+
+/* Bring the schema of an existing database up to date */
+static int get_user_version(struct database *db)
+{
+    sqlite3_stmt *user_version;
+    prepare_statement(db, "PRAGMA user_version;", &user_version);
+    execute_statement(user_version);
+    int version = sqlite3_column_int(user_version, 0);
+    sqlite3_finalize(user_version);
+
+    return version;
+}
+
+/* kapd and the clients can open an old database at the same time, so the
+ * version is checked again once the write lock is held */
+static void migrate_database(struct database *db)
+{
+    int num_of_migrations = sizeof(migrations) / sizeof(migrations[0]);
+    if (get_user_version(db) >= num_of_migrations)
+    {
+        return;
+    }
+
+    /* Tables are rebuilt by dropping the old one, which would delete the
+     * rows that refer to it. It can't be changed inside a transaction */
+    sqlite3_exec(db->conn, "PRAGMA foreign_keys = OFF;", NULL, NULL, NULL);
+    for (int version = 0; version < num_of_migrations;)
+    {
+        char *error = NULL;
+        if (sqlite3_exec(db->conn, "BEGIN IMMEDIATE;", NULL, NULL, &error) !=
+            SQLITE_OK)
+        {
+            fprintf(stderr, "Failed to migrate database: %s\n", error);
+            sqlite3_free(error);
+            exit(EXIT_FAILURE);
+        }
+
+        /* Another process may have applied it while this one waited */
+        version = get_user_version(db);
+        if (version < num_of_migrations)
+        {
+            char pragma[64];
+            snprintf(pragma, sizeof(pragma), "PRAGMA user_version = %d;",
+                     version + 1);
+            if (sqlite3_exec(db->conn, migrations[version], NULL, NULL,
+                             &error) != SQLITE_OK ||
+                sqlite3_exec(db->conn, pragma, NULL, NULL, &error) !=
+                    SQLITE_OK)
+            {
+                fprintf(stderr, "Failed to migrate database: %s\n", error);
+                sqlite3_free(error);
+                sqlite3_exec(db->conn, "ROLLBACK;", NULL, NULL, NULL);
+                exit(EXIT_FAILURE);
+            }
+            version++;
+        }
+        sqlite3_exec(db->conn, "COMMIT;", NULL, NULL, NULL);
+    }
+    sqlite3_exec(db->conn, "PRAGMA foreign_keys = ON;", NULL, NULL, NULL);
+}
+
+/* Create a new database if one does not already exist */
+struct database *database_init(char *filepath)
+{
+    filepath = (filepath != NULL) ? filepath : database_default_path();
+
+    struct database *db = new_handle();
+    // Put database in a proper location, probably ~/.kaprica/history.db
+    sqlite3_open(filepath, &db->conn);
+    if (!db->conn)
+    {
+        fprintf(stderr, "Failed to create database: %s\n",
+                sqlite3_errmsg(db->conn));
         exit(EXIT_FAILURE);
     }
     free(filepath);
+    sqlite3_busy_timeout(db->conn, OPEN_BUSY_TIMEOUT_MS);
 
     prepare_bootstrap_statements(db);
-    execute_statement(pragma_foreign_keys);
-    execute_statement(pragma_auto_vacuum);
-    execute_statement(pragma_secure_delete);
-    execute_statement(create_main_table);
-    execute_statement(create_content_table);
+    execute_statement(db->pragma_foreign_keys);
+    execute_statement(db->pragma_auto_vacuum);
+    execute_statement(db->pragma_secure_delete);
+    execute_statement(db->create_main_table);
+    execute_statement(db->create_content_table);
 
     prepare_index_statements(db);
-    execute_statement(create_data_index);
-    execute_statement(create_timestamp_index);
-    execute_statement(create_mime_index);
-    execute_statement(create_snippet_index);
-    execute_statement(create_thumbnail_index);
-    execute_statement(create_hash_index);
-
+    execute_statement(db->create_timestamp_index);
+    execute_statement(db->create_mime_index);
+    execute_statement(db->create_snippet_index);
+    execute_statement(db->create_thumbnail_index);
+    execute_statement(db->create_hash_index);
+
+    register_functions(db);
+    migrate_database(db);
+    create_compression_contexts(db);
     prepare_all_statements(db);
+    load_current_dictionary(db);
+    sqlite3_busy_timeout(db->conn, 0);
 
     return db;
 }
 
 /* Open an existing database */
-sqlite3 *database_open(char *filepath)
+struct database *database_open(char *filepath)
 {
-    filepath = (filepath != NULL) ? filepath : find_database_path();
+    filepath = (filepath != NULL) ? filepath : database_default_path();
     if (access(filepath, F_OK) == -1)
     {
         fprintf(stderr, "Could not find database at %s\n", filepath);
         exit(EXIT_FAILURE);
     }
 
-    sqlite3 *db;
-    sqlite3_open(filepath, &db);
-    if (!db)
+    struct database *db = new_handle();
+    sqlite3_open(filepath, &db->conn);
+    if (!db->conn)
     {
-        fprintf(stderr, "Failed to open database: %s\n", sqlite3_errmsg(db));
+        fprintf(stderr, "Failed to open database: %s\n",
+                sqlite3_errmsg(db->conn));
         exit(EXIT_FAILURE);
     }
     free(filepath);
+    sqlite3_busy_timeout(db->conn, OPEN_BUSY_TIMEOUT_MS);
 
     prepare_bootstrap_statements(db);
 
-    execute_statement(pragma_foreign_keys);
-    execute_statement(pragma_auto_vacuum);
-    execute_statement(pragma_secure_delete);
-    execute_statement(create_main_table);
-    execute_statement(create_content_table);
+    execute_statement(db->pragma_foreign_keys);
+    execute_statement(db->pragma_auto_vacuum);
+    execute_statement(db->pragma_secure_delete);
+    execute_statement(db->create_main_table);
+    execute_statement(db->create_content_table);
 
+    register_functions(db);
+    migrate_database(db);
+    create_compression_contexts(db);
     prepare_all_statements(db);
+    load_current_dictionary(db);
+    sqlite3_busy_timeout(db->conn, 0);
 
     return db;
 }
 
-void database_delete_all_entries(sqlite3 *db)
-{
-    execute_statement(delete_all_entries);
-    sqlite3_reset(delete_all_entries);
-}
-
-void database_maintenance(sqlite3 *db)
-{
-    sqlite3_exec(db, "VACUUM;", NULL, NULL, NULL);
-
-    execute_statement(pragma_optimize);
-    sqlite3_reset(pragma_optimize);
-}
-
-void database_close(sqlite3 *db)
-{
-    sqlite3_finalize(select_latest_entries);
-    sqlite3_finalize(select_entry);
-    sqlite3_finalize(delete_old_entries);
-    sqlite3_finalize(pragma_foreign_keys);
-    sqlite3_finalize(insert_entry_content);
-    sqlite3_finalize(insert_entry);
-    sqlite3_finalize(create_main_table);
-    sqlite3_finalize(create_content_table);
-    sqlite3_finalize(find_matching_entries);
-    sqlite3_finalize(select_snippet);
-    sqlite3_finalize(find_matching_types);
-    sqlite3_finalize(delete_entry);
-    sqlite3_finalize(total_entries);
-    sqlite3_finalize(select_thumbnail);
-    sqlite3_finalize(delete_duplicate_entries);
-    sqlite3_finalize(delete_last_entries);
-    sqlite3_finalize(create_data_index);
-    sqlite3_finalize(create_mime_index);
-    sqlite3_finalize(create_snippet_index);
-    sqlite3_finalize(create_thumbnail_index);
-    sqlite3_finalize(create_timestamp_index);
-    sqlite3_finalize(create_hash_index);
-    sqlite3_finalize(delete_large_entries);
-    sqlite3_finalize(find_matching_entries_glob);
-    sqlite3_finalize(pragma_secure_delete);
-    sqlite3_finalize(pragma_auto_vacuum);
-    sqlite3_finalize(pragma_optimize);
-    sqlite3_finalize(select_size);
-    sqlite3_finalize(find_entry_from_snippet);
-    sqlite3_finalize(delete_all_entries);
-    sqlite3_db_release_memory(db);
-    sqlite3_close(db);
+void database_delete_all_entries(struct database *db)
+{
+    execute_statement(db->delete_all_entries);
+    sqlite3_reset(db->delete_all_entries);
+}
+
+void database_maintenance(struct database *db)
+{
+    sqlite3_exec(db->conn, "VACUUM;", NULL, NULL, NULL);
+
+    execute_statement(db->pragma_optimize);
+    sqlite3_reset(db->pragma_optimize);
+}
+
+void database_close(struct database *db)
+{
+    sqlite3_finalize(db->select_latest_entries);
+    sqlite3_finalize(db->select_entry);
+    sqlite3_finalize(db->delete_old_entries);
+    sqlite3_finalize(db->pragma_foreign_keys);
+    sqlite3_finalize(db->insert_entry_content);
+    sqlite3_finalize(db->insert_entry);
+    sqlite3_finalize(db->create_main_table);
+    sqlite3_finalize(db->create_content_table);
+    sqlite3_finalize(db->select_snippet);
+    sqlite3_finalize(db->delete_entry);
+    sqlite3_finalize(db->total_entries);
+    sqlite3_finalize(db->select_thumbnail);
+    sqlite3_finalize(db->delete_duplicate_entries);
+    sqlite3_finalize(db->delete_last_entries);
+    sqlite3_finalize(db->create_mime_index);
+    sqlite3_finalize(db->create_snippet_index);
+    sqlite3_finalize(db->create_thumbnail_index);
+    sqlite3_finalize(db->create_timestamp_index);
+    sqlite3_finalize(db->create_hash_index);
+    sqlite3_finalize(db->delete_large_entries);
+    for (int i = 0; i < NUMBER_OF_SHAPES; i++)
+    {
+        sqlite3_finalize(db->query_statements[i]);
+        db->query_statements[i] = NULL;
+    }
+    sqlite3_finalize(db->find_matching_snippets);
+    sqlite3_finalize(db->scan_matching_entries);
+    sqlite3_finalize(db->scan_matching_entries_glob);
+    sqlite3_finalize(db->scan_matching_entries_regex);
+    sqlite3_finalize(db->pragma_secure_delete);
+    sqlite3_finalize(db->pragma_auto_vacuum);
+    sqlite3_finalize(db->pragma_optimize);
+    sqlite3_finalize(db->select_size);
+    sqlite3_finalize(db->find_entry_from_snippet);
+    sqlite3_finalize(db->delete_all_entries);
+    sqlite3_finalize(db->insert_dictionary);
+    sqlite3_finalize(db->select_dictionary);
+    sqlite3_finalize(db->select_latest_dictionary);
+    sqlite3_finalize(db->select_dictionary_samples);
+    sqlite3_finalize(db->count_undictionaried_entries);
+    sqlite3_finalize(db->delete_unused_dictionaries);
+    sqlite3_finalize(db->select_cold_content);
+    sqlite3_finalize(db->update_cold_content);
+    sqlite3_finalize(db->insert_chunk);
+    sqlite3_finalize(db->insert_chunk_ref);
+    sqlite3_finalize(db->find_chunk);
+    sqlite3_finalize(db->select_chunk);
+    sqlite3_finalize(db->insert_search_text);
+    sqlite3_finalize(db->insert_search_filter);
+    sqlite3_finalize(db->select_unindexed_entries);
+    sqlite3_finalize(db->select_all_search_text);
+    sqlite3_finalize(db->select_data_version);
+    sqlite3_finalize(db->select_usage);
+    sqlite3_finalize(db->select_usage_from_hash);
+    sqlite3_finalize(db->replace_usage);
+    sqlite3_finalize(db->select_frecent_entries);
+    sqlite3_finalize(db->insert_renewed_entry);
+    for (int i = 0; i < NUMBER_OF_ENTRY_TABLES; i++)
+    {
+        sqlite3_finalize(db->move_entry_rows[i]);
+    }
+    sqlite3_finalize(db->select_index_entries);
+    sqlite3_finalize(db->select_search_text);
+    free_fuzzy_candidates(db);
+    free_search_record(&db->last_search);
+    free_search_record(&db->current_search);
+
+    int num_of_slots =
+        sizeof(db->loaded_dictionaries) / sizeof(db->loaded_dictionaries[0]);
+    for (int i = 0; i < num_of_slots; i++)
+    {
+        ZSTD_freeDDict(db->loaded_dictionaries[i].ddict);
+        db->loaded_dictionaries[i].ddict = NULL;
+    }
+    ZSTD_freeCDict(db->current_dictionary);
+    db->current_dictionary = NULL;
+    ZSTD_freeCCtx(db->compress_context);
+    ZSTD_freeDCtx(db->decompress_context);
+
+    sqlite3_db_release_memory(db->conn);
+    sqlite3_close(db->conn);
+    free(db);
 }
@@ -1,4 +1,5 @@
 #include <sqlite3.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include "clipboard.h"
 
@@ -10,41 +11,185 @@ enum search_type
     CONTENT,
     MIME_TYPE,
     GLOB,
+    /* Ranked by how well the entry matches instead of by age */
+    FUZZY,
+    /* PCRE2 syntax, ignoring case */
+    REGEX,
     TIMESTAMP // TODO
 };
 
-sqlite3 *database_init(char *filepath);
+/* A single search result, the snippet is only valid during the callback */
+struct search_match
+{
+    int64_t id;
+    const char *snippet;
+    /* How closely it matched, only set by fuzzy searches */
+    int32_t score;
+};
+
+struct query;
+
+/* A connection to the database and everything prepared on it. A handle is
+ * only ever used by one thread at a time */
+struct database;
+
+/* What kapd keeps in memory about an entry, only valid during the callback */
+struct index_entry
+{
+    int64_t id;
+    const char *timestamp;
+    const char *snippet;
+    /* NULL if its search text hasn't been extracted yet */
+    const char *text;
+    size_t text_len;
+    /* Separated by newlines */
+    const char *mime_types;
+    /* Of the largest type */
+    int64_t size;
+};
+
+/* What a row of a list shows of an entry */
+struct entry_row
+{
+    int64_t id;
+    char *snippet;
+    /* NULL if the entry has no thumbnail */
+    void *thumbnail;
+    size_t thumbnail_len;
+};
+
+/* Called with each match as soon as it's found, returning false stops the
+ * search */
+typedef bool (*search_callback)(const struct search_match *match,
+                                void *user_data);
+typedef void (*index_callback)(const struct index_entry *entry,
+                               void *user_data);
+
+/* The ids of every match, for when they're only used once the search is
+ * done. Starts out empty, the ids are freed by the caller */
+struct id_list
+{
+    int64_t *ids;
+    uint32_t len;
+    uint32_t size;
+};
+
+/* A search_callback that adds each match to the id_list in user_data */
+bool database_collect_match(const struct search_match *match, void *user_data);
+
+struct database *database_init(char *filepath);
 /* Exits the program if the database cannot be found */
-sqlite3 *database_open(char *filepath);
-void database_close(sqlite3 *db);
-void database_maintenance(sqlite3 *db);
-uint64_t database_get_size(sqlite3 *db);
-
-void database_insert_entry(sqlite3 *db, source_buffer *src);
-
-uint32_t database_get_total_entries(sqlite3 *db);
-char *database_get_snippet(sqlite3 *db, int64_t id);
-void *database_get_thumbnail(sqlite3 *db, int64_t id, size_t *len);
-bool database_get_entry(sqlite3 *db, int64_t id, source_buffer *src);
-uint32_t database_get_latest_entries(sqlite3 *db, uint32_t num_of_entries,
-                                     uint32_t offset, int64_t *list_of_ids);
-
-uint32_t database_find_matching_entries(sqlite3 *db, void *match, size_t length,
-                                        uint32_t num_of_entries,
-                                        int64_t *list_of_ids,
-                                        enum search_type type);
-int64_t database_find_entry_from_snippet(sqlite3 *db, char *snippet,
+struct database *database_open(char *filepath);
+void database_close(struct database *db);
+void database_maintenance(struct database *db);
+/* Trains a new compression dictionary for text once enough new entries have
+ * been added since the last one, returns true if one was trained */
+bool database_train_dictionary(struct database *db);
+/* Recompresses a batch of entries older than the specified number of days
+ * with slower settings, returns the number of rows looked at */
+uint32_t database_recompress_cold_entries(struct database *db, int32_t days,
+                                          uint32_t num_of_rows);
+/* Data of a single type at least this many bytes long is split into chunks
+ * that are shared with other entries, 0 disables it */
+void database_set_chunk_threshold(struct database *db, size_t threshold);
+/* Extracts the search text of a batch of entries saved before it was done
+ * at capture time. Their ids are put in ids, which must fit num_of_entries,
+ * returns the number of entries indexed */
+uint32_t database_index_search_text(struct database *db,
+                                    uint32_t num_of_entries, int64_t *ids);
+uint64_t database_get_size(struct database *db);
+
+void database_insert_entry(struct database *db, source_buffer *src);
+
+uint32_t database_get_total_entries(struct database *db);
+char *database_get_snippet(struct database *db, int64_t id);
+void *database_get_thumbnail(struct database *db, int64_t id, size_t *len);
+bool database_get_entry(struct database *db, int64_t id, source_buffer *src);
+uint32_t database_get_latest_entries(struct database *db,
+                                     uint32_t num_of_entries, uint32_t offset,
+                                     int64_t *list_of_ids);
+/* Entries that are copied and pasted often and recently come first */
+uint32_t database_get_frecent_entries(struct database *db,
+                                      uint32_t num_of_entries, uint32_t offset,
+                                      int64_t *list_of_ids);
+/* Counts a paste of the entry towards its frecency, copies are counted when
+ * they're inserted */
+void database_record_use(struct database *db, int64_t id);
+/* Moves an entry to the top of the history as if it was copied again.
+ * Returns its new id, or 0 if it doesn't exist */
+int64_t database_renew_entry(struct database *db, int64_t id);
+/* Every entry newer than after, oldest first */
+void database_get_index_entries(struct database *db, int64_t after,
+                                index_callback callback, void *user_data);
+/* NULL if the entry's search text hasn't been extracted yet */
+char *database_get_search_text(struct database *db, int64_t id,
+                               size_t *len);
+/* Changes whenever another connection commits to the database */
+int64_t database_get_data_version(struct database *db);
+/* $XDG_DATA_HOME/kaprica/history.db or
+ * $HOME/.local/share/kaprica/history.db, creating the directory if needed */
+char *database_default_path(void);
+/* Whether db is the database at filepath, NULL meaning the default one */
+bool database_is_file(struct database *db, const char *filepath);
+/* The file the database was opened from */
+const char *database_get_path(struct database *db);
+/* A read only handle of the calling thread's own, so other threads can read
+ * while the one that opened the database writes. It's opened the first time
+ * the thread asks for it and closed when the thread exits */
+struct database *database_get_reader(const char *filepath);
+/* Returns false if the entry doesn't exist */
+bool database_read_row(struct database *db, int64_t id,
+                       struct entry_row *row);
+void database_free_row(struct entry_row *row);
+
+/* Matches are newest first, or best first for fuzzy searches. Stops after
+ * limit matches, 0 for no limit, and returns the number of matches */
+uint32_t database_search(struct database *db, void *match, size_t length,
+                         uint32_t limit, enum search_type type,
+                         search_callback callback, void *user_data);
+/* The same, but with every filter of the query applied at once */
+uint32_t database_query(struct database *db, const struct query *query,
+                        uint32_t limit, search_callback callback,
+                        void *user_data);
+/* True if the entry matches the text and every filter of the query, fuzzy
+ * queries only have their filters checked */
+bool database_query_matches(struct database *db, const struct query *query,
+                            int64_t id);
+/* Only looks at the snippets, which is quick but may miss some matches */
+uint32_t database_find_matching_snippets(struct database *db, void *match,
+                                         size_t length,
+                                         uint32_t num_of_entries,
+                                         int64_t *list_of_ids);
+/* Searches up to num_of_entries entries older than before, newest first, so
+ * a long search can be done in steps. before is set to where the next step
+ * should continue from, or 0 once every entry has been searched */
+uint32_t database_find_matching_entries_before(struct database *db,
+                                               void *match, size_t length,
+                                               int64_t *before,
+                                               uint32_t num_of_entries,
+                                               int64_t *list_of_ids,
+                                               enum search_type type);
+/* Searches run by the calling thread stop early, returning what was found so
+ * far, once cancelled is set from another thread. NULL turns it off again */
+void database_set_search_cancellation(const atomic_bool *cancelled);
+/* True if the last plain search run to the end can be narrowed down to this
+ * one, which makes database_find_matching_entries_before() only look at its
+ * matches instead of every entry */
+bool database_can_refine_search(struct database *db, void *match,
+                                size_t length, enum search_type type);
+int64_t database_find_entry_from_snippet(struct database *db, char *snippet,
                                          size_t length);
 
-void database_delete_entry(sqlite3 *db, int64_t id);
-// TODO: void database_delete_all_entries(sqlite3 *db);
+void database_delete_entry(struct database *db, int64_t id);
+// TODO: void database_delete_all_entries(struct database *db);
 /* Deletes entries older than the specified number of days */
-uint32_t database_delete_old_entries(sqlite3 *db, int32_t days);
+uint32_t database_delete_old_entries(struct database *db, int32_t days);
 /* Deletes the oldest entries */
-uint32_t database_delete_last_entries(sqlite3 *db, uint32_t num_of_entries);
-uint32_t database_delete_duplicate_entries(sqlite3 *db);
+uint32_t database_delete_last_entries(struct database *db,
+                                      uint32_t num_of_entries);
+uint32_t database_delete_duplicate_entries(struct database *db);
 /* Will ignore entries created within the last 24 hours */
-uint32_t database_delete_largest_entries(sqlite3 *db, uint32_t size);
-void database_delete_all_entries(sqlite3 *db);
+uint32_t database_delete_largest_entries(struct database *db, uint32_t size);
+void database_delete_all_entries(struct database *db);
 
 #endif
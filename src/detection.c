@@ -4,19 +4,83 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <ctype.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
+#include <xxhash.h>
 #include <MagickWand/MagickWand.h>
 #include "xmalloc.h"
 #include "detection.h"
 #include "clipboard.h"
 
+enum transcode_defaults
+{
+    TRANSCODE_CACHE_SIZE = 4
+};
+
+enum search_text_defaults
+{
+    /* Only the start of very large entries is searchable */
+    MAX_SEARCH_TEXT_LENGTH = 1048576,
+    MAX_ENTITY_LENGTH = 10
+};
+
+/* Formats the search text can be extracted from, in order of preference */
+enum text_format
+{
+    FORMAT_NONE,
+    FORMAT_OTHER,
+    FORMAT_RTF,
+    FORMAT_HTML,
+    FORMAT_PLAIN
+};
+
+/* Search text is built up a character at a time, folding case and
+ * collapsing whitespace as it goes */
+struct text_builder
+{
+    char *text;
+    size_t len;
+    size_t size;
+    bool pending_space;
+};
+
 struct length_type
 {
     size_t length;
     int type;
 };
 
+/* Raster formats that applications commonly offer side by side for the
+ * same image, any of them can be regenerated from a lossless one */
+struct image_format
+{
+    const char *mime_type;
+    const char *format;
+    bool lossless;
+};
+
+static const struct image_format image_formats[] = {
+    {"image/png", "PNG", true},    {"image/bmp", "BMP", true},
+    {"image/x-bmp", "BMP", true},  {"image/x-ms-bmp", "BMP", true},
+    {"image/tiff", "TIFF", true},  {"image/x-tiff", "TIFF", true},
+    {"image/jpeg", "JPEG", false}, {"image/jpg", "JPEG", false},
+    {"image/webp", "WEBP", false}};
+
+/* Recently transcoded images so repeated pastes don't re-encode */
+struct transcode_cache_entry
+{
+    uint64_t image_hash;
+    const struct image_format *format;
+    void *data;
+    size_t len;
+    uint64_t last_used;
+};
+
+static struct transcode_cache_entry transcode_cache[TRANSCODE_CACHE_SIZE];
+static uint64_t transcode_clock = 0;
+
 static char *find_exact_type(const void *data, size_t length)
 {
     magic_t magic = magic_open(MAGIC_MIME_TYPE | MAGIC_RAW);
@@ -110,6 +174,18 @@ static bool is_explicit_text(const char *mime_type)
     return false;
 }
 
+bool is_text_type(const char *mime_type)
+{
+    if (is_utf8_text(mime_type) || is_explicit_text(mime_type) ||
+        !strcmp("application/rtf", mime_type) ||
+        !strcmp("application/xml", mime_type) ||
+        !strcmp("application/json", mime_type))
+    {
+        return true;
+    }
+    return false;
+}
+
 static bool is_image(const char *mime_type)
 {
     if (!strncmp("image/", mime_type, strlen("image/")))
@@ -289,6 +365,457 @@ void get_snippet(source_buffer *src)
     }
 }
 
+static void append_char(struct text_builder *builder, char c)
+{
+    if (builder->len >= MAX_SEARCH_TEXT_LENGTH || c == '\0')
+    {
+        return;
+    }
+    if (isspace((unsigned char)c))
+    {
+        builder->pending_space = builder->len > 0;
+        return;
+    }
+
+    /* Room for a pending space, the character and the terminator */
+    if (builder->len + 3 > builder->size)
+    {
+        builder->size = builder->size ? builder->size * 2 : SNIPPET_SIZE;
+        builder->text = xrealloc(builder->text, builder->size);
+    }
+    if (builder->pending_space)
+    {
+        builder->text[builder->len++] = ' ';
+        builder->pending_space = false;
+    }
+    /* Only ASCII is case folded, the same as LIKE */
+    builder->text[builder->len++] =
+        ((unsigned char)c < 0x80) ? tolower((unsigned char)c) : c;
+}
+
+static void append_codepoint(struct text_builder *builder, uint32_t codepoint)
+{
+    /* No-break space */
+    if (codepoint == 0xa0)
+    {
+        append_char(builder, ' ');
+    }
+    else if (codepoint < 0x80)
+    {
+        append_char(builder, codepoint);
+    }
+    else if (codepoint < 0x800)
+    {
+        append_char(builder, 0xc0 | (codepoint >> 6));
+        append_char(builder, 0x80 | (codepoint & 0x3f));
+    }
+    else if (codepoint < 0x10000)
+    {
+        append_char(builder, 0xe0 | (codepoint >> 12));
+        append_char(builder, 0x80 | ((codepoint >> 6) & 0x3f));
+        append_char(builder, 0x80 | (codepoint & 0x3f));
+    }
+    else if (codepoint < 0x110000)
+    {
+        append_char(builder, 0xf0 | (codepoint >> 18));
+        append_char(builder, 0x80 | ((codepoint >> 12) & 0x3f));
+        append_char(builder, 0x80 | ((codepoint >> 6) & 0x3f));
+        append_char(builder, 0x80 | (codepoint & 0x3f));
+    }
+}
+
+/* Returns the position of the needle after the start, or the length of the
+ * data if it isn't found */
+static size_t find_ignoring_case(const char *data, size_t len, size_t start,
+                                 const char *needle)
+{
+    size_t needle_len = strlen(needle);
+    for (size_t i = start; i + needle_len <= len; i++)
+    {
+        if (!strncasecmp(data + i, needle, needle_len))
+        {
+            return i;
+        }
+    }
+    return len;
+}
+
+static enum text_format find_text_format(const char *mime_type)
+{
+    if (is_utf8_text(mime_type) || !strcmp("TEXT", mime_type) ||
+        !strcmp("STRING", mime_type) ||
+        !strncmp("text/plain", mime_type, strlen("text/plain")))
+    {
+        return FORMAT_PLAIN;
+    }
+    else if (!strncmp("text/html", mime_type, strlen("text/html")))
+    {
+        return FORMAT_HTML;
+    }
+    else if (!strcmp("text/rtf", mime_type) ||
+             !strcmp("application/rtf", mime_type))
+    {
+        return FORMAT_RTF;
+    }
+    else if (is_text_type(mime_type))
+    {
+        return FORMAT_OTHER;
+    }
+    return FORMAT_NONE;
+}
+
+struct named_entity
+{
+    const char *name;
+    uint32_t codepoint;
+};
+
+static const struct named_entity named_entities[] = {
+    {"amp", '&'},       {"lt", '<'},        {"gt", '>'},
+    {"quot", '"'},      {"apos", '\''},     {"nbsp", 0xa0},
+    {"copy", 0xa9},     {"reg", 0xae},      {"hellip", 0x2026},
+    {"mdash", 0x2014},  {"ndash", 0x2013}};
+
+/* Decodes the entity at the start of the data, returns how many bytes it
+ * took up or 0 if it isn't one */
+static size_t decode_entity(const char *data, size_t len,
+                            struct text_builder *builder)
+{
+    size_t end = 1;
+    while (end < len && end < MAX_ENTITY_LENGTH && data[end] != ';')
+    {
+        end++;
+    }
+    if (end >= len || data[end] != ';')
+    {
+        return 0;
+    }
+
+    if (data[1] == '#')
+    {
+        char *number_end;
+        bool hex = data[2] == 'x' || data[2] == 'X';
+        uint32_t codepoint =
+            strtoul(data + (hex ? 3 : 2), &number_end, hex ? 16 : 10);
+        if (number_end != data + end)
+        {
+            return 0;
+        }
+        append_codepoint(builder, codepoint);
+        return end + 1;
+    }
+
+    int num_of_entities = sizeof(named_entities) / sizeof(named_entities[0]);
+    for (int i = 0; i < num_of_entities; i++)
+    {
+        if (strlen(named_entities[i].name) == end - 1 &&
+            !strncmp(named_entities[i].name, data + 1, end - 1))
+        {
+            append_codepoint(builder, named_entities[i].codepoint);
+            return end + 1;
+        }
+    }
+    return 0;
+}
+
+/* Tags that start a new line when rendered, the rest are dropped without
+ * separating the text around them */
+static const char *const block_tags[] = {
+    "br", "p", "div", "li", "tr", "td", "th", "h1", "h2", "h3", "h4",
+    "h5", "h6", "ul", "ol", "table", "blockquote", "pre", "hr", "title"};
+
+static void extract_html(const char *data, size_t len,
+                         struct text_builder *builder)
+{
+    size_t i = 0;
+    while (i < len)
+    {
+        if (data[i] == '&')
+        {
+            size_t entity_len = decode_entity(data + i, len - i, builder);
+            if (entity_len)
+            {
+                i += entity_len;
+                continue;
+            }
+        }
+        if (data[i] != '<')
+        {
+            append_char(builder, data[i]);
+            i++;
+            continue;
+        }
+
+        if (i + 4 <= len && !strncmp(data + i, "<!--", 4))
+        {
+            i = find_ignoring_case(data, len, i + 4, "-->") + 3;
+            continue;
+        }
+
+        size_t name = i + 1 + (i + 1 < len && data[i + 1] == '/');
+        size_t name_len = 0;
+        while (name + name_len < len &&
+               isalnum((unsigned char)data[name + name_len]))
+        {
+            name_len++;
+        }
+        i = find_ignoring_case(data, len, i, ">") + 1;
+
+        /* Scripts and styles aren't text the user can see */
+        if (data[name - 1] != '/' &&
+            ((name_len == 6 && !strncasecmp(data + name, "script", 6)) ||
+             (name_len == 5 && !strncasecmp(data + name, "style", 5))))
+        {
+            i = find_ignoring_case(data, len, i,
+                                   name_len == 6 ? "</script" : "</style");
+            i = find_ignoring_case(data, len, i, ">") + 1;
+            continue;
+        }
+
+        int num_of_tags = sizeof(block_tags) / sizeof(block_tags[0]);
+        for (int j = 0; j < num_of_tags; j++)
+        {
+            if (strlen(block_tags[j]) == name_len &&
+                !strncasecmp(data + name, block_tags[j], name_len))
+            {
+                append_char(builder, ' ');
+                break;
+            }
+        }
+    }
+}
+
+/* Groups that hold document settings rather than text */
+static const char *const rtf_destinations[] = {
+    "fonttbl", "colortbl", "stylesheet", "info", "pict", "listtable",
+    "listoverridetable", "rsidtbl", "generator", "themedata",
+    "colorschememapping", "latentstyles", "datastore", "xmlnstbl"};
+
+static bool is_rtf_destination(const char *word, size_t len)
+{
+    int num_of_destinations =
+        sizeof(rtf_destinations) / sizeof(rtf_destinations[0]);
+    for (int i = 0; i < num_of_destinations; i++)
+    {
+        if (strlen(rtf_destinations[i]) == len &&
+            !strncmp(rtf_destinations[i], word, len))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void extract_rtf(const char *data, size_t len,
+                        struct text_builder *builder)
+{
+    int depth = 0, skip_depth = 0;
+    /* Characters following \u that readers without unicode would show */
+    long fallback_length = 1, fallback = 0;
+
+    size_t i = 0;
+    while (i < len)
+    {
+        char c = data[i];
+        if (c == '{')
+        {
+            depth++;
+            i++;
+            if (!skip_depth && i + 1 < len && data[i] == '\\')
+            {
+                size_t word_len = 0;
+                while (i + 1 + word_len < len &&
+                       isalpha((unsigned char)data[i + 1 + word_len]))
+                {
+                    word_len++;
+                }
+                if (data[i + 1] == '*' ||
+                    is_rtf_destination(data + i + 1, word_len))
+                {
+                    skip_depth = depth;
+                }
+            }
+            continue;
+        }
+        if (c == '}')
+        {
+            if (skip_depth == depth)
+            {
+                skip_depth = 0;
+            }
+            depth--;
+            i++;
+            continue;
+        }
+        if (c == '\r' || c == '\n')
+        {
+            i++;
+            continue;
+        }
+        if (c != '\\')
+        {
+            if (!skip_depth && fallback > 0)
+            {
+                fallback--;
+            }
+            else if (!skip_depth)
+            {
+                append_char(builder, c);
+            }
+            i++;
+            continue;
+        }
+
+        /* Control symbols */
+        i++;
+        if (i >= len)
+        {
+            break;
+        }
+        if (!isalpha((unsigned char)data[i]))
+        {
+            c = data[i];
+            i++;
+            if (skip_depth)
+            {
+                continue;
+            }
+            if (c == '\\' || c == '{' || c == '}')
+            {
+                append_char(builder, c);
+            }
+            else if (c == '~')
+            {
+                append_char(builder, ' ');
+            }
+            else if (c == '\'' && i + 2 <= len)
+            {
+                char hex[3] = {data[i], data[i + 1], '\0'};
+                i += 2;
+                if (fallback > 0)
+                {
+                    fallback--;
+                }
+                else
+                {
+                    /* Close enough to the usual Windows-1252 code page */
+                    append_codepoint(builder, strtoul(hex, NULL, 16));
+                }
+            }
+            continue;
+        }
+
+        /* Control words, with an optional numeric parameter and a space
+         * that's part of the word */
+        const char *word = data + i;
+        size_t word_len = 0;
+        while (i < len && isalpha((unsigned char)data[i]))
+        {
+            word_len++;
+            i++;
+        }
+        /* The data isn't terminated so strtol() can't be used */
+        bool negative = i < len && data[i] == '-';
+        long parameter = 0;
+        i += negative;
+        while (i < len && isdigit((unsigned char)data[i]))
+        {
+            parameter = parameter * 10 + (data[i] - '0');
+            i++;
+        }
+        parameter = negative ? -parameter : parameter;
+        if (i < len && data[i] == ' ')
+        {
+            i++;
+        }
+        if (skip_depth)
+        {
+            continue;
+        }
+
+        if ((word_len == 3 && (!strncmp(word, "par", 3) ||
+                               !strncmp(word, "tab", 3) ||
+                               !strncmp(word, "row", 3))) ||
+            (word_len == 4 && (!strncmp(word, "line", 4) ||
+                               !strncmp(word, "cell", 4) ||
+                               !strncmp(word, "page", 4))))
+        {
+            append_char(builder, ' ');
+        }
+        else if (word_len == 1 && word[0] == 'u')
+        {
+            append_codepoint(builder,
+                             (parameter < 0) ? parameter + 65536 : parameter);
+            fallback = fallback_length;
+        }
+        else if (word_len == 2 && !strncmp(word, "uc", 2))
+        {
+            fallback_length = parameter;
+        }
+    }
+}
+
+static void extract_text(const char *data, size_t len, enum text_format format,
+                         struct text_builder *builder)
+{
+    if (format == FORMAT_HTML)
+    {
+        extract_html(data, len, builder);
+    }
+    else if (format == FORMAT_RTF)
+    {
+        extract_rtf(data, len, builder);
+    }
+    else
+    {
+        for (size_t i = 0; i < len; i++)
+        {
+            append_char(builder, data[i]);
+        }
+    }
+}
+
+void get_search_text(source_buffer *src)
+{
+    enum text_format best_format = FORMAT_NONE;
+    int best_type = -1;
+    for (int i = 0; i < src->num_types; i++)
+    {
+        enum text_format format = find_text_format(src->types[i]);
+        if (src->data[i] && format > best_format)
+        {
+            best_format = format;
+            best_type = i;
+        }
+    }
+
+    struct text_builder builder = {0};
+    if (best_type != -1)
+    {
+        extract_text(src->data[best_type], src->len[best_type], best_format,
+                     &builder);
+    }
+
+    if (builder.text)
+    {
+        builder.text[builder.len] = '\0';
+    }
+    free(src->search_text);
+    src->search_text = builder.text ? builder.text : xstrdup("");
+}
+
+char *normalize_search_text(const char *text, size_t len)
+{
+    struct text_builder builder = {0};
+    extract_text(text, len, FORMAT_PLAIN, &builder);
+    if (!builder.text)
+    {
+        return xstrdup("");
+    }
+    builder.text[builder.len] = '\0';
+    return builder.text;
+}
+
 /* Sort length types in descending order */
 static int compare_size_t(const void *a, const void *b)
 {
@@ -352,3 +879,196 @@ void get_thumbnail(source_buffer *src)
     DestroyMagickWand(wand);
     MagickWandTerminus();
 }
+
+static const struct image_format *find_image_format(const char *mime_type)
+{
+    size_t num_of_formats = sizeof(image_formats) / sizeof(image_formats[0]);
+    for (int i = 0; i < num_of_formats; i++)
+    {
+        if (!strcasecmp(image_formats[i].mime_type, mime_type))
+        {
+            return &image_formats[i];
+        }
+    }
+    return NULL;
+}
+
+/* PNG is preferred, otherwise the smallest lossless encoding is kept */
+static int8_t find_canonical_image(source_buffer *src)
+{
+    int8_t canonical = -1;
+    for (int i = 0; i < src->num_types; i++)
+    {
+        const struct image_format *format = find_image_format(src->types[i]);
+        if (!format || !format->lossless || !src->data[i])
+        {
+            continue;
+        }
+
+        if (!strcasecmp(src->types[i], "image/png"))
+        {
+            return i;
+        }
+        if (canonical == -1 || src->len[i] < src->len[canonical])
+        {
+            canonical = i;
+        }
+    }
+    return canonical;
+}
+
+static bool get_image_size(const void *data, size_t len, size_t *width,
+                           size_t *height)
+{
+    MagickWand *wand = NewMagickWand();
+    if (MagickPingImageBlob(wand, data, len) == MagickFalse)
+    {
+        DestroyMagickWand(wand);
+        return false;
+    }
+
+    *width = MagickGetImageWidth(wand);
+    *height = MagickGetImageHeight(wand);
+    DestroyMagickWand(wand);
+
+    return true;
+}
+
+void collapse_image_types(source_buffer *src)
+{
+    int8_t canonical = find_canonical_image(src);
+    if (canonical == -1)
+    {
+        return;
+    }
+
+    size_t width, height;
+    if (!get_image_size(src->data[canonical], src->len[canonical], &width,
+                        &height))
+    {
+        return;
+    }
+
+    for (int i = 0; i < src->num_types; i++)
+    {
+        if (i == canonical || !src->data[i] ||
+            !find_image_format(src->types[i]))
+        {
+            continue;
+        }
+
+        /* Only drop a variant if it is the same bitmap, some applications
+         * offer a different image such as an icon in another format */
+        size_t variant_width, variant_height;
+        if (!get_image_size(src->data[i], src->len[i], &variant_width,
+                            &variant_height) ||
+            variant_width != width || variant_height != height)
+        {
+            continue;
+        }
+
+        free(src->data[i]);
+        src->data[i] = NULL;
+        src->len[i] = 0;
+    }
+}
+
+const void *get_transcoded_image(source_buffer *src, uint8_t type,
+                                 size_t *len)
+{
+    const struct image_format *format = find_image_format(src->types[type]);
+    int8_t canonical = find_canonical_image(src);
+    if (!format || canonical == -1)
+    {
+        return NULL;
+    }
+
+    uint64_t image_hash =
+        XXH3_64bits(src->data[canonical], src->len[canonical]);
+
+    /* Look for a cached copy while keeping track of the least recently used
+     * slot to evict in case there is none */
+    struct transcode_cache_entry *slot = &transcode_cache[0];
+    for (int i = 0; i < TRANSCODE_CACHE_SIZE; i++)
+    {
+        struct transcode_cache_entry *entry = &transcode_cache[i];
+        if (entry->data && entry->image_hash == image_hash &&
+            entry->format == format)
+        {
+            entry->last_used = ++transcode_clock;
+            *len = entry->len;
+            return entry->data;
+        }
+        if (entry->last_used < slot->last_used)
+        {
+            slot = entry;
+        }
+    }
+
+    MagickWand *wand = NewMagickWand();
+    if (MagickReadImageBlob(wand, src->data[canonical],
+                            src->len[canonical]) == MagickFalse)
+    {
+        ExceptionType severity;
+        char *error = MagickGetException(wand, &severity);
+        fprintf(stderr, "Error reading image blob: %s\n", error);
+        MagickRelinquishMemory(error);
+        DestroyMagickWand(wand);
+        return NULL;
+    }
+
+    size_t length;
+    MagickSetImageFormat(wand, format->format);
+    unsigned char *blob = MagickGetImageBlob(wand, &length);
+    DestroyMagickWand(wand);
+    if (!blob)
+    {
+        fprintf(stderr, "Failed to transcode image to %s\n",
+                src->types[type]);
+        return NULL;
+    }
+
+    free(slot->data);
+    slot->data = xmalloc(length);
+    memcpy(slot->data, blob, length);
+    MagickRelinquishMemory(blob);
+    slot->len = length;
+    slot->format = format;
+    slot->image_hash = image_hash;
+    slot->last_used = ++transcode_clock;
+
+    *len = length;
+    return slot->data;
+}
+
+void *optimize_png(const void *data, size_t len, size_t *optimized_len)
+{
+    MagickWand *wand = NewMagickWand();
+    if (MagickReadImageBlob(wand, data, len) == MagickFalse)
+    {
+        DestroyMagickWand(wand);
+        return NULL;
+    }
+
+    /* For PNG the tens digit of the quality is the zlib level and the ones
+     * digit the filter, 5 tries every filter on each row */
+    MagickSetImageFormat(wand, "PNG");
+    MagickSetImageCompressionQuality(wand, 95);
+    MagickSetOption(wand, "png:exclude-chunks", "date,time");
+
+    size_t length;
+    unsigned char *blob = MagickGetImageBlob(wand, &length);
+    DestroyMagickWand(wand);
+    if (!blob || length >= len)
+    {
+        MagickRelinquishMemory(blob);
+        return NULL;
+    }
+
+    void *optimized = xmalloc(length);
+    memcpy(optimized, blob, length);
+    MagickRelinquishMemory(blob);
+    *optimized_len = length;
+
+    return optimized;
+}
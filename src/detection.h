@@ -7,8 +7,25 @@
 
 void guess_mime_types(source_buffer *src);
 void get_snippet(source_buffer *src);
+/* Extracts the text of the entry that searches run against, markup is
+ * stripped, entities decoded, ASCII case folded and whitespace collapsed */
+void get_search_text(source_buffer *src);
+/* Normalizes a search query the same way as the text it's matched with */
+char *normalize_search_text(const char *text, size_t len);
 void get_thumbnail(source_buffer *src);
 uint8_t find_write_type(source_buffer *src);
 bool is_minimum_length(source_buffer *src, size_t min_length);
+/* Whether the MIME type is known to hold text, without looking at the data */
+bool is_text_type(const char *mime_type);
+/* Keeps one lossless encoding of an image offered in several formats, the
+ * dropped types are left with no data and can be regenerated on demand */
+void collapse_image_types(source_buffer *src);
+/* Returns the given type transcoded from the image kept by
+ * collapse_image_types(), the buffer is owned by an internal cache */
+const void *get_transcoded_image(source_buffer *src, uint8_t type,
+                                 size_t *len);
+/* Losslessly re-encodes a PNG with the highest compression, returns NULL if
+ * it could not be made any smaller */
+void *optimize_png(const void *data, size_t len, size_t *optimized_len);
 
 #endif
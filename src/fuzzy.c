@@ -0,0 +1,201 @@
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fuzzy.h"
+#include "xmalloc.h"
+
+/* Roughly the same weights as fzf so results rank the way people expect */
+enum fuzzy_scores
+{
+    SCORE_MATCH = 16,
+    SCORE_GAP_START = -3,
+    SCORE_GAP_EXTENSION = -1,
+    BONUS_BOUNDARY = 8,
+    BONUS_CONSECUTIVE = 4,
+    BONUS_FIRST_CHAR_MULTIPLIER = 2
+};
+
+static bool is_word(unsigned char c)
+{
+    return isalnum(c) || c >= 0x80;
+}
+
+static int32_t score_term(const char *term, size_t term_len, const char *text,
+                          size_t text_len)
+{
+    /* Find where the first occurrence of the subsequence ends, memchr() is
+     * vectorized so most of the text is skipped over quickly */
+    const char *position = text;
+    const char *end = text + text_len;
+    for (size_t i = 0; i < term_len; i++)
+    {
+        position = memchr(position, term[i], end - position);
+        if (!position)
+        {
+            return -1;
+        }
+        position++;
+    }
+
+    /* Then walk back from there to the closest start, which gives the
+     * shortest match ending at the same place, scoring it on the way */
+    size_t later = position - text - 1;
+    int32_t later_bonus = 0, score = 0;
+    for (size_t i = term_len; i > 0; position--)
+    {
+        size_t current = position - text - 1;
+        if (text[current] != term[i - 1])
+        {
+            continue;
+        }
+        i--;
+
+        int32_t bonus = 0;
+        if (is_word(text[current]) &&
+            (current == 0 || !is_word(text[current - 1])))
+        {
+            bonus = BONUS_BOUNDARY;
+        }
+
+        if (i < term_len - 1)
+        {
+            size_t gap = later - current - 1;
+            if (gap)
+            {
+                score +=
+                    SCORE_GAP_START + (int32_t)(gap - 1) * SCORE_GAP_EXTENSION;
+            }
+            else if (later_bonus < BONUS_CONSECUTIVE)
+            {
+                score += BONUS_CONSECUTIVE - later_bonus;
+            }
+        }
+
+        score += SCORE_MATCH + ((i == 0) ? bonus * BONUS_FIRST_CHAR_MULTIPLIER
+                                         : bonus);
+        later = current;
+        later_bonus = bonus;
+    }
+
+    return score;
+}
+
+uint64_t fuzzy_character_set(const char *text, size_t len)
+{
+    uint64_t set = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (text[i] != ' ')
+        {
+            set |= 1ULL << (text[i] & 63);
+        }
+    }
+    return set;
+}
+
+int32_t fuzzy_score(const char *pattern, const char *text, size_t text_len)
+{
+    int32_t total = 0;
+    while (*pattern)
+    {
+        size_t term_len = strcspn(pattern, " ");
+        if (term_len)
+        {
+            int32_t score = score_term(pattern, term_len, text, text_len);
+            if (score < 0)
+            {
+                return -1;
+            }
+            total += score;
+        }
+        pattern += term_len + (pattern[term_len] == ' ');
+    }
+
+    return total;
+}
+
+/* Whether the first match ranks below the second */
+static bool ranks_below(const struct fuzzy_match *a,
+                        const struct fuzzy_match *b)
+{
+    return a->score < b->score || (a->score == b->score && a->id < b->id);
+}
+
+static void swap_matches(struct fuzzy_match *a, struct fuzzy_match *b)
+{
+    struct fuzzy_match tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+static void sift_down(struct fuzzy_match *heap, uint32_t len, uint32_t i)
+{
+    while (true)
+    {
+        uint32_t lowest = i;
+        uint32_t left = 2 * i + 1, right = 2 * i + 2;
+        if (left < len && ranks_below(&heap[left], &heap[lowest]))
+        {
+            lowest = left;
+        }
+        if (right < len && ranks_below(&heap[right], &heap[lowest]))
+        {
+            lowest = right;
+        }
+        if (lowest == i)
+        {
+            return;
+        }
+        swap_matches(&heap[i], &heap[lowest]);
+        i = lowest;
+    }
+}
+
+void fuzzy_results_init(struct fuzzy_results *results, uint32_t size)
+{
+    results->matches = xmalloc(sizeof(struct fuzzy_match) * (size ? size : 1));
+    results->len = 0;
+    results->size = size;
+}
+
+void fuzzy_results_add(struct fuzzy_results *results, int64_t id,
+                       int32_t score)
+{
+    struct fuzzy_match match = {.id = id, .score = score};
+    struct fuzzy_match *heap = results->matches;
+
+    if (results->len < results->size)
+    {
+        uint32_t i = results->len++;
+        heap[i] = match;
+        while (i > 0 && ranks_below(&heap[i], &heap[(i - 1) / 2]))
+        {
+            swap_matches(&heap[i], &heap[(i - 1) / 2]);
+            i = (i - 1) / 2;
+        }
+    }
+    else if (results->size && ranks_below(&heap[0], &match))
+    {
+        heap[0] = match;
+        sift_down(heap, results->len, 0);
+    }
+}
+
+void fuzzy_results_sort(struct fuzzy_results *results)
+{
+    /* Heapsort in place, repeatedly moving the lowest ranked match to the
+     * end leaves the best one first */
+    for (uint32_t len = results->len; len > 1; len--)
+    {
+        swap_matches(&results->matches[0], &results->matches[len - 1]);
+        sift_down(results->matches, len - 1, 0);
+    }
+}
+
+void fuzzy_results_free(struct fuzzy_results *results)
+{
+    free(results->matches);
+    results->matches = NULL;
+    results->len = 0;
+}
@@ -0,0 +1,43 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef FUZZY_H
+#define FUZZY_H
+
+enum fuzzy_defaults
+{
+    /* Matches further into an entry than this aren't worth ranking */
+    MAX_FUZZY_TEXT_LENGTH = 2048
+};
+
+struct fuzzy_match
+{
+    int64_t id;
+    int32_t score;
+};
+
+/* Keeps the best scoring matches seen so far in a min-heap so the worst of
+ * them can be replaced in O(log n) */
+struct fuzzy_results
+{
+    struct fuzzy_match *matches;
+    uint32_t len;
+    uint32_t size;
+};
+
+/* A set of the characters in the text, a pattern can only match text whose
+ * set contains all of its characters */
+uint64_t fuzzy_character_set(const char *text, size_t len);
+/* Scores how well the text matches the pattern, with each space separated
+ * term of the pattern matched as a subsequence. Both are expected to be
+ * normalized already, returns -1 if any of the terms doesn't match */
+int32_t fuzzy_score(const char *pattern, const char *text, size_t text_len);
+
+void fuzzy_results_init(struct fuzzy_results *results, uint32_t size);
+void fuzzy_results_add(struct fuzzy_results *results, int64_t id,
+                       int32_t score);
+/* Sorts the matches best first, newer entries win ties */
+void fuzzy_results_sort(struct fuzzy_results *results);
+void fuzzy_results_free(struct fuzzy_results *results);
+
+#endif
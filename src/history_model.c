@@ -0,0 +1,209 @@
+#include <gio/gio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "database.h"
+#include "history_model.h"
+#include "xmalloc.h"
+
+struct _HistoryItem
+{
+    GObject parent_instance;
+    int64_t id;
+};
+
+G_DEFINE_TYPE(HistoryItem, history_item, G_TYPE_OBJECT)
+
+static void history_item_class_init(HistoryItemClass *class)
+{
+}
+
+static void history_item_init(HistoryItem *item)
+{
+    item->id = 0;
+}
+
+static HistoryItem *history_item_new(int64_t id)
+{
+    HistoryItem *item = g_object_new(HISTORY_TYPE_ITEM, NULL);
+    item->id = id;
+
+    return item;
+}
+
+int64_t history_item_get_id(HistoryItem *item)
+{
+    return item->id;
+}
+
+struct _HistoryModel
+{
+    GObject parent_instance;
+    int64_t *ids;
+    uint32_t len;
+    uint32_t size;
+};
+
+static GType get_item_type(GListModel *list)
+{
+    return HISTORY_TYPE_ITEM;
+}
+
+static guint get_n_items(GListModel *list)
+{
+    return HISTORY_MODEL(list)->len;
+}
+
+static gpointer get_item(GListModel *list, guint position)
+{
+    HistoryModel *model = HISTORY_MODEL(list);
+    if (position >= model->len)
+    {
+        return NULL;
+    }
+
+    return history_item_new(model->ids[position]);
+}
+
+static void history_model_list_init(GListModelInterface *iface)
+{
+    iface->get_item_type = get_item_type;
+    iface->get_n_items = get_n_items;
+    iface->get_item = get_item;
+}
+
+G_DEFINE_TYPE_WITH_CODE(HistoryModel, history_model, G_TYPE_OBJECT,
+                        G_IMPLEMENT_INTERFACE(G_TYPE_LIST_MODEL,
+                                              history_model_list_init))
+
+static void history_model_finalize(GObject *object)
+{
+    free(HISTORY_MODEL(object)->ids);
+    G_OBJECT_CLASS(history_model_parent_class)->finalize(object);
+}
+
+static void history_model_class_init(HistoryModelClass *class)
+{
+    G_OBJECT_CLASS(class)->finalize = history_model_finalize;
+}
+
+static void history_model_init(HistoryModel *model)
+{
+    model->ids = NULL;
+    model->len = 0;
+    model->size = 0;
+}
+
+static void load_ids(HistoryModel *model, struct database *db, bool frecency)
+{
+    uint32_t total = database_get_total_entries(db);
+    if (total + 1 > model->size)
+    {
+        model->size = total + 1;
+        model->ids = xrealloc(model->ids, sizeof(int64_t) * model->size);
+    }
+    model->len = frecency
+                     ? database_get_frecent_entries(db, total, 0, model->ids)
+                     : database_get_latest_entries(db, total, 0, model->ids);
+}
+
+HistoryModel *history_model_new(struct database *db, bool frecency)
+{
+    HistoryModel *model = g_object_new(HISTORY_TYPE_MODEL, NULL);
+    load_ids(model, db, frecency);
+
+    return model;
+}
+
+HistoryModel *history_model_new_from_ids(const int64_t *ids, uint32_t len)
+{
+    HistoryModel *model = g_object_new(HISTORY_TYPE_MODEL, NULL);
+    model->size = len + 1;
+    model->ids = xmalloc(sizeof(int64_t) * model->size);
+    memcpy(model->ids, ids, sizeof(int64_t) * len);
+    model->len = len;
+
+    return model;
+}
+
+/* Rows at the top that haven't changed are left alone, so the list doesn't
+ * have to make them again */
+void history_model_reload(HistoryModel *model, struct database *db,
+                          bool frecency)
+{
+    int64_t *old = model->ids;
+    uint32_t removed = model->len;
+    model->ids = NULL;
+    model->size = 0;
+    load_ids(model, db, frecency);
+
+    uint32_t same = 0;
+    while (same < removed && same < model->len &&
+           old[same] == model->ids[same])
+    {
+        same++;
+    }
+    free(old);
+
+    if (same < removed || same < model->len)
+    {
+        g_list_model_items_changed(G_LIST_MODEL(model), same, removed - same,
+                                   model->len - same);
+    }
+}
+
+static int64_t find_id(HistoryModel *model, int64_t id)
+{
+    for (uint32_t i = 0; i < model->len; i++)
+    {
+        if (model->ids[i] == id)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+void history_model_prepend(HistoryModel *model, int64_t id)
+{
+    if (find_id(model, id) >= 0)
+    {
+        return;
+    }
+
+    if (model->len == model->size)
+    {
+        model->size *= 2;
+        model->ids = xrealloc(model->ids, sizeof(int64_t) * model->size);
+    }
+    memmove(&model->ids[1], &model->ids[0], sizeof(int64_t) * model->len);
+    model->ids[0] = id;
+    model->len++;
+
+    g_list_model_items_changed(G_LIST_MODEL(model), 0, 0, 1);
+}
+
+bool history_model_remove(HistoryModel *model, int64_t id)
+{
+    int64_t position = find_id(model, id);
+    if (position < 0)
+    {
+        return false;
+    }
+
+    memmove(&model->ids[position], &model->ids[position + 1],
+            sizeof(int64_t) * (model->len - position - 1));
+    model->len--;
+
+    g_list_model_items_changed(G_LIST_MODEL(model), position, 1, 0);
+    return true;
+}
+
+void history_model_clear(HistoryModel *model)
+{
+    uint32_t removed = model->len;
+    model->len = 0;
+
+    g_list_model_items_changed(G_LIST_MODEL(model), 0, removed, 0);
+}
@@ -0,0 +1,34 @@
+#include <gio/gio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "database.h"
+
+#ifndef HISTORY_MODEL_H
+#define HISTORY_MODEL_H
+
+/* An entry of the history list, only the id is kept so rows are read from
+ * the database when they're shown */
+#define HISTORY_TYPE_ITEM (history_item_get_type())
+G_DECLARE_FINAL_TYPE(HistoryItem, history_item, HISTORY, ITEM, GObject)
+
+int64_t history_item_get_id(HistoryItem *item);
+
+/* Every entry in the history as a GListModel, newest or most used first.
+ * Items are made as the list asks for them, so only the ids of the entries
+ * are held for the whole history */
+#define HISTORY_TYPE_MODEL (history_model_get_type())
+G_DECLARE_FINAL_TYPE(HistoryModel, history_model, HISTORY, MODEL, GObject)
+
+HistoryModel *history_model_new(struct database *db, bool frecency);
+/* Only the entries given, until it's reloaded from the database */
+HistoryModel *history_model_new_from_ids(const int64_t *ids, uint32_t len);
+/* Reads every id again, for changes that weren't passed on one at a time */
+void history_model_reload(HistoryModel *model, struct database *db,
+                          bool frecency);
+/* Puts a new entry first, unless it's already in the list */
+void history_model_prepend(HistoryModel *model, int64_t id);
+/* Returns false if the entry isn't in the list */
+bool history_model_remove(HistoryModel *model, int64_t id);
+void history_model_clear(HistoryModel *model);
+
+#endif
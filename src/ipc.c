@@ -0,0 +1,814 @@
+#define _POSIX_C_SOURCE 200112L
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "ipc.h"
+#include "xmalloc.h"
+
+/* Both ends are on the same machine, so it's sent as is */
+struct ipc_search_request
+{
+    uint32_t limit;
+    int32_t type;
+    uint32_t frecency;
+    int64_t larger_than;
+    int64_t smaller_than;
+};
+
+/* What kapd needs of a data file before mapping it, so it can't change
+ * under kapd */
+#define REQUIRED_SEALS (F_SEAL_SHRINK | F_SEAL_WRITE)
+
+/* Marks a NULL string */
+#define NO_STRING UINT32_MAX
+/* Ends the matches of a search */
+#define END_OF_RESULTS 0
+/* The first fd systemd passes to a socket activated service */
+#define LISTEN_FDS_START 3
+
+/* systemd owns the socket's path if it was passed to kapd */
+static bool listener_inherited = false;
+
+static bool get_socket_address(struct sockaddr_un *address)
+{
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (!runtime_dir)
+    {
+        return false;
+    }
+
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    int len = snprintf(address->sun_path, sizeof(address->sun_path),
+                       "%s/kaprica.sock", runtime_dir);
+
+    return len < sizeof(address->sun_path);
+}
+
+static void set_timeouts(int fd)
+{
+    struct timeval timeout = {.tv_sec = IPC_TIMEOUT_MS / 1000,
+                              .tv_usec = (IPC_TIMEOUT_MS % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+/* A client going away mustn't take kapd down with SIGPIPE */
+static bool write_all(int fd, const void *data, size_t len)
+{
+    const char *position = data;
+    while (len)
+    {
+        ssize_t written = send(fd, position, len, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return false;
+        }
+        position += written;
+        len -= written;
+    }
+
+    return true;
+}
+
+static bool read_all(int fd, void *data, size_t len)
+{
+    char *position = data;
+    while (len)
+    {
+        ssize_t bytes_read = recv(fd, position, len, 0);
+        if (bytes_read < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes_read <= 0)
+        {
+            return false;
+        }
+        position += bytes_read;
+        len -= bytes_read;
+    }
+
+    return true;
+}
+
+static bool write_string(int fd, const char *string)
+{
+    uint32_t len = string ? strlen(string) : NO_STRING;
+    return write_all(fd, &len, sizeof(len)) &&
+           (!string || write_all(fd, string, len));
+}
+
+static bool read_string(int fd, char **string)
+{
+    uint32_t len;
+    *string = NULL;
+    if (!read_all(fd, &len, sizeof(len)))
+    {
+        return false;
+    }
+    if (len == NO_STRING)
+    {
+        return true;
+    }
+    if (len > MAX_IPC_STRING_LENGTH)
+    {
+        return false;
+    }
+
+    *string = xmalloc(len + 1);
+    if (!read_all(fd, *string, len))
+    {
+        free(*string);
+        *string = NULL;
+        return false;
+    }
+    (*string)[len] = '\0';
+
+    return true;
+}
+
+/* Unlike write_all(), for files */
+static bool write_file(int fd, const void *data, size_t len)
+{
+    const char *position = data;
+    while (len)
+    {
+        ssize_t written = write(fd, position, len);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return false;
+        }
+        position += written;
+        len -= written;
+    }
+
+    return true;
+}
+
+/* Returns the socket systemd passed on from kaprica.socket, or -1 */
+static int get_inherited_socket(void)
+{
+    const char *pid = getenv("LISTEN_PID");
+    const char *fds = getenv("LISTEN_FDS");
+    if (!pid || !fds || strtol(pid, NULL, 10) != getpid() ||
+        strtol(fds, NULL, 10) != 1)
+    {
+        return -1;
+    }
+
+    /* Processes kapd starts mustn't think the socket is theirs */
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+
+    struct stat info;
+    if (fstat(LISTEN_FDS_START, &info) < 0 || !S_ISSOCK(info.st_mode))
+    {
+        return -1;
+    }
+    fcntl(LISTEN_FDS_START, F_SETFD, FD_CLOEXEC);
+
+    return LISTEN_FDS_START;
+}
+
+int ipc_listen(void)
+{
+    int inherited = get_inherited_socket();
+    if (inherited >= 0)
+    {
+        listener_inherited = true;
+        return inherited;
+    }
+
+    struct sockaddr_un address;
+    if (!get_socket_address(&address))
+    {
+        return -1;
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    /* Left behind if kapd didn't stop cleanly */
+    unlink(address.sun_path);
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(listener, SOMAXCONN) < 0)
+    {
+        perror("Failed to listen for searches");
+        close(listener);
+        return -1;
+    }
+
+    return listener;
+}
+
+void ipc_close(int listener)
+{
+    struct sockaddr_un address;
+    if (listener < 0)
+    {
+        return;
+    }
+
+    close(listener);
+    if (!listener_inherited && get_socket_address(&address))
+    {
+        unlink(address.sun_path);
+    }
+}
+
+void ipc_notify_systemd(const char *state)
+{
+    const char *path = getenv("NOTIFY_SOCKET");
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (!path || (path[0] != '/' && path[0] != '@') ||
+        strlen(path) >= sizeof(address.sun_path))
+    {
+        return;
+    }
+
+    /* A leading @ is an abstract socket */
+    size_t len = strlen(path);
+    memcpy(address.sun_path, path, len);
+    if (path[0] == '@')
+    {
+        address.sun_path[0] = '\0';
+    }
+
+    int notify = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (notify < 0)
+    {
+        return;
+    }
+    sendto(notify, state, strlen(state), MSG_NOSIGNAL,
+           (struct sockaddr *)&address,
+           offsetof(struct sockaddr_un, sun_path) + len);
+    close(notify);
+}
+
+int ipc_accept(int listener)
+{
+    int client = accept(listener, NULL, NULL);
+    if (client >= 0)
+    {
+        set_timeouts(client);
+    }
+
+    return client;
+}
+
+enum ipc_command ipc_read_command(int client)
+{
+    uint32_t command;
+    if (!read_all(client, &command, sizeof(command)) ||
+        command < IPC_SEARCH || command > IPC_WATCH)
+    {
+        return IPC_INVALID;
+    }
+
+    return command;
+}
+
+struct query *ipc_read_search(int client, uint32_t *limit, char **database)
+{
+    struct ipc_search_request request;
+    if (!read_all(client, &request, sizeof(request)))
+    {
+        return NULL;
+    }
+
+    struct query *query = query_init();
+    query->type = request.type;
+    query->frecency = request.frecency;
+    query->larger_than = request.larger_than;
+    query->smaller_than = request.smaller_than;
+    *limit = request.limit;
+    *database = NULL;
+    if (!read_string(client, &query->text) ||
+        !read_string(client, &query->mime_type) ||
+        !read_string(client, &query->after) ||
+        !read_string(client, &query->before) ||
+        !read_string(client, database))
+    {
+        query_free(query);
+        free(*database);
+        return NULL;
+    }
+
+    return query;
+}
+
+bool ipc_read_serve_entry(int client, int64_t *id, char **database)
+{
+    return read_all(client, id, sizeof(*id)) &&
+           read_string(client, database);
+}
+
+/* The fd arrives alongside a single byte, the rest of the request is read
+ * as usual */
+static int receive_fd(int client)
+{
+    char byte;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr message = {.msg_iov = &iov,
+                             .msg_iovlen = 1,
+                             .msg_control = control.buf,
+                             .msg_controllen = sizeof(control.buf)};
+
+    if (recvmsg(client, &message, MSG_CMSG_CLOEXEC) <= 0)
+    {
+        return -1;
+    }
+
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    if (!header || header->cmsg_level != SOL_SOCKET ||
+        header->cmsg_type != SCM_RIGHTS)
+    {
+        return -1;
+    }
+
+    int fd;
+    memcpy(&fd, CMSG_DATA(header), sizeof(fd));
+    return fd;
+}
+
+static bool send_fd(int server, int fd)
+{
+    char byte = 0;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr message = {.msg_iov = &iov,
+                             .msg_iovlen = 1,
+                             .msg_control = control.buf,
+                             .msg_controllen = sizeof(control.buf)};
+
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &fd, sizeof(fd));
+
+    return sendmsg(server, &message, MSG_NOSIGNAL) == 1;
+}
+
+bool ipc_read_serve_data(int client, source_buffer *src)
+{
+    uint32_t num_types;
+    uint64_t lengths[MAX_MIME_TYPES];
+    if (!read_all(client, &num_types, sizeof(num_types)) || !num_types ||
+        num_types > MAX_MIME_TYPES)
+    {
+        return false;
+    }
+
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < num_types; i++)
+    {
+        char *type = NULL;
+        if (!read_all(client, &lengths[i], sizeof(lengths[i])) ||
+            !read_string(client, &type) || !type ||
+            lengths[i] > MAX_DATA_SIZE)
+        {
+            free(type);
+            return false;
+        }
+        src->types[src->num_types] = type;
+        src->data[src->num_types] = NULL;
+        src->len[src->num_types] = 0;
+        src->num_types++;
+        total += lengths[i];
+    }
+
+    /* Every type's data is in the one file, one after the other. It has to
+     * be sealed, a client that could still shrink it would crash kapd while
+     * it reads the mapping */
+    int fd = receive_fd(client);
+    struct stat info;
+    int seals = (fd >= 0) ? fcntl(fd, F_GET_SEALS) : -1;
+    if (seals < 0 || (seals & REQUIRED_SEALS) != REQUIRED_SEALS ||
+        fstat(fd, &info) < 0 || info.st_size < total)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return false;
+    }
+
+    void *data = total ? mmap(NULL, total, PROT_READ, MAP_PRIVATE, fd, 0)
+                       : NULL;
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+
+    uint64_t offset = 0;
+    for (uint32_t i = 0; i < num_types; i++)
+    {
+        src->data[i] = xmalloc(lengths[i] ? lengths[i] : 1);
+        memcpy(src->data[i], (char *)data + offset, lengths[i]);
+        src->len[i] = lengths[i];
+        offset += lengths[i];
+    }
+    if (data)
+    {
+        munmap(data, total);
+    }
+
+    return true;
+}
+
+bool ipc_read_watch(int client, char **database)
+{
+    return read_string(client, database);
+}
+
+bool ipc_send_status(int client, enum ipc_status status)
+{
+    uint32_t value = status;
+    return write_all(client, &value, sizeof(value));
+}
+
+struct ipc_results
+{
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+struct ipc_results *ipc_results_init(void)
+{
+    struct ipc_results *results = xmalloc(sizeof(struct ipc_results));
+    results->data = NULL;
+    results->len = 0;
+    results->size = 0;
+
+    return results;
+}
+
+static void add_to_results(struct ipc_results *results, const void *data,
+                           size_t len)
+{
+    if (results->len + len > results->size)
+    {
+        while (results->len + len > results->size)
+        {
+            results->size = results->size ? results->size * 2 : 4096;
+        }
+        results->data = xrealloc(results->data, results->size);
+    }
+    memcpy(results->data + results->len, data, len);
+    results->len += len;
+}
+
+bool ipc_add_match(const struct search_match *match, void *user_data)
+{
+    struct ipc_results *results = user_data;
+    uint32_t snippet_len = strlen(match->snippet);
+    add_to_results(results, &match->id, sizeof(match->id));
+    add_to_results(results, &snippet_len, sizeof(snippet_len));
+    add_to_results(results, match->snippet, snippet_len);
+
+    return true;
+}
+
+/* Written to a memory backed file that's passed over the socket, as the
+ * client could take its time reading that many matches from the socket */
+void ipc_send_results(int client, struct ipc_results *results)
+{
+    int64_t end = END_OF_RESULTS;
+    add_to_results(results, &end, sizeof(end));
+
+    int fd = memfd_create("kaprica-results", MFD_CLOEXEC);
+    if (fd >= 0 && write_file(fd, results->data, results->len))
+    {
+        ipc_send_status(client, IPC_OK);
+        send_fd(client, fd);
+    }
+    else
+    {
+        ipc_send_status(client, IPC_UNSUPPORTED);
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    free(results->data);
+    free(results);
+}
+
+/* Sent as one message, so a watcher that isn't reading is noticed before
+ * half an event is left in its socket */
+bool ipc_send_event(int client, const struct ipc_event *event)
+{
+    uint32_t type = event->type;
+    uint32_t snippet_len = event->snippet ? strlen(event->snippet) : 0;
+    size_t len = sizeof(type) + sizeof(event->id) + sizeof(event->timestamp) +
+                 sizeof(snippet_len) + snippet_len;
+
+    char *message = xmalloc(len);
+    char *position = message;
+    memcpy(position, &type, sizeof(type));
+    position += sizeof(type);
+    memcpy(position, &event->id, sizeof(event->id));
+    position += sizeof(event->id);
+    memcpy(position, event->timestamp, sizeof(event->timestamp));
+    position += sizeof(event->timestamp);
+    memcpy(position, &snippet_len, sizeof(snippet_len));
+    position += sizeof(snippet_len);
+    memcpy(position, event->snippet, snippet_len);
+
+    ssize_t sent = send(client, message, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    free(message);
+
+    return sent == len;
+}
+
+/* Returns the socket, or -1 if kapd isn't running */
+static int connect_to_kapd(enum ipc_command command)
+{
+    struct sockaddr_un address;
+    if (!get_socket_address(&address))
+    {
+        return -1;
+    }
+
+    int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server < 0)
+    {
+        return -1;
+    }
+    if (connect(server, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        close(server);
+        return -1;
+    }
+    set_timeouts(server);
+
+    uint32_t value = command;
+    if (!write_all(server, &value, sizeof(value)))
+    {
+        close(server);
+        return -1;
+    }
+
+    return server;
+}
+
+/* kapd doesn't share the client's working directory, so the path is made
+ * absolute first */
+static bool write_database(int server, const char *database)
+{
+    char *path = NULL;
+    if (database && !(path = realpath(database, NULL)))
+    {
+        return false;
+    }
+
+    bool written = write_string(server, path);
+    free(path);
+
+    return written;
+}
+
+static bool read_status(int server)
+{
+    uint32_t status;
+    return read_all(server, &status, sizeof(status)) && status == IPC_OK;
+}
+
+bool ipc_search(const char *database, const struct query *query,
+                uint32_t limit, search_callback callback, void *user_data)
+{
+    int server = connect_to_kapd(IPC_SEARCH);
+    if (server < 0)
+    {
+        return false;
+    }
+
+    struct ipc_search_request request = {.limit = limit,
+                                         .type = query->type,
+                                         .frecency = query->frecency,
+                                         .larger_than = query->larger_than,
+                                         .smaller_than = query->smaller_than};
+    if (!write_all(server, &request, sizeof(request)) ||
+        !write_string(server, query->text) ||
+        !write_string(server, query->mime_type) ||
+        !write_string(server, query->after) ||
+        !write_string(server, query->before) ||
+        !write_database(server, database) || !read_status(server))
+    {
+        close(server);
+        return false;
+    }
+
+    int fd = receive_fd(server);
+    close(server);
+    struct stat info;
+    char *data = MAP_FAILED;
+    if (fd >= 0 && !fstat(fd, &info) && info.st_size > 0)
+    {
+        data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+
+    /* Some results may already have been handed out, so from here on a
+     * failure only ends the search early */
+    bool ended = false;
+    size_t offset = 0;
+    int64_t id;
+    uint32_t snippet_len;
+    while (offset + sizeof(id) <= info.st_size)
+    {
+        memcpy(&id, data + offset, sizeof(id));
+        offset += sizeof(id);
+        if (id == END_OF_RESULTS)
+        {
+            ended = true;
+            break;
+        }
+        if (offset + sizeof(snippet_len) > info.st_size)
+        {
+            break;
+        }
+        memcpy(&snippet_len, data + offset, sizeof(snippet_len));
+        offset += sizeof(snippet_len);
+        if (snippet_len > info.st_size - offset)
+        {
+            break;
+        }
+
+        char *snippet = xmalloc(snippet_len + 1);
+        memcpy(snippet, data + offset, snippet_len);
+        snippet[snippet_len] = '\0';
+        offset += snippet_len;
+
+        struct search_match match = {.id = id, .snippet = snippet, .score = 0};
+        bool more = callback(&match, user_data);
+        free(snippet);
+        if (!more)
+        {
+            ended = true;
+            break;
+        }
+    }
+    munmap(data, info.st_size);
+
+    if (!ended)
+    {
+        fprintf(stderr, "Search results from kapd were cut short\n");
+    }
+
+    return true;
+}
+
+bool ipc_serve_entry(const char *database, int64_t id)
+{
+    int server = connect_to_kapd(IPC_SERVE_ENTRY);
+    if (server < 0)
+    {
+        return false;
+    }
+
+    bool served = write_all(server, &id, sizeof(id)) &&
+                  write_database(server, database) && read_status(server);
+    close(server);
+
+    return served;
+}
+
+/* Writes the data of every type into a memory backed file, so kapd can
+ * read it without it going through the socket */
+static int write_data_file(const source_buffer *src)
+{
+    int fd = memfd_create("kaprica-copy", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    for (int i = 0; i < src->num_types; i++)
+    {
+        if (!write_file(fd, src->data[i], src->len[i]))
+        {
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (fcntl(fd, F_ADD_SEALS, REQUIRED_SEALS) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+bool ipc_serve_data(const source_buffer *src)
+{
+    int server = connect_to_kapd(IPC_SERVE_DATA);
+    if (server < 0)
+    {
+        return false;
+    }
+
+    uint32_t num_types = src->num_types;
+    bool sent = write_all(server, &num_types, sizeof(num_types));
+    for (int i = 0; sent && i < src->num_types; i++)
+    {
+        uint64_t len = src->len[i];
+        sent = write_all(server, &len, sizeof(len)) &&
+               write_string(server, src->types[i]);
+    }
+
+    int fd = sent ? write_data_file(src) : -1;
+    bool served = fd >= 0 && send_fd(server, fd) && read_status(server);
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    close(server);
+
+    return served;
+}
+
+int ipc_watch(const char *database)
+{
+    int server = connect_to_kapd(IPC_WATCH);
+    if (server < 0)
+    {
+        return -1;
+    }
+    if (!write_database(server, database) || !read_status(server))
+    {
+        close(server);
+        return -1;
+    }
+
+    /* Events can be far apart */
+    struct timeval no_timeout = {0};
+    setsockopt(server, SOL_SOCKET, SO_RCVTIMEO, &no_timeout,
+               sizeof(no_timeout));
+
+    return server;
+}
+
+bool ipc_read_event(int server, struct ipc_event *event)
+{
+    uint32_t type;
+    if (!read_all(server, &type, sizeof(type)) ||
+        !read_all(server, &event->id, sizeof(event->id)) ||
+        !read_all(server, event->timestamp, sizeof(event->timestamp)) ||
+        !read_string(server, &event->snippet))
+    {
+        return false;
+    }
+    event->type = type;
+    event->timestamp[sizeof(event->timestamp) - 1] = '\0';
+
+    return true;
+}
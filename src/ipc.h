@@ -0,0 +1,100 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include "clipboard.h"
+#include "database.h"
+#include "query.h"
+
+#ifndef IPC_H
+#define IPC_H
+
+/* Clients talk to kapd over a Unix socket in the runtime directory. Each
+ * request is a command followed by its arguments, and the reply starts with
+ * a status. A search is the query followed by the database the client would
+ * have opened, and is answered with a file holding each match followed by an
+ * id of 0 */
+enum ipc_command
+{
+    IPC_INVALID,
+    IPC_SEARCH,
+    /* Has kapd serve an entry from its database as the selection */
+    IPC_SERVE_ENTRY,
+    /* Has kapd save and serve new data, which is passed as a file */
+    IPC_SERVE_DATA,
+    /* Keeps the connection open and sends an ipc_event for each entry
+     * added to or removed from the history */
+    IPC_WATCH
+};
+
+enum ipc_status
+{
+    IPC_OK,
+    /* The client has to search the database itself */
+    IPC_UNSUPPORTED
+};
+
+enum ipc_event_type
+{
+    IPC_ENTRY_ADDED = 1,
+    IPC_ENTRY_REMOVED
+};
+
+struct ipc_event
+{
+    enum ipc_event_type type;
+    int64_t id;
+    /* The same format as the database */
+    char timestamp[20];
+    char *snippet;
+};
+
+/* The matches of a search, kept in memory until the search is done */
+struct ipc_results;
+
+enum ipc_defaults
+{
+    /* Neither side waits longer than this for the other */
+    IPC_TIMEOUT_MS = 2000,
+    MAX_IPC_STRING_LENGTH = 1048576
+};
+
+/* Returns the listening socket, or -1 if there's no runtime directory to
+ * put it in. A socket passed on by systemd is used instead if there is one */
+int ipc_listen(void);
+void ipc_close(int listener);
+/* Tells systemd about kapd's state, if it was started by it */
+void ipc_notify_systemd(const char *state);
+/* Returns the socket of the next client, or -1 */
+int ipc_accept(int listener);
+/* Returns IPC_INVALID if the client sent something else */
+enum ipc_command ipc_read_command(int client);
+/* Reads the rest of a search. Returns NULL if the request is malformed,
+ * database is NULL if the client uses the default one */
+struct query *ipc_read_search(int client, uint32_t *limit, char **database);
+bool ipc_read_serve_entry(int client, int64_t *id, char **database);
+/* Adds the types and data to an empty src */
+bool ipc_read_serve_data(int client, source_buffer *src);
+bool ipc_read_watch(int client, char **database);
+bool ipc_send_status(int client, enum ipc_status status);
+struct ipc_results *ipc_results_init(void);
+/* A search_callback, user_data is the ipc_results */
+bool ipc_add_match(const struct search_match *match, void *user_data);
+/* Hands the matches over in one go, so a client that reads them slowly
+ * doesn't hold kapd up. Frees the results */
+void ipc_send_results(int client, struct ipc_results *results);
+/* Never blocks, returns false if the watcher has gone or can't keep up */
+bool ipc_send_event(int client, const struct ipc_event *event);
+
+/* Has kapd run the search, returns false if it isn't running or can't
+ * answer it so the caller has to search the database instead */
+bool ipc_search(const char *database, const struct query *query,
+                uint32_t limit, search_callback callback, void *user_data);
+/* Have kapd serve the selection, so the client doesn't have to stay around.
+ * Returns false if it isn't running, or doesn't have the entry */
+bool ipc_serve_entry(const char *database, int64_t id);
+bool ipc_serve_data(const source_buffer *src);
+/* Returns a socket to read events from with ipc_read_event(), or -1 */
+int ipc_watch(const char *database);
+/* Blocks until the next event, the snippet has to be freed */
+bool ipc_read_event(int server, struct ipc_event *event);
+
+#endif
@@ -11,6 +11,9 @@
 #include <getopt.h>
 #include "clipboard.h"
 #include "database.h"
+#include "ipc.h"
+#include "query.h"
+#include "snapshot.h"
 #include "detection.h"
 #include "protocol/wlr-data-control.h"
 #include "xmalloc.h"
@@ -23,7 +26,8 @@ enum verb
     COPY,
     PASTE,
     SEARCH,
-    DELETE
+    DELETE,
+    WATCH
 };
 
 struct config
@@ -42,6 +46,9 @@ struct config
     char *db_path;
     bool snippets;
     enum search_type search_type;
+    bool query;
+    bool frecency;
+    bool recent;
     char *type;
     int64_t limit;
     enum verb action;
@@ -58,6 +65,9 @@ static struct config options = {.foreground = false,
                                 .db_path = NULL,
                                 .snippets = false,
                                 .search_type = CONTENT,
+                                .query = false,
+                                .frecency = false,
+                                .recent = false,
                                 .clear = false,
                                 .paste_once = false,
                                 .limit = -1,
@@ -73,6 +83,8 @@ static const char help[] =
     "    paste  - Retrieves data from either the clipboard or history\n"
     "    search - Searches through history database\n"
     "    delete - Delete entries from the history database\n"
+    "    watch  - Prints entries as they're added to or removed from the "
+    "history\n"
     "Options:\n"
     "    -h, --help            Show this help message\n"
     "    -v, --version         Show version number\n"
@@ -146,6 +158,11 @@ static const struct option search[] = {
     {"list", no_argument, NULL, 'L'},
     {"type", no_argument, NULL, 't'},
     {"glob", no_argument, NULL, 'g'},
+    {"fuzzy", no_argument, NULL, 'f'},
+    {"regex", no_argument, NULL, 'E'},
+    {"query", no_argument, NULL, 'q'},
+    {"frecency", no_argument, NULL, 'F'},
+    {"recent", no_argument, NULL, 'R'},
     {"database", required_argument, NULL, 'D'},
     {0, 0, 0, 0}};
 
@@ -163,6 +180,12 @@ static const char search_help[] =
     "    -s, --snippet          Show only the snippets of the entries found\n"
     "    -t, --type             Search by MIME type\n"
     "    -g, --glob             Search by glob pattern\n"
+    "    -f, --fuzzy            Fuzzy search, best matches first\n"
+    "    -E, --regex            Search by regular expression\n"
+    "    -q, --query            Search with filters, see kapc(1)\n"
+    "    -F, --frecency         Show the most used entries first\n"
+    "    -R, --recent           Show the newest entries without searching, "
+    "as many as kapd keeps in memory unless a limit is given\n"
     "    -L, --list             Output in machine-readable format\n"
     "    -D, --database </path> Specify the path to the history database\n";
 
@@ -174,6 +197,7 @@ static const struct option delete[] = {
     {"type", no_argument, NULL, 't'},
     {"accept", no_argument, NULL, 'a'},
     {"glob", no_argument, NULL, 'g'},
+    {"query", no_argument, NULL, 'q'},
     {"database", required_argument, NULL, 'D'},
     {0, 0, 0, 0}};
 
@@ -190,9 +214,26 @@ static const char delete_help[] =
     "entries\n"
     "    -g, --glob             Delete by glob pattern\n"
     "    -t, --type             Delete by MIME type\n"
+    "    -q, --query            Delete by a search with filters\n"
     "    -i, --id               Delete one or more id's from history\n"
     "    -D, --database </path> Specify the path to the history database\n";
 
+static const struct option watch[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"version", no_argument, NULL, 'v'},
+    {"database", required_argument, NULL, 'D'},
+    {0, 0, 0, 0}};
+
+static const char watch_help[] =
+    "Usage: kapc watch [options]\n"
+    "Print a line of JSON for each entry added to or removed from the history "
+    "database\n"
+    "\n"
+    "Options:\n"
+    "    -h, --help             Show this help message\n"
+    "    -v, --version          Show version number\n"
+    "    -D, --database </path> Specify the path to the history database\n";
+
 static void parse_options(int argc, char *argv[])
 {
     if (argc < 2)
@@ -219,15 +260,21 @@ static void parse_options(int argc, char *argv[])
     else if (!strcmp(argv[1], "search"))
     {
         action = (void *)search;
-        opt_string = "hvl:itLsD:g";
+        opt_string = "hvl:itLsD:gfEqFR";
         options.action = SEARCH;
     }
     else if (!strcmp(argv[1], "delete"))
     {
         action = (void *)delete;
-        opt_string = "hvl:itaD:g";
+        opt_string = "hvl:itaD:gq";
         options.action = DELETE;
     }
+    else if (!strcmp(argv[1], "watch"))
+    {
+        action = (void *)watch;
+        opt_string = "hvD:";
+        options.action = WATCH;
+    }
     else if (!strcmp(argv[1], "--version") || !strcmp(argv[1], "-v"))
     {
         printf("Kaprica %s\n", PROJECT_VERSION);
@@ -256,7 +303,14 @@ static void parse_options(int argc, char *argv[])
             printf("Kaprica %s\n", PROJECT_VERSION);
             exit(EXIT_SUCCESS);
         case 'f':
-            options.foreground = true;
+            if (options.action == SEARCH)
+            {
+                options.search_type = FUZZY;
+            }
+            else
+            {
+                options.foreground = true;
+            }
             break;
         case 'L':
             options.list = true;
@@ -296,6 +350,18 @@ static void parse_options(int argc, char *argv[])
         case 'g':
             options.search_type = GLOB;
             break;
+        case 'E':
+            options.search_type = REGEX;
+            break;
+        case 'q':
+            options.query = true;
+            break;
+        case 'F':
+            options.frecency = true;
+            break;
+        case 'R':
+            options.recent = true;
+            break;
         case 'D':
             options.db_path = xstrdup(optarg);
             break;
@@ -348,6 +414,10 @@ static void parse_options(int argc, char *argv[])
             {
                 printf("%s", delete_help);
             }
+            else if (options.action == WATCH)
+            {
+                printf("%s", watch_help);
+            }
             exit(EXIT_FAILURE);
         }
     }
@@ -536,6 +606,134 @@ static int64_t *seperate_stdin_into_ids(uint32_t *num_of_ids)
     return ids;
 }
 
+static void print_json_string(const char *string)
+{
+    putchar('"');
+    for (const unsigned char *c = (const unsigned char *)string; *c; c++)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            printf("\\%c", *c);
+        }
+        else if (*c < 0x20)
+        {
+            printf("\\u%04x", *c);
+        }
+        else
+        {
+            putchar(*c);
+        }
+    }
+    putchar('"');
+}
+
+/* One line per event, flushed straight away so it can be piped into other
+ * programs */
+static void print_event(const struct ipc_event *event)
+{
+    printf("{\"event\":\"%s\",\"id\":%ld,\"timestamp\":",
+           (event->type == IPC_ENTRY_ADDED) ? "added" : "removed", event->id);
+    print_json_string(event->timestamp);
+    printf(",\"snippet\":");
+    print_json_string(event->snippet);
+    printf("}\n");
+    fflush(stdout);
+}
+
+/* Prints each match as soon as the search finds it */
+static bool print_match(const struct search_match *match, void *user_data)
+{
+    if (!options.snippets)
+    {
+        if (!options.list)
+        {
+            printf("ID: ");
+        }
+        printf("%ld", match->id);
+    }
+    if (!options.id && !options.snippets)
+    {
+        printf("\t");
+    }
+    if (!options.id)
+    {
+        if (!options.list)
+        {
+            printf("\"");
+        }
+        printf("%s", match->snippet);
+        if (!options.list)
+        {
+            printf("...\"");
+        }
+    }
+    printf("\n");
+
+    return true;
+}
+
+/* The search term is either a query with filters or text to match */
+static struct query *get_query(source_buffer *src)
+{
+    struct query *query =
+        options.query
+            ? query_parse(src->data[0], src->len[0])
+            : query_from_search(src->data[0], src->len[0], options.search_type);
+    query->frecency = options.frecency;
+
+    return query;
+}
+
+/* The newest entries, taken from kapd's snapshot so the database is only
+ * read for the ones past it. A limit of 0 means every entry. Returns the
+ * database if it had to be opened */
+static struct database *print_recent(uint32_t limit)
+{
+    struct entry_row rows[SNAPSHOT_ENTRIES];
+    uint32_t len = snapshot_read(
+        options.db_path, rows,
+        (limit && limit < SNAPSHOT_ENTRIES) ? limit : SNAPSHOT_ENTRIES);
+    for (uint32_t i = 0; i < len; i++)
+    {
+        struct search_match match = {.id = rows[i].id,
+                                     .snippet = rows[i].snippet};
+        print_match(&match, NULL);
+        database_free_row(&rows[i]);
+    }
+    if (limit && len == limit)
+    {
+        return NULL;
+    }
+
+    /* Read a snapshot's worth at a time, so no limit doesn't mean reading
+     * every id at once */
+    struct database *db = database_open(options.db_path);
+    int64_t ids[SNAPSHOT_ENTRIES];
+    uint32_t found;
+    do
+    {
+        uint32_t wanted = SNAPSHOT_ENTRIES;
+        if (limit && limit - len < wanted)
+        {
+            wanted = limit - len;
+        }
+        found = database_get_latest_entries(db, wanted, len, ids);
+        for (uint32_t i = 0; i < found; i++)
+        {
+            char *snippet = database_get_snippet(db, ids[i]);
+            if (snippet)
+            {
+                struct search_match match = {.id = ids[i], .snippet = snippet};
+                print_match(&match, NULL);
+                free(snippet);
+            }
+        }
+        len += found;
+    } while (found == SNAPSHOT_ENTRIES && (!limit || len < limit));
+
+    return db;
+}
+
 static int64_t *get_ids(int args, char *argv[], uint32_t *num_of_ids)
 {
     if (isatty(STDIN_FILENO) || args > 0)
@@ -572,19 +770,37 @@ void write_to_stdout(source_buffer *src)
         type = find_write_type(src);
     }
 
-    if (src->data[type] == NULL)
+    const void *data = src->data[type];
+    size_t len = src->len[type];
+    if (data == NULL)
+    {
+        /* Entries from the history database may only store one encoding of
+         * an image */
+        data = get_transcoded_image(src, type, &len);
+    }
+    if (data == NULL)
     {
         src->data[type] =
             clip_get_selection_type(clip, src->types[type], &src->len[type]);
+        data = src->data[type];
+        len = src->len[type];
     }
 
-    write(STDOUT_FILENO, src->data[type], src->len[type]);
+    write(STDOUT_FILENO, data, len);
     if (!options.newline && isatty(STDOUT_FILENO))
     {
         printf("\n");
     }
 }
 
+/* kapd serves copies itself when it's running, so nothing is left behind.
+ * Paste once copies are still served here, kapd would serve the last entry
+ * again once it's pasted */
+static bool can_hand_off(void)
+{
+    return !options.paste_once && !options.foreground;
+}
+
 int main(int argc, char *argv[])
 {
     parse_options(argc, argv);
@@ -593,7 +809,7 @@ int main(int argc, char *argv[])
     int num_of_args = argc - optind;
     char **args = argv + optind;
 
-    sqlite3 *db = NULL;
+    struct database *db = NULL;
     int64_t *ids = NULL;
 
     clip = clip_init();
@@ -610,7 +826,6 @@ int main(int argc, char *argv[])
         }
         else if (options.id)
         {
-            db = database_open(options.db_path);
             uint32_t num_of_ids = 0;
             ids = get_ids(num_of_args, args, &num_of_ids);
             if (ids == NULL)
@@ -623,6 +838,13 @@ int main(int argc, char *argv[])
                 fprintf(stderr, "Only one id can be copied at a time\n");
                 goto cleanup;
             }
+            if (can_hand_off() && !options.password &&
+                ipc_serve_entry(options.db_path, ids[0]))
+            {
+                goto cleanup;
+            }
+
+            db = database_open(options.db_path);
             if (!database_get_entry(db, ids[0], src))
             {
                 printf("ID: %ld not found\n", ids[0]);
@@ -646,6 +868,8 @@ int main(int argc, char *argv[])
         }
         if (options.reverse_search)
         {
+            /* The path is freed when the database is opened */
+            char *db_path = options.db_path ? xstrdup(options.db_path) : NULL;
             db = database_open(options.db_path);
             int64_t id =
                 database_find_entry_from_snippet(db, src->data[0], src->len[0]);
@@ -653,6 +877,14 @@ int main(int argc, char *argv[])
             if (id == 0)
             {
                 fprintf(stderr, "Snippet not found\n");
+                free(db_path);
+                goto cleanup;
+            }
+            bool handed_off = can_hand_off() && !options.password &&
+                              ipc_serve_entry(db_path, id);
+            free(db_path);
+            if (handed_off)
+            {
                 goto cleanup;
             }
 
@@ -689,6 +921,11 @@ int main(int argc, char *argv[])
             src->num_types++;
         }
 
+        if (can_hand_off() && ipc_serve_data(src))
+        {
+            goto cleanup;
+        }
+
         clip_set_selection(clip);
         if (!options.foreground)
         {
@@ -733,6 +970,7 @@ int main(int argc, char *argv[])
                     else
                     {
                         write_to_stdout(src);
+                        database_record_use(db, ids[i]);
                     }
                     source_clear(src);
                 }
@@ -770,6 +1008,7 @@ int main(int argc, char *argv[])
             source_buffer *tmp = xmalloc(sizeof(source_buffer));
             tmp->num_types = ofr->num_types;
             tmp->snippet = NULL;
+            tmp->search_text = NULL;
             tmp->data_hash = NULL;
             tmp->source = NULL;
             tmp->thumbnail = NULL;
@@ -784,9 +1023,18 @@ int main(int argc, char *argv[])
             source_destroy(tmp);
         }
     }
+    else if (options.action == SEARCH && options.recent)
+    {
+        if (num_of_args > 0)
+        {
+            fprintf(stderr, "--recent doesn't take a search term\n");
+            goto cleanup;
+        }
+        db = print_recent((options.limit == -1) ? SNAPSHOT_ENTRIES
+                                                : options.limit);
+    }
     else if (options.action == SEARCH)
     {
-        db = database_open(options.db_path);
         if (!get_stdin(num_of_args, args, src))
         {
             src->data[0] = xstrdup("");
@@ -795,49 +1043,16 @@ int main(int argc, char *argv[])
             src->num_types = 1;
         }
 
-        if (options.limit == -1)
+        /* A limit of 0 means no limit. kapd answers from memory if it can,
+         * so the database is only opened when it isn't running */
+        struct query *query = get_query(src);
+        uint32_t limit = (options.limit == -1) ? 0 : options.limit;
+        if (!ipc_search(options.db_path, query, limit, print_match, NULL))
         {
-            options.limit = database_get_total_entries(db);
-        }
-        ids = xmalloc(sizeof(int64_t) * options.limit);
-
-        uint32_t found = database_find_matching_entries(
-            db, src->data[0], src->len[0], options.limit, ids,
-            options.search_type);
-
-        for (int i = 0; i < found; i++)
-        {
-            source_clear(src);
-            char *snippet = database_get_snippet(db, ids[i]);
-
-            if (!options.snippets)
-            {
-                if (!options.list)
-                {
-                    printf("ID: ");
-                }
-                printf("%ld", ids[i]);
-            }
-            if (!options.id && !options.snippets)
-            {
-                printf("\t");
-            }
-            if (!options.id)
-            {
-                if (!options.list)
-                {
-                    printf("\"");
-                }
-                printf("%s", snippet);
-                if (!options.list)
-                {
-                    printf("...\"");
-                }
-            }
-            printf("\n");
-
-            free(snippet);
+            db = database_open(options.db_path);
+            database_query(db, query, limit, print_match, NULL);
         }
+        query_free(query);
     }
     else if (options.action == DELETE)
     {
@@ -861,14 +1076,16 @@ int main(int argc, char *argv[])
                 src->num_types = 1;
             }
 
-            if (options.limit == -1)
-            {
-                options.limit = database_get_total_entries(db);
-            }
-            ids = xmalloc(sizeof(int64_t) * options.limit);
-            found = database_find_matching_entries(db, src->data[0],
-                                                   src->len[0], options.limit,
-                                                   ids, options.search_type);
+            /* Entries can't be deleted while the search is still going
+             * through them, so the ids are collected first */
+            struct id_list list = {.ids = NULL, .len = 0, .size = 0};
+            struct query *query = get_query(src);
+            database_query(db, query,
+                           (options.limit == -1) ? 0 : options.limit,
+                           database_collect_match, &list);
+            query_free(query);
+            ids = list.ids;
+            found = list.len;
         }
 
         char *input = NULL;
@@ -902,6 +1119,24 @@ int main(int argc, char *argv[])
             }
         }
     }
+    else if (options.action == WATCH)
+    {
+        /* Only kapd knows when entries are added */
+        int server = ipc_watch(options.db_path);
+        if (server < 0)
+        {
+            fprintf(stderr, "kapd isn't running or uses another database\n");
+            goto cleanup;
+        }
+
+        struct ipc_event event;
+        while (ipc_read_event(server, &event))
+        {
+            print_event(&event);
+            free(event.snippet);
+        }
+        close(server);
+    }
 
 cleanup:
     if (db)
@@ -3,13 +3,14 @@
 #include <wayland-client.h>
 #include <poll.h>
 #include <signal.h>
-#include <sqlite3.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
@@ -19,6 +20,9 @@
 #include "database.h"
 #include "protocol/wlr-data-control.h"
 #include "detection.h"
+#include "ipc.h"
+#include "search_index.h"
+#include "snapshot.h"
 #include "xmalloc.h"
 #include "config.h" /* Generated by meson */
 
@@ -26,11 +30,20 @@ enum defaults
 {
     SIGNAL_EVENT = 1,
     TIMER_EVENT = 2,
+    IDLE_EVENT = 3,
+    IPC_EVENT = 4,
+    DATABASE_EVENT = 5,
+    MAX_WATCHERS = 64,
+    TEN_SECONDS = 10,
     ONE_MINUTE_IN_SECONDS = 60,
     FIVE_MINUTES_IN_SECONDS = 300,
+    SEVEN_DAYS = 7,
     THIRTY_DAYS = 30,
+    COLD_BATCH_SIZE = 8,
+    SEARCH_TEXT_BATCH_SIZE = 64,
     TEN_ENTRIES = 10,
     TEN_THOUSAND_ENTRIES = 10000,
+    ONE_MEGABYTE = 1048576,
     MINIMUM_LENGTH = 6
 };
 
@@ -40,16 +53,27 @@ struct config
     char *config;
     uint64_t size;
     uint32_t expire;
+    uint32_t cold;
+    uint64_t chunk;
     uint64_t limit;
     size_t min_length;
 };
 
+/* Clients waiting to hear about new and removed entries */
+struct watchers
+{
+    int fds[MAX_WATCHERS];
+    uint32_t len;
+};
+
 static struct config options = {
     .database = NULL,
     .config = NULL,
     /* Defaults to 2GB, can't be stored in a enum due to overflow */
     .size = 2147483648,
     .expire = THIRTY_DAYS,
+    .cold = SEVEN_DAYS,
+    .chunk = ONE_MEGABYTE,
     .min_length = MINIMUM_LENGTH,
     .limit = TEN_THOUSAND_ENTRIES};
 
@@ -69,6 +93,10 @@ static const char help[] =
     "is deleted\n"
     "    -l, --limit <0-x>        Limit the number of entries in the history "
     "database\n"
+    "    -C, --cold <0-x>         Set the time in days before an entry is "
+    "recompressed to save space, 0 disables it\n"
+    "    -k, --chunk <(x)KB/MB/GB> Set the size above which entries are split "
+    "into chunks shared with similar entries, 0 disables it\n"
     "    -c, --config </path>     Specify the path to the configuration file\n"
     "See kapd(1) for more information\n";
 
@@ -80,6 +108,8 @@ static const struct option arguments[] = {
     {"min-length", required_argument, NULL, 'm'},
     {"expire", required_argument, NULL, 'e'},
     {"limit", required_argument, NULL, 'l'},
+    {"cold", required_argument, NULL, 'C'},
+    {"chunk", required_argument, NULL, 'k'},
     {"config", required_argument, NULL, 'c'},
     {0, 0, 0, 0}};
 
@@ -111,8 +141,8 @@ static uint64_t parse_size(const char *size)
 static void parse_options(int argc, char *argv[])
 {
     int c;
-    while ((c = getopt_long(argc, argv, "hvD:S:e:l:c:m:", arguments, NULL)) !=
-           -1)
+    while ((c = getopt_long(argc, argv, "hvD:S:e:l:c:m:C:k:", arguments,
+                            NULL)) != -1)
     {
         switch (c)
         {
@@ -140,6 +170,12 @@ static void parse_options(int argc, char *argv[])
         case 'l':
             options.limit = strtoull(optarg, NULL, 10);
             break;
+        case 'C':
+            options.cold = strtoull(optarg, NULL, 10);
+            break;
+        case 'k':
+            options.chunk = strtoull(optarg, NULL, 10) ? parse_size(optarg) : 0;
+            break;
         default:
             fprintf(stderr, "%s", help);
             exit(EXIT_FAILURE);
@@ -227,6 +263,20 @@ static void config_handler(void *user, const char *section, const char *name,
             options.limit = strtoull(value, NULL, 10);
         }
     }
+    else if (strcmp(name, "cold") == 0)
+    {
+        if (options.cold == SEVEN_DAYS)
+        {
+            options.cold = strtoull(value, NULL, 10);
+        }
+    }
+    else if (strcmp(name, "chunk") == 0)
+    {
+        if (options.chunk == ONE_MEGABYTE)
+        {
+            options.chunk = strtoull(value, NULL, 10) ? parse_size(value) : 0;
+        }
+    }
     else
     {
         fprintf(stderr, "Invalid option: %s\n", name);
@@ -234,6 +284,218 @@ static void config_handler(void *user, const char *section, const char *name,
     }
 }
 
+/* Answers a search from kapc or kapg out of memory, as long as it's for the
+ * same database */
+static void serve_search(int client, struct search_index *index,
+                         struct database *db)
+{
+    uint32_t limit;
+    char *requested;
+    struct query *query = ipc_read_search(client, &limit, &requested);
+    if (!query)
+    {
+        return;
+    }
+
+    if (database_is_file(db, requested) && search_index_can_answer(query))
+    {
+        struct ipc_results *results = ipc_results_init();
+        search_index_query(index, db, query, limit, ipc_add_match, results);
+        ipc_send_results(client, results);
+    }
+    else
+    {
+        ipc_send_status(client, IPC_UNSUPPORTED);
+    }
+
+    query_free(query);
+    free(requested);
+}
+
+/* Sends every change to the search index on to the watchers, dropping any
+ * that have gone or fallen behind */
+static void publish_event(enum index_event event,
+                          const struct indexed_entry *entry, void *user_data)
+{
+    struct watchers *watchers = user_data;
+    struct ipc_event message = {.type = (event == ENTRY_ADDED)
+                                            ? IPC_ENTRY_ADDED
+                                            : IPC_ENTRY_REMOVED,
+                                .id = entry->id,
+                                .snippet = entry->snippet};
+    memcpy(message.timestamp, entry->timestamp, sizeof(message.timestamp));
+
+    for (uint32_t i = 0; i < watchers->len;)
+    {
+        if (ipc_send_event(watchers->fds[i], &message))
+        {
+            i++;
+            continue;
+        }
+        close(watchers->fds[i]);
+        watchers->fds[i] = watchers->fds[--watchers->len];
+    }
+}
+
+/* Returns false if the client can't be added, watchers that have hung up
+ * are only noticed here or when an event is sent */
+static bool add_watcher(struct watchers *watchers, int client)
+{
+    char byte;
+    for (uint32_t i = 0;
+         watchers->len == MAX_WATCHERS && i < watchers->len;)
+    {
+        if (recv(watchers->fds[i], &byte, 1, MSG_DONTWAIT | MSG_PEEK) == 0)
+        {
+            close(watchers->fds[i]);
+            watchers->fds[i] = watchers->fds[--watchers->len];
+            continue;
+        }
+        i++;
+    }
+    if (watchers->len == MAX_WATCHERS)
+    {
+        return false;
+    }
+
+    watchers->fds[watchers->len++] = client;
+    return true;
+}
+
+/* Keeps the connection open if the client is now watching */
+static bool serve_watch(int client, struct watchers *watchers,
+                        struct database *db)
+{
+    char *requested = NULL;
+    bool watching = ipc_read_watch(client, &requested) &&
+                    database_is_file(db, requested) &&
+                    add_watcher(watchers, client);
+    free(requested);
+    ipc_send_status(client, watching ? IPC_OK : IPC_UNSUPPORTED);
+
+    return watching;
+}
+
+/* Serves src instead of the current selection */
+static void replace_selection(clipboard *clip, source_buffer *src)
+{
+    /* The old source is destroyed when it's cancelled */
+    clip->selection_source->source = NULL;
+    source_destroy(clip->selection_source);
+    clip->selection_source = src;
+    clip_set_selection(clip);
+    clip->serving = true;
+}
+
+/* kapc and kapg hand over entries from the history so they don't have to
+ * stay around to serve them */
+static bool serve_entry(int client, clipboard *clip, struct database *db)
+{
+    int64_t id;
+    char *requested = NULL;
+    if (!ipc_read_serve_entry(client, &id, &requested))
+    {
+        free(requested);
+        return false;
+    }
+
+    source_buffer *src = source_init();
+    bool found = database_is_file(db, requested) &&
+                 database_get_entry(db, id, src);
+    free(requested);
+    if (!found)
+    {
+        ipc_send_status(client, IPC_UNSUPPORTED);
+        source_destroy(src);
+        return false;
+    }
+
+    src->id = database_renew_entry(db, id);
+    replace_selection(clip, src);
+    ipc_send_status(client, IPC_OK);
+
+    return true;
+}
+
+/* New data from kapc is saved the same as a copy from any other client,
+ * without having to read it back from the clipboard */
+static bool serve_data(int client, clipboard *clip, struct database *db,
+                       uint32_t *num_of_entries)
+{
+    source_buffer *src = source_init();
+    if (!ipc_read_serve_data(client, src))
+    {
+        source_destroy(src);
+        return false;
+    }
+
+    for (int i = 0; i < src->num_types; i++)
+    {
+        if (!strcmp(src->types[i], "x-kde-passwordManagerHint"))
+        {
+            src->password = true;
+        }
+    }
+    source_prepare(src);
+
+    if (src->password)
+    {
+        printf("Password detected, not saving\n");
+    }
+    else if (is_minimum_length(src, options.min_length))
+    {
+        database_insert_entry(db, src);
+        (*num_of_entries)++;
+    }
+    replace_selection(clip, src);
+    ipc_send_status(client, IPC_OK);
+
+    return true;
+}
+
+/* Returns true if the selection was replaced */
+static bool serve_client(int listener, clipboard *clip,
+                         struct search_index *index, struct watchers *watchers,
+                         struct database *db, uint32_t *num_of_entries)
+{
+    int client = ipc_accept(listener);
+    if (client < 0)
+    {
+        return false;
+    }
+
+    bool replaced = false;
+    bool keep_open = false;
+    switch (ipc_read_command(client))
+    {
+    case IPC_SEARCH:
+        serve_search(client, index, db);
+        break;
+    case IPC_SERVE_ENTRY:
+        replaced = serve_entry(client, clip, db);
+        break;
+    case IPC_SERVE_DATA:
+        replaced = serve_data(client, clip, db, num_of_entries);
+        break;
+    case IPC_WATCH:
+        keep_open = serve_watch(client, watchers, db);
+        break;
+    default:
+        break;
+    }
+    if (!keep_open)
+    {
+        close(client);
+    }
+
+    if (replaced)
+    {
+        search_index_refresh(index, db);
+    }
+
+    return replaced;
+}
+
 static void prepare_read(struct wl_display *display)
 {
     while (wl_display_prepare_read(display) != 0)
@@ -279,51 +541,92 @@ int main(int argc, char *argv[])
                                .it_value = one_minute};
     timerfd_settime(clean_up_entries, 0, &timer, NULL);
 
+    /* Set up timer to index and recompress old entries while nothing is
+     * happening */
+    int idle_work = timerfd_create(CLOCK_MONOTONIC, 0);
+    struct timespec ten_seconds = {.tv_sec = TEN_SECONDS};
+    struct itimerspec idle_timer = {.it_interval = ten_seconds,
+                                    .it_value = ten_seconds};
+    timerfd_settime(idle_work, 0, &idle_timer, NULL);
+    time_t last_activity = time(NULL);
+
     /* Get the fd of the display for poll */
     int display_fd = wl_display_get_fd(clip->display);
 
+    /* Without a runtime directory to put the socket in clients can't reach
+     * kapd, poll() skips the negative fd */
+    int ipc_listener = ipc_listen();
+
+    /* Other processes write to the database too, the file is watched so
+     * watchers hear about their changes */
+    int watch_database = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
     struct pollfd wait_for_events[] = {
         {.fd = display_fd, .events = POLLIN},
         {.fd = watch_signals, .events = POLLIN},
-        {.fd = clean_up_entries, .events = POLLIN}};
-
-    sqlite3 *db = database_init(options.database);
+        {.fd = clean_up_entries, .events = POLLIN},
+        {.fd = idle_work, .events = POLLIN},
+        {.fd = ipc_listener, .events = POLLIN},
+        {.fd = watch_database, .events = POLLIN}};
+
+    struct database *db = database_init(options.database);
+    database_set_chunk_threshold(db, options.chunk);
+    struct search_index *index = search_index_init(db);
+    struct watchers watchers = {.len = 0};
+    index->on_event = publish_event;
+    index->event_data = &watchers;
+    inotify_add_watch(watch_database, database_get_path(db), IN_MODIFY);
+
+    /* kapd's own writes are seen through the database watch too, so the
+     * snapshot is kept up to date from there */
+    struct snapshot *snapshot = snapshot_create(db);
+    if (snapshot)
+    {
+        snapshot_update(snapshot, db);
+    }
 
     clip_watch(clip);
     wl_display_roundtrip(clip->display);
 
-    /* If selection is set add it to the database; if its unset
-     * try to load last source from history, and if all else
-     * fails just wait for selection to be set */
+    /* If selection is set add it to the database; if its unset try to load
+     * last source from history, and if both are empty the main loop waits
+     * for the first copy */
     uint32_t num_of_entries = database_get_total_entries(db);
-    bool selection_set = false;
-    do
+    if (clip_get_selection(clip))
     {
-        selection_set = clip_get_selection(clip);
-        if (selection_set)
-        {
-            database_insert_entry(db, clip->selection_source);
-            num_of_entries++;
-            break;
-        }
-
-        if (num_of_entries > 0)
-        {
-            int64_t id;
-            database_get_latest_entries(db, 1, 0, &id);
-            database_get_entry(db, id, clip->selection_source);
-            clip_set_selection(clip);
-            clip->serving = true;
-            break;
-        }
+        database_insert_entry(db, clip->selection_source);
+        search_index_refresh(index, db);
+        num_of_entries++;
+    }
+    else if (num_of_entries > 0)
+    {
+        int64_t id;
+        database_get_latest_entries(db, 1, 0, &id);
+        database_get_entry(db, id, clip->selection_source);
+        clip_set_selection(clip);
+        clip->serving = true;
+    }
 
-        wl_display_dispatch(clip->display);
-    } while (selection_set == false);
+    /* Nothing above waits for a copy, so clients that connected while kapd
+     * was starting are answered as soon as the main loop runs */
+    ipc_notify_systemd("READY=1");
 
     while (true)
     {
         prepare_read(clip->display);
 
+        /* A paste can request several types, so every request handled in
+         * one go counts as a single use */
+        source_buffer *served = clip->selection_source;
+        if (clip->serving && served->pastes)
+        {
+            if (served->id)
+            {
+                database_record_use(db, served->id);
+            }
+            served->pastes = 0;
+        }
+
         // FIXME: This causes wl_display_read_events() to leak memory
         if ((clip->serving && clip->selection_source->expired) ||
             (!clip->serving && clip->selection_offer->expired))
@@ -340,20 +643,28 @@ int main(int argc, char *argv[])
                                            options.min_length))
                 {
                     database_insert_entry(db, clip->selection_source);
+                    search_index_refresh(index, db);
                     num_of_entries++;
                 }
+                last_activity = time(NULL);
                 clip->serving = false;
             }
-            else
+            else if (clip->selection_source->num_types)
             {
                 clip_set_selection(clip);
                 clip->serving = true;
             }
+            else
+            {
+                /* Nothing has been copied yet, so there's nothing to serve
+                 * in place of the cleared selection */
+                clip->selection_offer->expired = false;
+            }
 
             prepare_read(clip->display);
         }
 
-        if (poll(wait_for_events, 3, -1) < 0)
+        if (poll(wait_for_events, 6, -1) < 0)
         {
             perror("poll");
             wl_display_cancel_read(clip->display);
@@ -404,6 +715,57 @@ int main(int argc, char *argv[])
                            entries_removed);
                 }
             }
+
+            if (database_train_dictionary(db))
+            {
+                printf("Trained a new compression dictionary\n");
+            }
+            search_index_refresh(index, db);
+        }
+
+        if (poll(&wait_for_events[IDLE_EVENT], 1, 0) > 0)
+        {
+            uint64_t tmp;
+            read(idle_work, &tmp, sizeof(uint64_t));
+
+            /* Work in small batches so serving the clipboard is never held
+             * up for long, progress is kept in the database */
+            if (time(NULL) - last_activity >= ONE_MINUTE_IN_SECONDS)
+            {
+                int64_t indexed[SEARCH_TEXT_BATCH_SIZE];
+                uint32_t len = database_index_search_text(
+                    db, SEARCH_TEXT_BATCH_SIZE, indexed);
+                search_index_update_text(index, db, indexed, len);
+                if (!len && options.cold)
+                {
+                    database_recompress_cold_entries(db, (options.cold * -1),
+                                                     COLD_BATCH_SIZE);
+                }
+            }
+        }
+
+        if (poll(&wait_for_events[IPC_EVENT], 1, 0) > 0 &&
+            serve_client(ipc_listener, clip, index, &watchers, db,
+                         &num_of_entries))
+        {
+            last_activity = time(NULL);
+        }
+
+        if (poll(&wait_for_events[DATABASE_EVENT], 1, 0) > 0)
+        {
+            /* Only whether it was written to matters */
+            char events[4096];
+            while (read(watch_database, events, sizeof(events)) > 0)
+                ;
+
+            if (database_get_data_version(db) != index->data_version)
+            {
+                search_index_refresh(index, db);
+            }
+            if (snapshot)
+            {
+                snapshot_update(snapshot, db);
+            }
         }
 
         if (wl_display_read_events(clip->display) == -1)
@@ -413,13 +775,27 @@ int main(int argc, char *argv[])
         }
     }
 
+    ipc_notify_systemd("STOPPING=1");
+
     /* Defragment and optimize the database before closing */
     database_maintenance(db);
 
     /* Cleanup that shouldn't be necessary but helps analyze with valgrind */
+    ipc_close(ipc_listener);
+    for (uint32_t i = 0; i < watchers.len; i++)
+    {
+        close(watchers.fds[i]);
+    }
+    close(watch_database);
+    if (snapshot)
+    {
+        snapshot_close(snapshot);
+    }
+    search_index_free(index);
     database_close(db);
     close(display_fd);
     close(watch_signals);
     close(clean_up_entries);
+    close(idle_work);
     clip_destroy(clip);
 }
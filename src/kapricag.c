@@ -5,14 +5,27 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <gtk/gtk.h>
+#include <glib-unix.h>
 #include "clipboard.h"
 #include "database.h"
+#include "history_model.h"
+#include "ipc.h"
+#include "query.h"
+#include "snapshot.h"
+#include "texture_cache.h"
 #include "xmalloc.h"
 #include "config.h" /* Generated by meson */
 
 enum defaults
 {
     NUMBER_OF_SOURCES = 20,
+    /* Entries searched before the results so far are shown */
+    SEARCH_BATCH_SIZE = 512,
+    /* Decoded thumbnails kept for rows that are shown again */
+    CACHED_TEXTURES = 128,
+    /* Rows read ahead of the scroll that haven't been shown yet. Past this
+     * they're dropped, as the list has likely been scrolled elsewhere */
+    MAX_PREFETCHED_ROWS = 3 * NUMBER_OF_SOURCES,
     WINDOW_WIDTH = 340,
     WINDOW_HEIGHT = 430
 };
@@ -22,11 +35,17 @@ struct config
     gboolean no_csd;
     char *database;
     char *style;
+    gboolean frecency;
+    gboolean resident;
     bool version;
 };
 
-static struct config options = {
-    .no_csd = FALSE, .database = NULL, .style = NULL, .version = FALSE};
+static struct config options = {.no_csd = FALSE,
+                                .database = NULL,
+                                .style = NULL,
+                                .frecency = FALSE,
+                                .resident = FALSE,
+                                .version = FALSE};
 
 GOptionEntry entries[] = {{"no-csd", 'n', 0, G_OPTION_ARG_NONE, &options.no_csd,
                            "Disable client-side decorations", NULL},
@@ -35,10 +54,23 @@ GOptionEntry entries[] = {{"no-csd", 'n', 0, G_OPTION_ARG_NONE, &options.no_csd,
                            "Specify the path to the history database", NULL},
                           {"style", 's', 0, G_OPTION_ARG_STRING, &options.style,
                            "Specify the path to the CSS style sheet", NULL},
+                          {"frecency", 'f', 0, G_OPTION_ARG_NONE,
+                           &options.frecency,
+                           "Show the most used entries first", NULL},
+                          {"resident", 'r', 0, G_OPTION_ARG_NONE,
+                           &options.resident,
+                           "Stay in the background once the window is closed",
+                           NULL},
                           {"version", 'v', 0, G_OPTION_ARG_NONE,
                            &options.version, "Show version number", NULL},
                           {NULL}};
 
+struct scroll_position
+{
+    double value;
+    gint64 time;
+};
+
 // TODO: Convert UI interface into a blueprint file
 struct Widgets
 {
@@ -64,22 +96,69 @@ struct Widgets
     GtkWidget *confirm_hbox;
     GtkWidget *confirm_yes;
     GtkWidget *confirm_no;
-    /* Database */
-    sqlite3 *db;
-    int64_t data_version;
+    /* Database, NULL until it's needed if the history was first shown from
+     * kapd's snapshot. Only used through get_database() */
+    struct database *db;
+    /* Worker threads read rows from their own connections to it */
+    char *db_path;
+    /* What the entry list shows, owned by the list */
+    HistoryModel *history;
+    struct texture_cache *textures;
+    /* Rows read ahead of the scroll by id, until they're shown. NULL while
+     * they're still being read */
+    GHashTable *prefetched;
+    /* Where each list was last scrolled to, to tell how fast it's going */
+    struct scroll_position history_scroll;
+    struct scroll_position search_scroll;
+    /* Where kapd sends changes to the history, -1 if it isn't running */
+    int events;
+    /* The database's data_version when the history was last read */
+    int64_t history_version;
+    struct search_results *search_results;
 };
 
 /* Used to pass around data throughout the entire search process */
 struct search_data
 {
-    char *text;
-    uint32_t total_sources;
+    struct query *query;
+    struct Widgets *widgets;
+    /* Set as soon as the search is cancelled to stop the query running */
+    GCancellable *cancellable;
+    gulong cancelled_handler;
+    atomic_bool cancelled;
+};
+
+/* Sent from the search thread each time part of the search is done */
+struct search_batch
+{
+    GCancellable *cancellable;
+    struct Widgets *widgets;
+    int64_t *ids;
     uint32_t found;
-    uint32_t offset;
+    /* Matches of the snippets, which are shown until the full search gets to
+     * them */
+    bool snippets;
+    int64_t searched_to;
+    bool done;
+};
+
+/* The results of the current search, newest first, only used on the main
+ * thread */
+struct search_results
+{
+    GCancellable *cancellable;
+    /* Matches of the full search */
     int64_t *ids;
-    enum search_type type;
-    struct Widgets *widgets;
-    GtkWidget **buttons;
+    uint32_t found;
+    int64_t *snippet_ids;
+    uint32_t snippets;
+    /* Every entry newer than this has been searched */
+    int64_t searched_to;
+    /* What the list is showing, the first shown of which have rows */
+    int64_t *list;
+    uint32_t listed;
+    uint32_t shown;
+    bool done;
 };
 
 /* Packs the id of the entry and widgets into a struct to pass to the
@@ -90,22 +169,33 @@ struct id_data
     struct Widgets *widgets;
 };
 
-/* Used to load more entries into the list when the user scrolls */
-struct load_data
+/* Opened the first time it's needed */
+static struct database *get_database(struct Widgets *widgets)
 {
-    int64_t *ids;
-    uint32_t found;
-    uint32_t offset;
-    struct Widgets *widgets;
-};
+    if (!widgets->db)
+    {
+        widgets->db = database_open(xstrdup(widgets->db_path));
+    }
 
-static void clicked(GtkWidget *button, gpointer user_data)
+    return widgets->db;
+}
+
+static void copy_entry(struct Widgets *widgets, int64_t id)
 {
+    /* Without kapd the entry is served from a forked process */
+    if (ipc_serve_entry(options.database, id))
+    {
+        return;
+    }
+
     clipboard *clip = clip_init();
-    struct id_data *data = user_data;
-    int64_t t = GPOINTER_TO_UINT(data->id);
-    database_get_entry(data->widgets->db, t, clip->selection_source);
-    database_close(data->widgets->db);
+    database_get_entry(get_database(widgets), id, clip->selection_source);
+    /* A resident kapg carries on using the connection */
+    if (!options.resident)
+    {
+        database_close(widgets->db);
+        widgets->db = NULL;
+    }
     clip_set_selection(clip);
 
     pid_t pid = fork();
@@ -116,10 +206,38 @@ static void clicked(GtkWidget *button, gpointer user_data)
     }
     else if (pid == 0)
     {
-        while (wl_display_dispatch(clip->display) >= 0)
+        /* Served until another client takes the selection */
+        while (!clip->selection_source->expired &&
+               wl_display_dispatch(clip->display) >= 0)
             ;
         clip_destroy(clip);
+        /* Leaves a resident kapg to the parent */
+        exit(EXIT_SUCCESS);
+    }
+    clip_release(clip);
+}
+
+static void clicked(GtkWidget *button, gpointer user_data)
+{
+    struct id_data *data = user_data;
+    copy_entry(data->widgets, GPOINTER_TO_UINT(data->id));
+}
+
+/* Copies the entry of a row of the history list, from the keyboard */
+static void history_activated(GtkListView *list, guint position,
+                              gpointer user_data)
+{
+    struct Widgets *widgets = user_data;
+    HistoryItem *item =
+        g_list_model_get_item(G_LIST_MODEL(widgets->history), position);
+    if (!item)
+    {
+        return;
     }
+
+    copy_entry(widgets, history_item_get_id(item));
+    g_object_unref(item);
+    gtk_window_close(GTK_WINDOW(widgets->window));
 }
 
 /* Passes the signal to clicked() */
@@ -141,6 +259,11 @@ static void copy_first_row(GtkSearchEntry *search, gpointer user_data)
     {
         return;
     }
+    if (widgets->visible == widgets->scrolled_window_entry)
+    {
+        history_activated(GTK_LIST_VIEW(widgets->entry_list), 0, widgets);
+        return;
+    }
 
     GtkWidget *scrolled_window = widgets->visible;
     GtkWidget *viewport =
@@ -151,6 +274,35 @@ static void copy_first_row(GtkSearchEntry *search, gpointer user_data)
     row_activated(GTK_LIST_BOX(list), row, NULL);
 }
 
+static bool remove_id(int64_t *ids, uint32_t *len, int64_t id)
+{
+    for (int i = 0; i < *len; i++)
+    {
+        if (ids[i] == id)
+        {
+            memmove(&ids[i], &ids[i + 1], sizeof(int64_t) * (*len - i - 1));
+            *len -= 1;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Stops the search from adding a removed entry back as more results come
+ * in */
+static void forget_result(struct search_results *results, int64_t id,
+                          bool had_row)
+{
+    if (results && results->list)
+    {
+        remove_id(results->ids, &results->found, id);
+        remove_id(results->snippet_ids, &results->snippets, id);
+        remove_id(results->list, &results->listed, id);
+        results->shown -= had_row;
+    }
+}
+
 static void delete_entry(GtkWidget *button, gpointer user_data)
 {
     struct id_data *data = user_data;
@@ -160,8 +312,24 @@ static void delete_entry(GtkWidget *button, gpointer user_data)
     GtkWidget *ListBoxRow = gtk_widget_get_parent(button_box);
     GtkWidget *list = gtk_widget_get_parent(ListBoxRow);
 
-    database_delete_entry(data->widgets->db, t);
+    database_delete_entry(get_database(data->widgets), t);
+    texture_cache_remove(data->widgets->textures, t);
     gtk_list_box_remove(GTK_LIST_BOX(list), ListBoxRow);
+
+    if (list == data->widgets->search_list)
+    {
+        forget_result(data->widgets->search_results, t, true);
+    }
+}
+
+static void delete_history_entry(GtkWidget *button, gpointer user_data)
+{
+    struct id_data *data = user_data;
+    int64_t t = GPOINTER_TO_UINT(data->id);
+
+    database_delete_entry(get_database(data->widgets), t);
+    texture_cache_remove(data->widgets->textures, t);
+    history_model_remove(data->widgets->history, t);
 }
 
 static GtkWidget *create_button_box()
@@ -176,56 +344,288 @@ static GtkWidget *create_button_box()
     return button_box;
 }
 
-static GtkWidget *create_entry_button(int64_t id, struct Widgets *widgets)
+static void show_texture(GtkWidget *button, GdkTexture *texture)
+{
+    GtkWidget *image = gtk_picture_new_for_paintable(GDK_PAINTABLE(texture));
+
+    /* A lot of formatting code to left align the image and fill to fit the
+     * button */
+    gtk_widget_set_halign(image, GTK_ALIGN_START);
+    gtk_widget_set_valign(image, GTK_ALIGN_FILL);
+    gtk_widget_set_hexpand(image, TRUE);
+    gtk_widget_set_vexpand(image, TRUE);
+    gtk_picture_set_can_shrink(GTK_PICTURE(image), TRUE);
+    gtk_picture_set_content_fit(GTK_PICTURE(image), GTK_CONTENT_FIT_CONTAIN);
+    gtk_widget_set_size_request(image, 250, 80);
+    gtk_widget_set_margin_start(image, 0);
+    gtk_widget_set_margin_end(image, 0);
+    gtk_widget_set_margin_top(image, 0);
+    gtk_widget_set_margin_bottom(image, 0);
+
+    gtk_button_set_child(GTK_BUTTON(button), image);
+}
+
+static void show_snippet(GtkWidget *button, const char *snippet)
 {
-    GtkWidget *button;
-    void *thumbnail = NULL, *snippet = NULL;
-    size_t len = 0;
+    gtk_button_set_label(GTK_BUTTON(button), snippet);
+    GtkWidget *label = gtk_button_get_child(GTK_BUTTON(button));
 
-    thumbnail = database_get_thumbnail(widgets->db, id, &len);
-    if (len)
+    /* Set the label to wrap and left align */
+    gtk_label_set_wrap(GTK_LABEL(label), TRUE);
+    gtk_label_set_wrap_mode(GTK_LABEL(label), PANGO_WRAP_WORD_CHAR);
+    gtk_label_set_xalign(GTK_LABEL(label), 0);
+}
+
+/* A row as the worker hands it over, with the thumbnail already decoded */
+struct decoded_row
+{
+    struct entry_row row;
+    /* NULL if the entry has no thumbnail */
+    GdkTexture *texture;
+};
+
+static void free_decoded_row(gpointer data)
+{
+    struct decoded_row *decoded = data;
+    g_clear_object(&decoded->texture);
+    database_free_row(&decoded->row);
+    free(decoded);
+}
+
+/* Textures can be made on any thread, the bytes own the thumbnail from here
+ * on */
+static void decode_thumbnail(struct decoded_row *decoded)
+{
+    decoded->texture = NULL;
+    if (decoded->row.thumbnail)
     {
-        /* Convert thumbnail into a gbytes structure so it can be turned into a
-         * texture */
-        GBytes *pix_array = g_bytes_new(thumbnail, len);
-        GdkTexture *texture = gdk_texture_new_from_bytes(pix_array, NULL);
-        GtkWidget *image =
-            gtk_picture_new_for_paintable(GDK_PAINTABLE(texture));
+        GBytes *bytes = g_bytes_new_take(decoded->row.thumbnail,
+                                         decoded->row.thumbnail_len);
+        decoded->row.thumbnail = NULL;
+        decoded->texture = gdk_texture_new_from_bytes(bytes, NULL);
+        g_bytes_unref(bytes);
+    }
+}
 
-        g_bytes_unref(pix_array);
-        free(thumbnail);
+/* Runs on a worker thread, which never touches the widgets and only returns
+ * plain data. Decoding the thumbnail is done here too */
+static void read_row_async(GTask *task, gpointer source_object,
+                           gpointer task_data, GCancellable *cancellable)
+{
+    struct id_data *data = task_data;
+    struct decoded_row *decoded = xmalloc(sizeof(struct decoded_row));
+    struct database *db = database_get_reader(data->widgets->db_path);
+    if (!database_read_row(db, GPOINTER_TO_UINT(data->id), &decoded->row))
+    {
+        free(decoded);
+        g_task_return_pointer(task, NULL, NULL);
+        return;
+    }
 
-        /* A lot of formatting code to left align the image and fill to fit the
-         * button */
-        gtk_widget_set_halign(image, GTK_ALIGN_START);
-        gtk_widget_set_valign(image, GTK_ALIGN_FILL);
-        gtk_widget_set_hexpand(image, TRUE);
-        gtk_widget_set_vexpand(image, TRUE);
-        gtk_picture_set_can_shrink(GTK_PICTURE(image), TRUE);
-        gtk_picture_set_content_fit(GTK_PICTURE(image),
-                                    GTK_CONTENT_FIT_CONTAIN);
-        gtk_widget_set_size_request(image, 250, 80);
-        gtk_widget_set_margin_start(image, 0);
-        gtk_widget_set_margin_end(image, 0);
-        gtk_widget_set_margin_top(image, 0);
-        gtk_widget_set_margin_bottom(image, 0);
+    decode_thumbnail(decoded);
+    g_task_return_pointer(task, decoded, free_decoded_row);
+}
 
-        button = gtk_button_new();
-        gtk_button_set_child(GTK_BUTTON(button), image);
+static void read_row_finish(GObject *source_object, GAsyncResult *res,
+                            gpointer user_data)
+{
+    struct id_data *data = g_task_get_task_data(G_TASK(res));
+    struct decoded_row *decoded =
+        g_task_propagate_pointer(G_TASK(res), NULL);
+    if (!decoded)
+    {
+        return;
     }
-    else
+
+    /* Cached even if the row has moved on, it's likely to be back */
+    if (decoded->texture)
     {
-        snippet = database_get_snippet(widgets->db, id);
-        button = gtk_button_new_with_label(snippet);
-        GtkWidget *label = gtk_button_get_child(GTK_BUTTON(button));
+        texture_cache_put(data->widgets->textures, decoded->row.id,
+                          decoded->texture);
+    }
 
-        free(snippet);
+    /* A reused row may have moved on to another entry since */
+    int64_t id = GPOINTER_TO_UINT(g_object_get_data(source_object, "entry"));
+    if (decoded->row.id == id)
+    {
+        if (decoded->texture)
+        {
+            show_texture(GTK_WIDGET(source_object), decoded->texture);
+        }
+        else
+        {
+            show_snippet(GTK_WIDGET(source_object), decoded->row.snippet);
+        }
+    }
+    free_decoded_row(decoded);
+}
+
+/* Thumbnails that were decoded before and rows that were read ahead are shown
+ * straight away. Otherwise the row is read and decoded on a worker thread, and
+ * the button is blank until it's done */
+static void set_button_content(GtkWidget *button, int64_t id,
+                               struct Widgets *widgets)
+{
+    g_object_set_data(G_OBJECT(button), "entry", GUINT_TO_POINTER(id));
+    GdkTexture *texture = texture_cache_get(widgets->textures, id);
+    if (texture)
+    {
+        show_texture(button, texture);
+        return;
+    }
+
+    struct decoded_row *prefetched =
+        g_hash_table_lookup(widgets->prefetched, GUINT_TO_POINTER(id));
+    if (prefetched)
+    {
+        /* Rows from kapd's snapshot still have their thumbnails to decode,
+         * which are small enough to do here */
+        if (prefetched->row.thumbnail)
+        {
+            decode_thumbnail(prefetched);
+        }
+        if (prefetched->texture)
+        {
+            texture_cache_put(widgets->textures, id, prefetched->texture);
+            show_texture(button, prefetched->texture);
+        }
+        else
+        {
+            show_snippet(button, prefetched->row.snippet);
+        }
+        g_hash_table_remove(widgets->prefetched, GUINT_TO_POINTER(id));
+        return;
+    }
+    gtk_button_set_label(GTK_BUTTON(button), "");
+
+    struct id_data *data = xmalloc(sizeof(struct id_data));
+    data->id = GUINT_TO_POINTER(id);
+    data->widgets = widgets;
+
+    GTask *task = g_task_new(button, NULL, read_row_finish, NULL);
+    g_task_set_task_data(task, data, free);
+    g_task_run_in_thread(task, read_row_async);
+    g_object_unref(task);
+}
+
+static void free_prefetched_row(gpointer data)
+{
+    if (data)
+    {
+        free_decoded_row(data);
+    }
+}
+
+static void prefetch_finish(GObject *source_object, GAsyncResult *res,
+                            gpointer user_data)
+{
+    struct id_data *data = g_task_get_task_data(G_TASK(res));
+    GHashTable *prefetched = data->widgets->prefetched;
+    struct decoded_row *decoded =
+        g_task_propagate_pointer(G_TASK(res), NULL);
+    if (!decoded)
+    {
+        g_hash_table_remove(prefetched, data->id);
+        return;
+    }
+
+    if (decoded->texture)
+    {
+        texture_cache_put(data->widgets->textures, decoded->row.id,
+                          decoded->texture);
+    }
+
+    /* Thumbnails are only kept in the cache, and a row that was dropped
+     * while it was read isn't wanted any more */
+    if (decoded->texture || !g_hash_table_contains(prefetched, data->id))
+    {
+        g_hash_table_remove(prefetched, data->id);
+        free_decoded_row(decoded);
+        return;
+    }
+    g_hash_table_replace(prefetched, data->id, decoded);
+}
+
+/* Reads and decodes the row in the background, so it's ready by the time
+ * it's scrolled into view */
+static void prefetch_row(struct Widgets *widgets, int64_t id)
+{
+    gpointer key = GUINT_TO_POINTER(id);
+    if (texture_cache_get(widgets->textures, id) ||
+        g_hash_table_contains(widgets->prefetched, key))
+    {
+        return;
+    }
+
+    if (g_hash_table_size(widgets->prefetched) >= MAX_PREFETCHED_ROWS)
+    {
+        g_hash_table_remove_all(widgets->prefetched);
+    }
+    g_hash_table_insert(widgets->prefetched, key, NULL);
+
+    struct id_data *data = xmalloc(sizeof(struct id_data));
+    data->id = key;
+    data->widgets = widgets;
+
+    GTask *task = g_task_new(NULL, NULL, prefetch_finish, NULL);
+    g_task_set_task_data(task, data, free);
+    g_task_run_in_thread(task, read_row_async);
+    g_object_unref(task);
+}
+
+/* Returns how many pages to read ahead of a scroll, none unless it's going
+ * down the list */
+static uint32_t pages_to_prefetch(struct scroll_position *last,
+                                  GtkAdjustment *adjustment)
+{
+    double value = gtk_adjustment_get_value(adjustment);
+    gint64 now = g_get_monotonic_time();
+    double velocity = (value - last->value) * G_USEC_PER_SEC /
+                      MAX(now - last->time, 1);
+    last->value = value;
+    last->time = now;
+
+    if (velocity <= 0)
+    {
+        return 0;
+    }
+
+    /* Faster than a page a second, the next page would be shown before it
+     * could be read */
+    return (velocity > gtk_adjustment_get_page_size(adjustment)) ? 2 : 1;
+}
+
+static void history_scrolled(GtkAdjustment *adjustment, gpointer user_data)
+{
+    struct Widgets *widgets = user_data;
+    uint32_t pages = pages_to_prefetch(&widgets->history_scroll, adjustment);
+    double upper = gtk_adjustment_get_upper(adjustment);
+    if (!pages || upper <= 0)
+    {
+        return;
+    }
 
-        /* Set the label to wrap and left align */
-        gtk_label_set_wrap(GTK_LABEL(label), TRUE);
-        gtk_label_set_wrap_mode(GTK_LABEL(label), PANGO_WRAP_WORD_CHAR);
-        gtk_label_set_xalign(GTK_LABEL(label), 0);
+    /* Rows differ in height, so which are in view is only estimated from
+     * how far down the list it is */
+    GListModel *history = G_LIST_MODEL(widgets->history);
+    uint32_t total = g_list_model_get_n_items(history);
+    double page_size = gtk_adjustment_get_page_size(adjustment);
+    uint32_t first =
+        (gtk_adjustment_get_value(adjustment) + page_size) / upper * total;
+    uint32_t rows_per_page = page_size / upper * total + 1;
+    uint32_t last = MIN(first + rows_per_page * pages, total);
+
+    for (uint32_t i = first; i < last; i++)
+    {
+        HistoryItem *item = g_list_model_get_item(history, i);
+        prefetch_row(widgets, history_item_get_id(item));
+        g_object_unref(item);
     }
+}
+
+static GtkWidget *create_entry_button(struct id_data *data)
+{
+    GtkWidget *button = gtk_button_new();
 
     /* Formatting code to make the button look nice */
     gtk_button_set_can_shrink(GTK_BUTTON(button), FALSE);
@@ -233,19 +633,16 @@ static GtkWidget *create_entry_button(int64_t id, struct Widgets *widgets)
     gtk_widget_set_halign(button, GTK_ALIGN_FILL);
     gtk_widget_set_hexpand(button, TRUE);
 
-    struct id_data *data = xmalloc(sizeof(struct id_data));
-    data->id = GUINT_TO_POINTER(id);
-    data->widgets = widgets;
-
     /* Copy the content and exit */
     g_signal_connect(button, "clicked", G_CALLBACK(clicked), data);
-    g_signal_connect_swapped(button, "clicked", G_CALLBACK(gtk_window_destroy),
-                             GTK_WINDOW(widgets->window));
+    g_signal_connect_swapped(button, "clicked", G_CALLBACK(gtk_window_close),
+                             GTK_WINDOW(data->widgets->window));
 
     return button;
 }
 
-static GtkWidget *create_delete_button(int64_t id, struct Widgets *widgets)
+static GtkWidget *create_delete_button(struct id_data *data,
+                                       GCallback delete)
 {
     GtkWidget *button = gtk_button_new_from_icon_name("edit-delete");
 
@@ -254,23 +651,17 @@ static GtkWidget *create_delete_button(int64_t id, struct Widgets *widgets)
     gtk_widget_set_halign(button, GTK_ALIGN_END);
     gtk_widget_set_valign(button, GTK_ALIGN_FILL);
 
-    struct id_data *data = xmalloc(sizeof(struct id_data));
-    data->id = GUINT_TO_POINTER(id);
-    data->widgets = widgets;
-
-    g_signal_connect(button, "clicked", G_CALLBACK(delete_entry), data);
+    g_signal_connect(button, "clicked", delete, data);
 
     return button;
 }
 
-static GtkWidget *create_button(int64_t id, struct Widgets *widgets)
+static GtkWidget *pack_buttons(GtkWidget *button, GtkWidget *delete)
 {
     GtkWidget *button_box = create_button_box();
-    GtkWidget *button = create_entry_button(id, widgets);
-    GtkWidget *delete = create_delete_button(id, widgets);
 
     /* Makes the buttons not focusable so tabbing and shift-tabbing only
-     * focuses the ListBoxRows */
+     * focuses the rows */
     gtk_widget_set_can_focus(delete, FALSE);
     gtk_widget_set_can_focus(button, FALSE);
     gtk_widget_set_can_focus(button_box, FALSE);
@@ -281,6 +672,50 @@ static GtkWidget *create_button(int64_t id, struct Widgets *widgets)
     return button_box;
 }
 
+static GtkWidget *create_button(int64_t id, struct Widgets *widgets)
+{
+    struct id_data *data = xmalloc(sizeof(struct id_data));
+    data->id = GUINT_TO_POINTER(id);
+    data->widgets = widgets;
+
+    GtkWidget *button = create_entry_button(data);
+    set_button_content(button, id, widgets);
+    GtkWidget *button_box = pack_buttons(
+        button, create_delete_button(data, G_CALLBACK(delete_entry)));
+    /* So the row can be found when kapd says the entry is gone */
+    g_object_set_data(G_OBJECT(button_box), "id", GUINT_TO_POINTER(id));
+
+    return button_box;
+}
+
+/* The history list only has rows for the entries in view, which are reused
+ * for other entries as it's scrolled */
+static void setup_history_row(GtkSignalListItemFactory *factory,
+                              GtkListItem *item, gpointer user_data)
+{
+    struct id_data *data = xmalloc(sizeof(struct id_data));
+    data->id = GUINT_TO_POINTER(0);
+    data->widgets = user_data;
+    g_object_set_data_full(G_OBJECT(item), "id_data", data, free);
+
+    GtkWidget *button = create_entry_button(data);
+    GtkWidget *delete =
+        create_delete_button(data, G_CALLBACK(delete_history_entry));
+    gtk_list_item_set_child(item, pack_buttons(button, delete));
+}
+
+static void bind_history_row(GtkSignalListItemFactory *factory,
+                             GtkListItem *item, gpointer user_data)
+{
+    struct id_data *data = g_object_get_data(G_OBJECT(item), "id_data");
+    int64_t id = history_item_get_id(gtk_list_item_get_item(item));
+    data->id = GUINT_TO_POINTER(id);
+
+    GtkWidget *button =
+        gtk_widget_get_first_child(gtk_list_item_get_child(item));
+    set_button_content(button, id, data->widgets);
+}
+
 static void swap_visible(struct Widgets *widgets, GtkWidget *list)
 {
     gtk_widget_set_visible(widgets->visible, FALSE);
@@ -288,140 +723,355 @@ static void swap_visible(struct Widgets *widgets, GtkWidget *list)
     widgets->visible = list;
 }
 
-static void load_more_entries(GtkScrolledWindow *scrolled_window,
-                              GtkPositionType pos, gpointer user_data)
+static void free_search_results(struct search_results *results)
 {
-    GtkWidget *viewport = gtk_scrolled_window_get_child(scrolled_window);
-    GtkWidget *list = gtk_viewport_get_child(GTK_VIEWPORT(viewport));
+    if (!results)
+    {
+        return;
+    }
 
-    struct load_data *load = user_data;
-    struct Widgets *widgets = load->widgets;
-    uint32_t offset = load->offset;
+    g_cancellable_cancel(results->cancellable);
+    g_object_unref(results->cancellable);
+    free(results->ids);
+    free(results->snippet_ids);
+    free(results->list);
+    free(results);
+}
 
-    for (int i = offset; i < load->found && i < (NUMBER_OF_SOURCES + offset);
-         i++)
+/* Matches of the snippets are only used for entries the full search hasn't
+ * reached yet, so the list is in the same order however far along it is */
+static void merge_search_results(struct search_results *results)
+{
+    free(results->list);
+    results->list =
+        xmalloc(sizeof(int64_t) * (results->found + results->snippets + 1));
+    results->listed = 0;
+
+    for (int i = 0; i < results->found; i++)
+    {
+        results->list[results->listed++] = results->ids[i];
+    }
+    for (int i = 0; i < results->snippets; i++)
     {
-        GtkWidget *button = create_button(load->ids[i], widgets);
-        gtk_list_box_insert(GTK_LIST_BOX(list), button, -1);
-        load->offset += 1;
+        if (results->snippet_ids[i] < results->searched_to)
+        {
+            results->list[results->listed++] = results->snippet_ids[i];
+        }
     }
 }
 
-static gboolean find_search_result_finish(GObject *source_object,
-                                          GAsyncResult *res, gpointer user_data)
+static int64_t get_row_id(GtkListBox *list, int index)
+{
+    GtkListBoxRow *row = gtk_list_box_get_row_at_index(list, index);
+    return GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(row), "id"));
+}
+
+static void insert_search_row(struct Widgets *widgets, int64_t id, int index)
 {
-    GTask *task = G_TASK(res);
-    struct search_data *data = g_task_propagate_pointer(task, NULL);
-    if (data == NULL) /* Search was cancelled */
+    GtkWidget *button = create_button(id, widgets);
+    gtk_list_box_insert(GTK_LIST_BOX(widgets->search_list), button, index);
+    g_object_set_data(G_OBJECT(gtk_widget_get_parent(button)), "id",
+                      GUINT_TO_POINTER(id));
+}
+
+/* Brings the rows up to date with the results, the rows already there are
+ * kept so the list doesn't flicker as more results come in */
+static void update_search_list(struct Widgets *widgets)
+{
+    struct search_results *results = widgets->search_results;
+    GtkListBox *list = GTK_LIST_BOX(widgets->search_list);
+
+    /* The rows are still from the previous search the first time */
+    uint32_t rows = results->list ? results->shown : 0;
+    if (!results->list)
     {
-        return G_SOURCE_REMOVE;
+        gtk_list_box_remove_all(list);
     }
 
-    struct Widgets *widgets = user_data;
-    GtkWidget *scrolled_window = widgets->scrolled_window_search;
-    gtk_list_box_remove_all(GTK_LIST_BOX(widgets->search_list));
+    merge_search_results(results);
+    uint32_t wanted = MIN(MAX(results->shown, NUMBER_OF_SOURCES),
+                          results->listed);
 
-    for (int i = 0; i < data->found && i < NUMBER_OF_SOURCES; i++)
+    /* Both are newest first, so rows only need to be removed or added */
+    uint32_t row = 0, i = 0;
+    while (i < wanted || row < rows)
     {
-        gtk_list_box_insert(GTK_LIST_BOX(widgets->search_list),
-                            data->buttons[i], -1);
-        data->offset += 1;
+        int64_t id = (row < rows) ? get_row_id(list, row) : 0;
+        if (row < rows && (i >= wanted || id > results->list[i]))
+        {
+            gtk_list_box_remove(
+                list, GTK_WIDGET(gtk_list_box_get_row_at_index(list, row)));
+            rows--;
+        }
+        else if (row < rows && id == results->list[i])
+        {
+            row++;
+            i++;
+        }
+        else
+        {
+            insert_search_row(widgets, results->list[i], row);
+            row++;
+            rows++;
+            i++;
+        }
     }
+    results->shown = wanted;
+}
+
+static gboolean show_search_batch(gpointer user_data)
+{
+    struct search_batch *batch = user_data;
+    struct Widgets *widgets = batch->widgets;
+    struct search_results *results = widgets->search_results;
 
-    if (data->found)
+    /* Belongs to a search that has since been replaced */
+    if (!results || batch->cancellable != results->cancellable)
     {
-        swap_visible(data->widgets, data->widgets->scrolled_window_search);
+        goto free_batch;
+    }
+
+    if (batch->snippets)
+    {
+        results->snippet_ids = xrealloc(
+            results->snippet_ids,
+            sizeof(int64_t) * (results->snippets + batch->found));
+        memcpy(results->snippet_ids + results->snippets, batch->ids,
+               sizeof(int64_t) * batch->found);
+        results->snippets += batch->found;
     }
     else
     {
-        swap_visible(data->widgets, data->widgets->no_match);
+        results->ids =
+            xrealloc(results->ids,
+                     sizeof(int64_t) * (results->found + batch->found));
+        memcpy(results->ids + results->found, batch->ids,
+               sizeof(int64_t) * batch->found);
+        results->found += batch->found;
+        results->searched_to = batch->searched_to;
     }
+    results->done = batch->done;
 
-    g_signal_handlers_disconnect_by_func(scrolled_window,
-                                         G_CALLBACK(load_more_entries), NULL);
-
-    struct load_data *load = xmalloc(sizeof(struct load_data));
-    load->ids = xmalloc(sizeof(int64_t) * data->found);
-    for (int i = 0; i < data->found; i++)
+    /* Keep showing what was there before rather than an empty list until
+     * there is something to show */
+    if (!results->list && !results->found && !results->snippets &&
+        !results->done)
     {
-        load->ids[i] = data->ids[i];
+        goto free_batch;
     }
-    load->found = data->found;
-    load->offset = data->offset;
-    load->widgets = widgets;
 
-    g_signal_connect(scrolled_window, "edge-reached",
-                     G_CALLBACK(load_more_entries), load);
+    update_search_list(widgets);
+    if (results->listed)
+    {
+        swap_visible(widgets, widgets->scrolled_window_search);
+    }
+    else if (results->done)
+    {
+        swap_visible(widgets, widgets->no_match);
+    }
 
+free_batch:
+    g_object_unref(batch->cancellable);
+    free(batch->ids);
+    free(batch);
     return G_SOURCE_REMOVE;
 }
 
+static void show_more_search_results(struct Widgets *widgets,
+                                     struct search_results *results)
+{
+    for (int i = 0; i < NUMBER_OF_SOURCES && results->shown < results->listed;
+         i++)
+    {
+        insert_search_row(widgets, results->list[results->shown], -1);
+        results->shown++;
+    }
+}
+
+static void load_more_search_results(GtkScrolledWindow *scrolled_window,
+                                     GtkPositionType pos, gpointer user_data)
+{
+    struct Widgets *widgets = user_data;
+    struct search_results *results = widgets->search_results;
+    if (pos != GTK_POS_BOTTOM || !results)
+    {
+        return;
+    }
+
+    show_more_search_results(widgets, results);
+}
+
+/* Rows are added while the bottom is still a page or two away, and the ones
+ * after them are read in the meantime, so scrolling never has to wait */
+static void search_scrolled(GtkAdjustment *adjustment, gpointer user_data)
+{
+    struct Widgets *widgets = user_data;
+    struct search_results *results = widgets->search_results;
+    uint32_t pages = pages_to_prefetch(&widgets->search_scroll, adjustment);
+    if (!pages || !results)
+    {
+        return;
+    }
+
+    double page_size = gtk_adjustment_get_page_size(adjustment);
+    double left = gtk_adjustment_get_upper(adjustment) -
+                  gtk_adjustment_get_value(adjustment) - page_size;
+    if (left < page_size * pages)
+    {
+        show_more_search_results(widgets, results);
+    }
+
+    uint32_t last =
+        MIN(results->shown + NUMBER_OF_SOURCES * pages, results->listed);
+    for (uint32_t i = results->shown; i < last; i++)
+    {
+        prefetch_row(widgets, results->list[i]);
+    }
+}
+
+/* Hands part of the results over to the main thread */
+static void send_search_batch(GTask *task, int64_t *ids, uint32_t found,
+                              int64_t searched_to, bool snippets, bool done)
+{
+    struct search_data *data = g_task_get_task_data(task);
+    struct search_batch *batch = xmalloc(sizeof(struct search_batch));
+    batch->cancellable = g_object_ref(g_task_get_cancellable(task));
+    batch->widgets = data->widgets;
+    batch->ids = xmalloc(sizeof(int64_t) * (found + 1));
+    memcpy(batch->ids, ids, sizeof(int64_t) * found);
+    batch->found = found;
+    batch->snippets = snippets;
+    batch->searched_to = searched_to;
+    batch->done = done;
+
+    g_main_context_invoke(NULL, show_search_batch, batch);
+}
+
+/* Searching the full text of every entry can take a while, so the snippets are
+ * searched first and the rest is sent over as it's searched */
 static void find_search_result_async(GTask *task, gpointer task_data,
                                      GCancellable *cancellable)
 {
     struct search_data *data = g_task_get_task_data(task);
+    struct query *query = data->query;
+    /* Read on the thread's own connection, so the main one can keep writing */
+    struct database *db = database_get_reader(data->widgets->db_path);
+
+    /* kapd answers from memory quicker than any of the steps below */
+    struct id_list list = {.ids = xmalloc(sizeof(int64_t) * NUMBER_OF_SOURCES),
+                           .len = 0,
+                           .size = NUMBER_OF_SOURCES};
+    if (ipc_search(options.database, query, 0, database_collect_match,
+                   &list))
+    {
+        send_search_batch(task, list.ids, list.len, 0, false, true);
+        free(list.ids);
+        g_task_return_boolean(task, TRUE);
+        return;
+    }
+
+    database_set_search_cancellation(&data->cancelled);
 
-    data->found = database_find_matching_entries(
-        data->widgets->db, (void *)data->text, strlen(data->text),
-        data->total_sources, data->ids, data->type);
-    data->buttons = xmalloc(sizeof(GtkWidget *) * data->found);
+    /* Filters, fuzzy matches and frecency are only known once the whole query
+     * is done */
+    if (!query_is_text_only(query) || query->frecency ||
+        (query->type != CONTENT && query->type != GLOB &&
+         query->type != REGEX))
+    {
+        database_query(db, query, 0, database_collect_match, &list);
+        send_search_batch(task, list.ids, list.len, 0, false, true);
+        free(list.ids);
+        database_set_search_cancellation(NULL);
+        g_task_return_boolean(task, TRUE);
+        return;
+    }
+
+    size_t length = strlen(query->text);
+    free(list.ids);
+    int64_t *ids = xmalloc(sizeof(int64_t) * SEARCH_BATCH_SIZE);
+    /* Narrowing down the last search is quick enough on its own */
+    if (query->type == CONTENT &&
+        !database_can_refine_search(db, query->text, length, query->type))
+    {
+        uint32_t found = database_find_matching_snippets(
+            db, query->text, length, NUMBER_OF_SOURCES, ids);
+        send_search_batch(task, ids, found, INT64_MAX, true, false);
+    }
 
-    for (int i = 0; i < data->found && i < NUMBER_OF_SOURCES; i++)
+    int64_t before = INT64_MAX;
+    while (before > 0 && !g_cancellable_is_cancelled(cancellable))
     {
-        data->buttons[i] = create_button(data->ids[i], data->widgets);
+        uint32_t found = database_find_matching_entries_before(
+            db, query->text, length, &before, SEARCH_BATCH_SIZE, ids,
+            query->type);
+        send_search_batch(task, ids, found, before, false, before == 0);
     }
+    free(ids);
 
-    g_task_return_pointer(task, data, NULL);
+    /* The thread is reused for other tasks */
+    database_set_search_cancellation(NULL);
+    g_task_return_boolean(task, TRUE);
+}
+
+static void cancel_search(GCancellable *cancellable, gpointer user_data)
+{
+    struct search_data *data = user_data;
+    atomic_store(&data->cancelled, true);
+}
+
+static void free_search_data(gpointer user_data)
+{
+    struct search_data *data = user_data;
+    g_cancellable_disconnect(data->cancellable, data->cancelled_handler);
+    g_object_unref(data->cancellable);
+    query_free(data->query);
+    free(data);
 }
 
 static void search_database(GtkSearchEntry *search_bar, gpointer user_data)
 {
     struct Widgets *widgets = user_data;
     GtkWidget *scrolled_window = widgets->scrolled_window_search;
-    struct search_data *search = xmalloc(sizeof(struct search_data));
     const char *text = gtk_editable_get_text(GTK_EDITABLE(search_bar));
 
+    /* Cancel the current search if it's still running */
+    free_search_results(widgets->search_results);
+    widgets->search_results = NULL;
+
     if (!strlen(text))
     {
         swap_visible(widgets, widgets->scrolled_window_entry);
         return;
     }
 
-    if (strncmp(text, "type:", strlen("type:")) == 0)
-    {
-        search->type = MIME_TYPE;
-        text += strlen("type:");
-    }
-    else if (strncmp(text, "glob:", strlen("glob:")) == 0)
-    {
-        search->type = GLOB;
-        text += strlen("glob:");
-    }
-    else
-    {
-        search->type = CONTENT;
-    }
-
-    search->text = xstrdup(text);
-    search->offset = 0;
-    search->found = 0;
-    search->buttons = NULL;
-    search->total_sources = database_get_total_entries(widgets->db);
+    struct search_data *search = xmalloc(sizeof(struct search_data));
+    search->query = query_parse(text, strlen(text));
+    search->query->frecency = options.frecency;
     search->widgets = widgets;
-    search->ids = xmalloc(sizeof(int64_t) * search->total_sources);
 
-    /* Cancel the current search if it's still running */
-    g_cancellable_cancel(g_cancellable_get_current());
+    struct search_results *results = xmalloc(sizeof(struct search_results));
+    results->cancellable = g_cancellable_new();
+    results->ids = NULL;
+    results->found = 0;
+    results->snippet_ids = NULL;
+    results->snippets = 0;
+    results->searched_to = INT64_MAX;
+    results->list = NULL;
+    results->listed = 0;
+    results->shown = 0;
+    results->done = false;
+    widgets->search_results = results;
+
+    search->cancellable = g_object_ref(results->cancellable);
+    atomic_init(&search->cancelled, false);
+    search->cancelled_handler = g_cancellable_connect(
+        search->cancellable, G_CALLBACK(cancel_search), search, NULL);
 
-    GCancellable *cancel_search = g_cancellable_new();
-    g_cancellable_push_current(cancel_search);
     GTask *task =
-        g_task_new(G_OBJECT(scrolled_window), cancel_search,
-                   (GAsyncReadyCallback)find_search_result_finish, widgets);
-
-    g_task_set_task_data(task, search, NULL);
-    g_task_set_return_on_cancel(task, TRUE);
+        g_task_new(G_OBJECT(scrolled_window), results->cancellable, NULL, NULL);
+    g_task_set_task_data(task, search, free_search_data);
     g_task_run_in_thread(task, (GTaskThreadFunc)find_search_result_async);
+    g_object_unref(task);
 }
 
 static void confirm_clear_all(GtkWidget *button, gpointer user_data)
@@ -453,8 +1103,10 @@ static void clear_all_yes(GtkWidget *button, gpointer user_data)
 {
     struct Widgets *widgets = user_data;
 
-    database_delete_all_entries(widgets->db);
-    gtk_list_box_remove_all(GTK_LIST_BOX(widgets->entry_list));
+    database_delete_all_entries(get_database(widgets));
+    texture_cache_clear(widgets->textures);
+    g_hash_table_remove_all(widgets->prefetched);
+    history_model_clear(widgets->history);
 
     gtk_widget_set_hexpand(widgets->close_window, FALSE);
 
@@ -466,38 +1118,78 @@ static void clear_all_yes(GtkWidget *button, gpointer user_data)
     widgets->visible = widgets->no_entry;
 }
 
-static gboolean load_entries_finish(GObject *source_object, GAsyncResult *res,
-                                    gpointer user_data)
+static GtkWidget *find_row(GtkWidget *list, int64_t id)
+{
+    GtkListBoxRow *row;
+    for (int i = 0;
+         (row = gtk_list_box_get_row_at_index(GTK_LIST_BOX(list), i)); i++)
+    {
+        GtkWidget *button_box = gtk_list_box_row_get_child(row);
+        if (GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(button_box), "id")) ==
+            id)
+        {
+            return GTK_WIDGET(row);
+        }
+    }
+
+    return NULL;
+}
+
+static void entry_added(struct Widgets *widgets, int64_t id)
 {
-    GTask *task = G_TASK(res);
-    GtkWidget **buttons = g_task_propagate_pointer(task, NULL);
-    const uint32_t found = *(uint32_t *)user_data;
-    GtkWidget *entry_list = GTK_WIDGET(source_object);
+    /* A new entry is only known to go first when sorted by time */
+    if (options.frecency)
+    {
+        return;
+    }
 
-    for (int i = 0; i < found && i < NUMBER_OF_SOURCES; i++)
+    history_model_prepend(widgets->history, id);
+    if (widgets->visible == widgets->no_entry &&
+        gtk_widget_get_visible(widgets->no_entry))
     {
-        gtk_list_box_insert(GTK_LIST_BOX(entry_list), buttons[i], -1);
+        swap_visible(widgets, widgets->scrolled_window_entry);
     }
+}
 
-    return G_SOURCE_REMOVE;
+static void entry_removed(struct Widgets *widgets, int64_t id)
+{
+    texture_cache_remove(widgets->textures, id);
+    g_hash_table_remove(widgets->prefetched, GUINT_TO_POINTER(id));
+    history_model_remove(widgets->history, id);
+
+    GtkWidget *row = find_row(widgets->search_list, id);
+    if (row)
+    {
+        gtk_list_box_remove(GTK_LIST_BOX(widgets->search_list), row);
+    }
+    forget_result(widgets->search_results, id, row != NULL);
 }
 
-static void load_entries_async(GTask *task, gpointer task_data,
-                               GCancellable *cancellable)
+/* Keeps the lists up to date with copies and deletions made elsewhere */
+static gboolean read_event(gint fd, GIOCondition condition,
+                           gpointer user_data)
 {
-    struct load_data *data = g_task_get_task_data(task);
-    struct Widgets *widgets = data->widgets;
-    GtkWidget **buttons = xmalloc(sizeof(GtkWidget *) * NUMBER_OF_SOURCES);
-    database_get_latest_entries(widgets->db, data->found, data->offset,
-                                data->ids);
+    struct Widgets *widgets = user_data;
+    struct ipc_event event;
+    if (!ipc_read_event(fd, &event))
+    {
+        /* kapd has stopped, the lists just stay as they are */
+        close(fd);
+        widgets->events = -1;
+        return G_SOURCE_REMOVE;
+    }
 
-    for (int i = 0; i < data->found && i < NUMBER_OF_SOURCES; i++)
+    if (event.type == IPC_ENTRY_ADDED)
+    {
+        entry_added(widgets, event.id);
+    }
+    else
     {
-        buttons[i] = create_button(data->ids[i], widgets);
-        data->offset += 1;
+        entry_removed(widgets, event.id);
     }
+    free(event.snippet);
 
-    g_task_return_pointer(task, buttons, NULL);
+    return G_SOURCE_CONTINUE;
 }
 
 static char *find_style_path()
@@ -523,6 +1215,123 @@ static char *find_style_path()
     return (access(style_path, F_OK) == 0) ? style_path : NULL;
 }
 
+static void watch_events(struct Widgets *widgets)
+{
+    widgets->events = ipc_watch(options.database);
+    if (widgets->events >= 0)
+    {
+        g_unix_fd_add(widgets->events, G_IO_IN | G_IO_HUP | G_IO_ERR,
+                      read_event, widgets);
+    }
+}
+
+/* A resident kapg is only built once, later launches just show it again */
+static struct Widgets *resident = NULL;
+
+/* Puts the window back how it was opened, while it's out of sight */
+static gboolean hide_window(GtkWindow *window, gpointer user_data)
+{
+    struct Widgets *widgets = user_data;
+    if (strlen(gtk_editable_get_text(GTK_EDITABLE(widgets->search_bar))))
+    {
+        gtk_editable_set_text(GTK_EDITABLE(widgets->search_bar), "");
+        search_database(GTK_SEARCH_ENTRY(widgets->search_bar), widgets);
+    }
+    if (gtk_widget_get_visible(widgets->confirm_vbox))
+    {
+        clear_all_no(NULL, widgets);
+    }
+    GtkScrolledWindow *history =
+        GTK_SCROLLED_WINDOW(widgets->scrolled_window_entry);
+    gtk_adjustment_set_value(gtk_scrolled_window_get_vadjustment(history), 0);
+
+    /* Hiding is left to the window */
+    return FALSE;
+}
+
+/* Swaps between the history and the label saying it's empty, unless
+ * something else is shown */
+static void show_history_or_empty(struct Widgets *widgets)
+{
+    uint32_t total = g_list_model_get_n_items(G_LIST_MODEL(widgets->history));
+    if (total && widgets->visible == widgets->no_entry)
+    {
+        swap_visible(widgets, widgets->scrolled_window_entry);
+    }
+    else if (!total && widgets->visible == widgets->scrolled_window_entry)
+    {
+        swap_visible(widgets, widgets->no_entry);
+    }
+}
+
+static void show_resident(struct Widgets *widgets)
+{
+    bool missed = widgets->events < 0;
+    if (missed)
+    {
+        watch_events(widgets);
+    }
+
+    /* Changes made while kapd wasn't running weren't passed on, and neither
+     * are uses of entries that reorder them by frecency */
+    struct database *db = get_database(widgets);
+    int64_t version = database_get_data_version(db);
+    if ((missed || options.frecency) && version != widgets->history_version)
+    {
+        history_model_reload(widgets->history, db, options.frecency);
+        widgets->history_version = version;
+        show_history_or_empty(widgets);
+    }
+
+    gtk_window_present(GTK_WINDOW(widgets->window));
+}
+
+/* Has the first rows ready before the window is first shown */
+static void prefetch_first_rows(struct Widgets *widgets)
+{
+    GListModel *history = G_LIST_MODEL(widgets->history);
+    uint32_t last =
+        MIN(2 * NUMBER_OF_SOURCES, g_list_model_get_n_items(history));
+    for (uint32_t i = 0; i < last; i++)
+    {
+        HistoryItem *item = g_list_model_get_item(history, i);
+        prefetch_row(widgets, history_item_get_id(item));
+        g_object_unref(item);
+    }
+}
+
+/* The rows of kapd's snapshot are kept as if they were read ahead, so the
+ * first screen is drawn without reading anything from the database */
+static HistoryModel *history_from_snapshot(struct Widgets *widgets,
+                                           struct entry_row *rows,
+                                           uint32_t len)
+{
+    int64_t ids[SNAPSHOT_ENTRIES];
+    for (uint32_t i = 0; i < len; i++)
+    {
+        struct decoded_row *decoded = xmalloc(sizeof(struct decoded_row));
+        decoded->row = rows[i];
+        decoded->texture = NULL;
+        g_hash_table_replace(widgets->prefetched,
+                             GUINT_TO_POINTER(rows[i].id), decoded);
+        ids[i] = rows[i].id;
+    }
+
+    return history_model_new_from_ids(ids, len);
+}
+
+/* Reads the rest of the history once the first screen is up */
+static gboolean load_history(gpointer user_data)
+{
+    struct Widgets *widgets = user_data;
+    struct database *db = get_database(widgets);
+    history_model_reload(widgets->history, db, options.frecency);
+    widgets->history_version = database_get_data_version(db);
+    show_history_or_empty(widgets);
+
+    return G_SOURCE_REMOVE;
+}
+
 static void activate(GtkApplication *app, gpointer user_data)
 {
     if (options.version)
@@ -531,9 +1340,16 @@ static void activate(GtkApplication *app, gpointer user_data)
         exit(EXIT_SUCCESS);
     }
 
+    if (resident)
+    {
+        show_resident(resident);
+        return;
+    }
+
     /* Create the main window */
     struct Widgets *widgets = xmalloc(sizeof(struct Widgets));
     widgets->window = gtk_application_window_new(app);
+    widgets->search_results = NULL;
     gtk_window_set_title(GTK_WINDOW(widgets->window), "kaprica");
     gtk_window_set_default_size(GTK_WINDOW(widgets->window), WINDOW_WIDTH,
                                 WINDOW_HEIGHT);
@@ -554,7 +1370,7 @@ static void activate(GtkApplication *app, gpointer user_data)
     GtkShortcutTrigger *trigger =
         gtk_keyval_trigger_new(GDK_KEY_Escape, GDK_ALT_MASK);
     GtkShortcutAction *action = gtk_callback_action_new(
-        (GtkShortcutFunc)gtk_window_destroy, widgets->window, NULL);
+        (GtkShortcutFunc)gtk_window_close, widgets->window, NULL);
     GtkShortcut *shortcut = gtk_shortcut_new(trigger, action);
     GtkEventController *controller = gtk_shortcut_controller_new();
     gtk_shortcut_controller_set_scope(GTK_SHORTCUT_CONTROLLER(controller),
@@ -563,37 +1379,67 @@ static void activate(GtkApplication *app, gpointer user_data)
                                          shortcut);
     gtk_widget_add_controller(widgets->window, controller);
 
-    /* Open a connection to the database */
-    widgets->db = database_open(options.database);
-    if (!widgets->db)
+    widgets->textures = texture_cache_new(CACHED_TEXTURES);
+    widgets->prefetched = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                                NULL, free_prefetched_row);
+    widgets->history_scroll.value = 0;
+    widgets->history_scroll.time = g_get_monotonic_time();
+    widgets->search_scroll = widgets->history_scroll;
+    /* Subscribed before reading the history, so nothing copied after is
+     * missed */
+    watch_events(widgets);
+
+    /* kapd keeps the newest rows where they're read without opening the
+     * database, which is then left until the window is up. They're only in
+     * the right order when sorted by time, and a resident kapg isn't in a
+     * hurry */
+    struct entry_row rows[SNAPSHOT_ENTRIES];
+    uint32_t snapshot_len = 0;
+    if (!options.frecency && !options.resident)
     {
-        fprintf(stderr, "Could not locate history database\n");
-        exit(EXIT_FAILURE);
+        snapshot_len = snapshot_read(options.database, rows, SNAPSHOT_ENTRIES);
+    }
+    if (snapshot_len)
+    {
+        widgets->db = NULL;
+        widgets->db_path = options.database ? xstrdup(options.database)
+                                            : database_default_path();
+        widgets->history = history_from_snapshot(widgets, rows, snapshot_len);
+        widgets->history_version = 0;
+        g_idle_add(load_history, widgets);
+    }
+    else
+    {
+        /* The path is still needed to ask kapd for search results */
+        widgets->db = database_open(
+            options.database ? xstrdup(options.database) : NULL);
+        if (!widgets->db)
+        {
+            fprintf(stderr, "Could not locate history database\n");
+            exit(EXIT_FAILURE);
+        }
+        widgets->db_path = xstrdup(database_get_path(widgets->db));
+        widgets->history = history_model_new(widgets->db, options.frecency);
+        widgets->history_version = database_get_data_version(widgets->db);
     }
-    uint32_t total_sources = database_get_total_entries(widgets->db);
+    uint32_t total_sources =
+        g_list_model_get_n_items(G_LIST_MODEL(widgets->history));
 
     /* Setup list of all entries in the database */
+    GtkListItemFactory *factory = gtk_signal_list_item_factory_new();
+    g_signal_connect(factory, "setup", G_CALLBACK(setup_history_row),
+                     widgets);
+    g_signal_connect(factory, "bind", G_CALLBACK(bind_history_row), NULL);
+    GtkSingleSelection *selection =
+        gtk_single_selection_new(G_LIST_MODEL(widgets->history));
+    gtk_single_selection_set_autoselect(selection, FALSE);
+    gtk_single_selection_set_can_unselect(selection, TRUE);
+
     widgets->scrolled_window_entry = gtk_scrolled_window_new();
-    widgets->entry_list = gtk_list_box_new();
+    widgets->entry_list =
+        gtk_list_view_new(GTK_SELECTION_MODEL(selection), factory);
     widgets->no_entry = gtk_label_new("No entries yet...");
 
-    struct load_data *load = xmalloc(sizeof(struct load_data));
-    load->ids = xmalloc(sizeof(int64_t) * total_sources);
-    load->found = total_sources;
-    load->offset = 0;
-    load->widgets = widgets;
-
-    /* Load initial entries */
-    GTask *task =
-        g_task_new(G_OBJECT(widgets->entry_list), NULL,
-                   (GAsyncReadyCallback)load_entries_finish, &load->found);
-    g_task_set_priority(task, G_PRIORITY_LOW);
-    g_task_set_task_data(task, load, NULL);
-    if (total_sources > 0)
-    {
-        g_task_run_in_thread(task, (GTaskThreadFunc)load_entries_async);
-    }
-
     gtk_scrolled_window_set_child(
         GTK_SCROLLED_WINDOW(widgets->scrolled_window_entry),
         widgets->entry_list);
@@ -604,10 +1450,11 @@ static void activate(GtkApplication *app, gpointer user_data)
     gtk_scrolled_window_set_policy(
         GTK_SCROLLED_WINDOW(widgets->scrolled_window_entry), GTK_POLICY_NEVER,
         GTK_POLICY_AUTOMATIC);
-    g_signal_connect(widgets->scrolled_window_entry, "edge-reached",
-                     G_CALLBACK(load_more_entries), load);
-    g_signal_connect(widgets->entry_list, "row-activated",
-                     G_CALLBACK(row_activated), NULL);
+    g_signal_connect(widgets->entry_list, "activate",
+                     G_CALLBACK(history_activated), widgets);
+    g_signal_connect(gtk_scrolled_window_get_vadjustment(GTK_SCROLLED_WINDOW(
+                         widgets->scrolled_window_entry)),
+                     "value-changed", G_CALLBACK(history_scrolled), widgets);
 
     /* Setup searching */
     widgets->header_bar = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
@@ -639,10 +1486,15 @@ static void activate(GtkApplication *app, gpointer user_data)
 
     g_signal_connect(widgets->search_bar, "search-changed",
                      G_CALLBACK(search_database), widgets);
+    g_signal_connect(widgets->scrolled_window_search, "edge-reached",
+                     G_CALLBACK(load_more_search_results), widgets);
+    g_signal_connect(gtk_scrolled_window_get_vadjustment(GTK_SCROLLED_WINDOW(
+                         widgets->scrolled_window_search)),
+                     "value-changed", G_CALLBACK(search_scrolled), widgets);
     g_signal_connect(widgets->search_list, "row-activated",
                      G_CALLBACK(row_activated), NULL);
     g_signal_connect_swapped(widgets->close_window, "clicked",
-                             G_CALLBACK(gtk_window_destroy),
+                             G_CALLBACK(gtk_window_close),
                              GTK_WINDOW(widgets->window));
     g_signal_connect(widgets->search_bar, "activate",
                      G_CALLBACK(copy_first_row), widgets);
@@ -735,6 +1587,18 @@ static void activate(GtkApplication *app, gpointer user_data)
     }
 
     gtk_window_set_child(GTK_WINDOW(widgets->window), widgets->back_list);
+
+    if (options.resident)
+    {
+        /* Starts out hidden, and is only hidden again when it's closed */
+        gtk_window_set_hide_on_close(GTK_WINDOW(widgets->window), TRUE);
+        g_signal_connect(widgets->window, "close-request",
+                         G_CALLBACK(hide_window), widgets);
+        g_application_hold(G_APPLICATION(app));
+        resident = widgets;
+        prefetch_first_rows(widgets);
+        return;
+    }
     gtk_window_present(GTK_WINDOW(widgets->window));
 }
 
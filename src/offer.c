@@ -99,6 +99,17 @@ const struct zwlr_data_control_device_v1_listener
         .primary_selection = data_control_device_primary_selection_handler,
         .finished = data_control_device_finished_handler};
 
+void source_prepare(source_buffer *src)
+{
+    src->snippet = calloc(sizeof(char), SNIPPET_SIZE);
+    get_snippet(src);
+    get_search_text(src);
+    get_thumbnail(src);
+    src->data_hash = generate_hash(src);
+    /* Hash the data as it was offered so duplicates are still detected */
+    collapse_image_types(src);
+}
+
 static void sync_buffers(clipboard *clip)
 {
     source_buffer *src = clip->selection_source;
@@ -117,10 +128,7 @@ static void sync_buffers(clipboard *clip)
         }
     }
     src->password = ofr->password;
-    src->snippet = calloc(sizeof(char), SNIPPET_SIZE);
-    get_snippet(src);
-    get_thumbnail(src);
-    src->data_hash = generate_hash(src);
+    source_prepare(src);
 }
 
 void clip_watch(clipboard *clip)
@@ -292,6 +300,7 @@ offer_buffer *offer_init(void)
     ofr->num_types = 0;
     ofr->offer = NULL;
     ofr->buf = SELECTION;
+    ofr->expired = false;
     return ofr;
 }
 
@@ -0,0 +1,216 @@
+#define _POSIX_C_SOURCE 200112L
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "query.h"
+#include "xmalloc.h"
+
+struct query *query_init(void)
+{
+    struct query *query = xmalloc(sizeof(struct query));
+    query->type = CONTENT;
+    query->text = NULL;
+    query->mime_type = NULL;
+    query->larger_than = -1;
+    query->smaller_than = -1;
+    query->after = NULL;
+    query->before = NULL;
+    query->frecency = false;
+
+    return query;
+}
+
+static bool has_prefix(const char *word, const char *prefix)
+{
+    return strncmp(word, prefix, strlen(prefix)) == 0;
+}
+
+/* Sizes are a number of bytes with an optional KB, MB or GB suffix, the
+ * same as kapd's options. Returns -1 if it isn't one */
+static int64_t parse_size(const char *size)
+{
+    if (!isdigit((unsigned char)*size))
+    {
+        return -1;
+    }
+
+    char *unit;
+    int64_t value = strtoll(size, &unit, 10);
+    int64_t multiplier;
+    if (!strcasecmp(unit, "") || !strcasecmp(unit, "B"))
+    {
+        multiplier = 1;
+    }
+    else if (!strcasecmp(unit, "KB"))
+    {
+        multiplier = 1024;
+    }
+    else if (!strcasecmp(unit, "MB"))
+    {
+        multiplier = 1024 * 1024;
+    }
+    else if (!strcasecmp(unit, "GB"))
+    {
+        multiplier = 1024 * 1024 * 1024;
+    }
+    else
+    {
+        return -1;
+    }
+
+    return value * multiplier;
+}
+
+/* Only YYYY-MM-DD is accepted so a mistyped date isn't silently compared as
+ * text */
+static bool is_date(const char *date)
+{
+    const char format[] = "0000-00-00";
+    if (strlen(date) != strlen(format))
+    {
+        return false;
+    }
+
+    for (int i = 0; format[i]; i++)
+    {
+        if (format[i] == '0' ? !isdigit((unsigned char)date[i])
+                             : date[i] != format[i])
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Returns false if the word isn't a valid filter, it's searched for as text
+ * instead */
+static bool parse_filter(struct query *query, const char *word)
+{
+    if (has_prefix(word, "type:") && word[strlen("type:")])
+    {
+        free(query->mime_type);
+        query->mime_type = xstrdup(word + strlen("type:"));
+        return true;
+    }
+    else if (has_prefix(word, "size:>") || has_prefix(word, "size:<"))
+    {
+        int64_t size = parse_size(word + strlen("size:>"));
+        if (size < 0)
+        {
+            return false;
+        }
+        if (word[strlen("size:")] == '>')
+        {
+            query->larger_than = size;
+        }
+        else
+        {
+            query->smaller_than = size;
+        }
+        return true;
+    }
+    else if (has_prefix(word, "after:") && is_date(word + strlen("after:")))
+    {
+        free(query->after);
+        query->after = xstrdup(word + strlen("after:"));
+        return true;
+    }
+    else if (has_prefix(word, "before:") && is_date(word + strlen("before:")))
+    {
+        free(query->before);
+        query->before = xstrdup(word + strlen("before:"));
+        return true;
+    }
+
+    return false;
+}
+
+static void append_word(struct query *query, const char *word)
+{
+    if (!*word)
+    {
+        return;
+    }
+
+    size_t len = query->text ? strlen(query->text) : 0;
+    query->text = xrealloc(query->text, len + strlen(word) + 2);
+    if (len)
+    {
+        query->text[len++] = ' ';
+    }
+    strcpy(query->text + len, word);
+}
+
+struct query *query_parse(const char *text, size_t len)
+{
+    struct query *query = query_init();
+    char *copy = xmalloc(len + 1);
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+
+    const char *mode_prefixes[] = {"glob:", "re:", "fuzzy:"};
+    const enum search_type modes[] = {GLOB, REGEX, FUZZY};
+
+    char *position = NULL;
+    for (char *word = strtok_r(copy, " \t\n", &position); word;
+         word = strtok_r(NULL, " \t\n", &position))
+    {
+        if (parse_filter(query, word))
+        {
+            continue;
+        }
+
+        for (int i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+        {
+            if (has_prefix(word, mode_prefixes[i]))
+            {
+                query->type = modes[i];
+                word += strlen(mode_prefixes[i]);
+                break;
+            }
+        }
+        append_word(query, word);
+    }
+    free(copy);
+
+    return query;
+}
+
+struct query *query_from_search(const char *text, size_t len,
+                                enum search_type type)
+{
+    struct query *query = query_init();
+    char *copy = xmalloc(len + 1);
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+
+    if (type == MIME_TYPE)
+    {
+        query->mime_type = copy;
+    }
+    else
+    {
+        query->type = type;
+        query->text = copy;
+    }
+
+    return query;
+}
+
+bool query_is_text_only(const struct query *query)
+{
+    return query->text && !query->mime_type && query->larger_than < 0 &&
+           query->smaller_than < 0 && !query->after && !query->before;
+}
+
+void query_free(struct query *query)
+{
+    free(query->text);
+    free(query->mime_type);
+    free(query->after);
+    free(query->before);
+    free(query);
+}
@@ -0,0 +1,37 @@
+#include <stdint.h>
+#include "database.h"
+
+#ifndef QUERY_H
+#define QUERY_H
+
+/* A search with any number of filters, from text like
+ * "type:image size:>1MB after:2026-10-01 foo". Filters that aren't set are
+ * NULL, or -1 for sizes */
+struct query
+{
+    /* How the text is matched, CONTENT, GLOB, FUZZY or REGEX */
+    enum search_type type;
+    char *text;
+    char *mime_type;
+    int64_t larger_than;
+    int64_t smaller_than;
+    /* Dates as YYYY-MM-DD */
+    char *after;
+    char *before;
+    /* Order by frecency instead of newest first */
+    bool frecency;
+};
+
+/* An empty query, which matches every entry */
+struct query *query_init(void);
+/* Words that aren't a filter make up the text to search for, a glob:, re: or
+ * fuzzy: prefix changes how it's matched */
+struct query *query_parse(const char *text, size_t len);
+/* Only matches text, the same as the search type flags of kapc */
+struct query *query_from_search(const char *text, size_t len,
+                                enum search_type type);
+/* True if the query only has text to match */
+bool query_is_text_only(const struct query *query);
+void query_free(struct query *query);
+
+#endif
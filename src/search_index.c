@@ -0,0 +1,262 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "detection.h"
+#include "search_index.h"
+#include "xmalloc.h"
+
+enum search_index_defaults
+{
+    INITIAL_INDEX_SIZE = 1024
+};
+
+/* The types are kept as a list of strings ended by an empty one, so each
+ * can be matched on its own */
+static char *copy_mime_types(const char *mime_types)
+{
+    size_t len = strlen(mime_types);
+    char *list = xmalloc(len + 2);
+    for (size_t i = 0; i < len; i++)
+    {
+        list[i] = (mime_types[i] == '\n') ? '\0' : mime_types[i];
+    }
+    list[len] = '\0';
+    list[len + (len > 0)] = '\0';
+
+    return list;
+}
+
+static void add_entry(const struct index_entry *entry, void *user_data)
+{
+    struct search_index *index = user_data;
+    if (index->len == index->size)
+    {
+        index->size = index->size ? index->size * 2 : INITIAL_INDEX_SIZE;
+        index->entries = xrealloc(index->entries,
+                                  sizeof(struct indexed_entry) * index->size);
+    }
+
+    struct indexed_entry *indexed = &index->entries[index->len++];
+    indexed->id = entry->id;
+    snprintf(indexed->timestamp, sizeof(indexed->timestamp), "%s",
+             entry->timestamp ? entry->timestamp : "");
+    indexed->snippet = xstrdup(entry->snippet ? entry->snippet : "");
+    indexed->text = (entry->text && entry->text_len <= MAX_INDEXED_TEXT_LENGTH)
+                        ? xstrdup(entry->text)
+                        : NULL;
+    indexed->mime_types = copy_mime_types(entry->mime_types);
+    indexed->size = entry->size;
+
+    if (index->on_event)
+    {
+        index->on_event(ENTRY_ADDED, indexed, index->event_data);
+    }
+}
+
+static void free_entry(struct indexed_entry *entry)
+{
+    free(entry->snippet);
+    free(entry->text);
+    free(entry->mime_types);
+}
+
+static int compare_ids(const void *a, const void *b)
+{
+    int64_t first = *(const int64_t *)a;
+    int64_t second = *(const int64_t *)b;
+    return (first > second) - (first < second);
+}
+
+/* Entries can be deleted by kapd or any other process, so the ids are
+ * compared with the database whenever the number of entries differs */
+static void remove_deleted_entries(struct search_index *index,
+                                   struct database *db)
+{
+    uint32_t total = database_get_total_entries(db);
+    if (total == index->len)
+    {
+        return;
+    }
+
+    int64_t *ids = xmalloc(sizeof(int64_t) * (total + 1));
+    total = database_get_latest_entries(db, total, 0, ids);
+    qsort(ids, total, sizeof(int64_t), compare_ids);
+
+    uint32_t kept = 0, j = 0;
+    for (uint32_t i = 0; i < index->len; i++)
+    {
+        while (j < total && ids[j] < index->entries[i].id)
+        {
+            j++;
+        }
+
+        if (j < total && ids[j] == index->entries[i].id)
+        {
+            index->entries[kept++] = index->entries[i];
+        }
+        else
+        {
+            if (index->on_event)
+            {
+                index->on_event(ENTRY_REMOVED, &index->entries[i],
+                                index->event_data);
+            }
+            free_entry(&index->entries[i]);
+        }
+    }
+    index->len = kept;
+    free(ids);
+}
+
+struct search_index *search_index_init(struct database *db)
+{
+    struct search_index *index = xmalloc(sizeof(struct search_index));
+    index->entries = NULL;
+    index->len = 0;
+    index->size = 0;
+    index->on_event = NULL;
+    index->event_data = NULL;
+    search_index_refresh(index, db);
+
+    return index;
+}
+
+void search_index_refresh(struct search_index *index, struct database *db)
+{
+    int64_t newest = index->len ? index->entries[index->len - 1].id : 0;
+    database_get_index_entries(db, newest, add_entry, index);
+    remove_deleted_entries(index, db);
+    index->data_version = database_get_data_version(db);
+}
+
+static int compare_entry_ids(const void *key, const void *entry)
+{
+    return compare_ids(key, &((const struct indexed_entry *)entry)->id);
+}
+
+void search_index_update_text(struct search_index *index, struct database *db,
+                              const int64_t *ids, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i++)
+    {
+        struct indexed_entry *entry =
+            bsearch(&ids[i], index->entries, index->len,
+                    sizeof(struct indexed_entry), compare_entry_ids);
+        if (!entry || entry->text)
+        {
+            continue;
+        }
+
+        size_t text_len = 0;
+        char *text = database_get_search_text(db, ids[i], &text_len);
+        if (text && text_len > MAX_INDEXED_TEXT_LENGTH)
+        {
+            free(text);
+            text = NULL;
+        }
+        entry->text = text;
+    }
+}
+
+bool search_index_can_answer(const struct query *query)
+{
+    return !query->frecency && (!query->text || query->type == CONTENT);
+}
+
+/* Types are matched with LIKE, the same as the database does */
+static bool has_mime_type(const struct indexed_entry *entry,
+                          const char *pattern)
+{
+    for (const char *type = entry->mime_types; *type;
+         type += strlen(type) + 1)
+    {
+        if (!sqlite3_strlike(pattern, type, 0))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool passes_filters(const struct indexed_entry *entry,
+                           const struct query *query,
+                           const char *mime_pattern)
+{
+    return (!mime_pattern || has_mime_type(entry, mime_pattern)) &&
+           (query->larger_than < 0 || entry->size > query->larger_than) &&
+           (query->smaller_than < 0 || entry->size < query->smaller_than) &&
+           (!query->after || strcmp(entry->timestamp, query->after) >= 0) &&
+           (!query->before || strcmp(entry->timestamp, query->before) < 0);
+}
+
+/* Surrounds the text with %, so LIKE matches it anywhere */
+static char *like_pattern(const char *text)
+{
+    char *pattern = xmalloc(strlen(text) + 3);
+    sprintf(pattern, "%%%s%%", text);
+
+    return pattern;
+}
+
+uint32_t search_index_query(struct search_index *index, struct database *db,
+                            const struct query *query, uint32_t limit,
+                            search_callback callback, void *user_data)
+{
+    if (database_get_data_version(db) != index->data_version)
+    {
+        search_index_refresh(index, db);
+    }
+
+    char *mime_pattern =
+        query->mime_type ? like_pattern(query->mime_type) : NULL;
+    char *text_pattern = NULL;
+    if (query->text)
+    {
+        char *normalized =
+            normalize_search_text(query->text, strlen(query->text));
+        text_pattern = like_pattern(normalized);
+        free(normalized);
+    }
+
+    uint32_t found = 0;
+    for (uint32_t i = index->len; i > 0 && (!limit || found < limit); i--)
+    {
+        const struct indexed_entry *entry = &index->entries[i - 1];
+        if (!passes_filters(entry, query, mime_pattern))
+        {
+            continue;
+        }
+
+        /* Long text is only read for the few entries that get this far */
+        if (text_pattern &&
+            (entry->text ? sqlite3_strlike(text_pattern, entry->text, 0)
+                         : !database_query_matches(db, query, entry->id)))
+        {
+            continue;
+        }
+
+        struct search_match match = {
+            .id = entry->id, .snippet = entry->snippet, .score = 0};
+        found++;
+        if (!callback(&match, user_data))
+        {
+            break;
+        }
+    }
+    free(mime_pattern);
+    free(text_pattern);
+
+    return found;
+}
+
+void search_index_free(struct search_index *index)
+{
+    for (uint32_t i = 0; i < index->len; i++)
+    {
+        free_entry(&index->entries[i]);
+    }
+    free(index->entries);
+    free(index);
+}
@@ -0,0 +1,69 @@
+#include <sqlite3.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "database.h"
+#include "query.h"
+
+#ifndef SEARCH_INDEX_H
+#define SEARCH_INDEX_H
+
+enum search_index_sizes
+{
+    /* Longer text is left in the database and only read for entries that
+     * pass every other filter */
+    MAX_INDEXED_TEXT_LENGTH = 65536
+};
+
+struct indexed_entry
+{
+    int64_t id;
+    /* The same format as the database, so dates compare the same way */
+    char timestamp[20];
+    char *snippet;
+    /* NULL if the text is too long to keep or hasn't been extracted yet,
+     * the database is searched instead */
+    char *text;
+    char *mime_types;
+    int64_t size;
+};
+
+enum index_event
+{
+    ENTRY_ADDED,
+    ENTRY_REMOVED
+};
+
+typedef void (*index_event_callback)(enum index_event event,
+                                     const struct indexed_entry *entry,
+                                     void *user_data);
+
+/* Everything needed to answer plain searches, kept in kapd's memory so
+ * other processes don't have to open the database. Oldest first */
+struct search_index
+{
+    struct indexed_entry *entries;
+    uint32_t len;
+    uint32_t size;
+    int64_t data_version;
+    /* Called for each entry a refresh adds or removes, may be NULL */
+    index_event_callback on_event;
+    void *event_data;
+};
+
+struct search_index *search_index_init(struct database *db);
+/* Adds new entries and drops deleted ones */
+void search_index_refresh(struct search_index *index, struct database *db);
+/* Reads the text of entries whose search text was extracted since they were
+ * added, as given by database_index_search_text() */
+void search_index_update_text(struct search_index *index, struct database *db,
+                              const int64_t *ids, uint32_t len);
+/* Only plain searches in newest first order are answered */
+bool search_index_can_answer(const struct query *query);
+/* The same results as database_query(), refreshing the index first if
+ * another process has changed the database */
+uint32_t search_index_query(struct search_index *index, struct database *db,
+                            const struct query *query, uint32_t limit,
+                            search_callback callback, void *user_data);
+void search_index_free(struct search_index *index);
+
+#endif
@@ -0,0 +1,362 @@
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "snapshot.h"
+#include "xmalloc.h"
+
+enum snapshot_layout
+{
+    SNAPSHOT_MAGIC = 0x6b617073,
+    /* Bumped whenever the layout changes */
+    SNAPSHOT_VERSION = 1,
+    /* Longer snippets are only type stamps, which are left to the
+     * database */
+    SLOT_SNIPPET_SIZE = 256,
+    /* Thumbnails are small JPEGs, a larger one is left to the database */
+    SLOT_THUMBNAIL_SIZE = 32768,
+    /* A reader gives up instead of waiting on a writer that died halfway */
+    MAX_READ_ATTEMPTS = 64
+};
+
+/* Both ends are on the same machine, so it's mapped as is */
+struct snapshot_header
+{
+    uint32_t magic;
+    uint32_t version;
+    /* Odd while kapd is writing, readers copy again if it changed while
+     * they were copying */
+    atomic_uint_least64_t sequence;
+    /* Of the database file, so a client of another database can tell */
+    uint64_t device;
+    uint64_t inode;
+    uint32_t capacity;
+    uint32_t count;
+    /* The newest entry, older ones come before it and wrap around */
+    uint32_t head;
+    uint32_t padding;
+};
+
+struct snapshot_slot
+{
+    int64_t id;
+    /* False if the row didn't fit, the snapshot ends before it */
+    uint32_t complete;
+    uint32_t thumbnail_len;
+    char snippet[SLOT_SNIPPET_SIZE];
+    uint8_t thumbnail[SLOT_THUMBNAIL_SIZE];
+};
+
+struct snapshot_file
+{
+    struct snapshot_header header;
+    struct snapshot_slot slots[SNAPSHOT_ENTRIES];
+};
+
+struct snapshot
+{
+    char *path;
+    struct snapshot_file *file;
+};
+
+/* $XDG_RUNTIME_DIR/kaprica.recent, NULL without a runtime directory */
+static char *get_snapshot_path(void)
+{
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (!runtime_dir)
+    {
+        return NULL;
+    }
+
+    char *path = xmalloc(strlen(runtime_dir) + strlen("/kaprica.recent") + 1);
+    strcpy(path, runtime_dir);
+    strcat(path, "/kaprica.recent");
+
+    return path;
+}
+
+struct snapshot *snapshot_create(struct database *db)
+{
+    char *path = get_snapshot_path();
+    if (!path)
+    {
+        return NULL;
+    }
+
+    /* Clients still mapping the last one keep their copy instead of having
+     * it truncated under them */
+    unlink(path);
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0 || ftruncate(fd, sizeof(struct snapshot_file)) < 0)
+    {
+        perror("Failed to create the snapshot");
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(path);
+        }
+        free(path);
+        return NULL;
+    }
+
+    struct snapshot_file *file =
+        mmap(NULL, sizeof(struct snapshot_file), PROT_READ | PROT_WRITE,
+             MAP_SHARED, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED)
+    {
+        perror("Failed to map the snapshot");
+        unlink(path);
+        free(path);
+        return NULL;
+    }
+
+    struct stat database;
+    if (!stat(database_get_path(db), &database))
+    {
+        file->header.device = database.st_dev;
+        file->header.inode = database.st_ino;
+    }
+    file->header.version = SNAPSHOT_VERSION;
+    file->header.capacity = SNAPSHOT_ENTRIES;
+    file->header.count = 0;
+    file->header.head = 0;
+    atomic_init(&file->header.sequence, 0);
+    /* The file is only used once everything else is in place */
+    atomic_thread_fence(memory_order_release);
+    file->header.magic = SNAPSHOT_MAGIC;
+
+    struct snapshot *snapshot = xmalloc(sizeof(struct snapshot));
+    snapshot->path = path;
+    snapshot->file = file;
+
+    return snapshot;
+}
+
+static int64_t get_slot_id(struct snapshot_header *header,
+                           struct snapshot_slot *slots, uint32_t age)
+{
+    return slots[(header->head + header->capacity - age) % header->capacity]
+        .id;
+}
+
+static void fill_slot(struct snapshot_slot *slot, int64_t id,
+                      const struct entry_row *row)
+{
+    slot->id = id;
+    slot->complete = false;
+    slot->thumbnail_len = 0;
+    if (!row || strlen(row->snippet) >= SLOT_SNIPPET_SIZE ||
+        row->thumbnail_len > SLOT_THUMBNAIL_SIZE)
+    {
+        return;
+    }
+
+    strcpy(slot->snippet, row->snippet);
+    if (row->thumbnail_len)
+    {
+        memcpy(slot->thumbnail, row->thumbnail, row->thumbnail_len);
+    }
+    slot->thumbnail_len = row->thumbnail_len;
+    slot->complete = true;
+}
+
+void snapshot_update(struct snapshot *snapshot, struct database *db)
+{
+    struct snapshot_header *header = &snapshot->file->header;
+    struct snapshot_slot *slots = snapshot->file->slots;
+
+    int64_t ids[SNAPSHOT_ENTRIES];
+    uint32_t len = database_get_latest_entries(db, SNAPSHOT_ENTRIES, 0, ids);
+
+    /* Usually entries were only added, so the ones already kept are the
+     * oldest of the new list and only the ones before them are read */
+    uint32_t added = 0;
+    for (; added < len; added++)
+    {
+        uint32_t kept = len - added;
+        if (kept > header->count)
+        {
+            continue;
+        }
+        uint32_t i = 0;
+        while (i < kept && ids[added + i] == get_slot_id(header, slots, i))
+        {
+            i++;
+        }
+        if (i == kept)
+        {
+            break;
+        }
+    }
+    if (!added && len == header->count)
+    {
+        return;
+    }
+
+    struct entry_row rows[SNAPSHOT_ENTRIES];
+    bool found[SNAPSHOT_ENTRIES];
+    for (uint32_t i = 0; i < added; i++)
+    {
+        found[i] = database_read_row(db, ids[i], &rows[i]);
+    }
+
+    /* Oldest first, so the newest one ends up at the head */
+    atomic_fetch_add_explicit(&header->sequence, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for (uint32_t i = added; i-- > 0;)
+    {
+        header->head = (header->head + 1) % header->capacity;
+        fill_slot(&slots[header->head], ids[i], found[i] ? &rows[i] : NULL);
+    }
+    header->count = len;
+    atomic_fetch_add_explicit(&header->sequence, 1, memory_order_release);
+
+    for (uint32_t i = 0; i < added; i++)
+    {
+        if (found[i])
+        {
+            database_free_row(&rows[i]);
+        }
+    }
+}
+
+void snapshot_close(struct snapshot *snapshot)
+{
+    unlink(snapshot->path);
+    munmap(snapshot->file, sizeof(struct snapshot_file));
+    free(snapshot->path);
+    free(snapshot);
+}
+
+/* Maps the snapshot if kapd keeps one of the database at filepath */
+static struct snapshot_file *map_snapshot(const char *filepath)
+{
+    char *path = get_snapshot_path();
+    if (!path)
+    {
+        return NULL;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    free(path);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    struct stat info;
+    struct snapshot_file *file = MAP_FAILED;
+    if (!fstat(fd, &info) && info.st_size == sizeof(struct snapshot_file))
+    {
+        file = mmap(NULL, sizeof(struct snapshot_file), PROT_READ,
+                    MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (file == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    char *database = filepath ? xstrdup(filepath) : database_default_path();
+    struct snapshot_header *header = &file->header;
+    bool usable = header->magic == SNAPSHOT_MAGIC &&
+                  header->version == SNAPSHOT_VERSION &&
+                  header->capacity == SNAPSHOT_ENTRIES &&
+                  !stat(database, &info) && header->device == info.st_dev &&
+                  header->inode == info.st_ino;
+    free(database);
+    atomic_thread_fence(memory_order_acquire);
+    if (!usable)
+    {
+        munmap(file, sizeof(struct snapshot_file));
+        return NULL;
+    }
+
+    return file;
+}
+
+/* Copies the rows while kapd isn't writing, returns false if it was */
+static bool copy_rows(struct snapshot_file *file, struct entry_row *rows,
+                      uint32_t max, uint32_t *len)
+{
+    struct snapshot_header *header = &file->header;
+    uint64_t sequence =
+        atomic_load_explicit(&header->sequence, memory_order_acquire);
+    if (sequence % 2)
+    {
+        return false;
+    }
+
+    uint32_t count = header->count < max ? header->count : max;
+    uint32_t head = header->head;
+    *len = 0;
+    for (uint32_t i = 0; i < count && head < SNAPSHOT_ENTRIES; i++)
+    {
+        struct snapshot_slot *slot =
+            &file->slots[(head + SNAPSHOT_ENTRIES - i) % SNAPSHOT_ENTRIES];
+        uint32_t thumbnail_len = slot->thumbnail_len;
+        if (!slot->complete || thumbnail_len > SLOT_THUMBNAIL_SIZE)
+        {
+            break;
+        }
+
+        struct entry_row *row = &rows[(*len)++];
+        row->id = slot->id;
+        /* Only checked once it's copied, so it may be cut short */
+        char snippet[SLOT_SNIPPET_SIZE];
+        memcpy(snippet, slot->snippet, SLOT_SNIPPET_SIZE);
+        snippet[SLOT_SNIPPET_SIZE - 1] = '\0';
+        row->snippet = xstrdup(snippet);
+        row->thumbnail = NULL;
+        row->thumbnail_len = thumbnail_len;
+        if (thumbnail_len)
+        {
+            row->thumbnail = xmalloc(thumbnail_len);
+            memcpy(row->thumbnail, slot->thumbnail, thumbnail_len);
+        }
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&header->sequence, memory_order_relaxed) ==
+        sequence)
+    {
+        return true;
+    }
+
+    for (uint32_t i = 0; i < *len; i++)
+    {
+        database_free_row(&rows[i]);
+    }
+    *len = 0;
+    return false;
+}
+
+uint32_t snapshot_read(const char *filepath, struct entry_row *rows,
+                       uint32_t max)
+{
+    struct snapshot_file *file = map_snapshot(filepath);
+    if (!file)
+    {
+        return 0;
+    }
+
+    uint32_t len = 0;
+    for (int attempt = 0; attempt < MAX_READ_ATTEMPTS; attempt++)
+    {
+        if (copy_rows(file, rows, max, &len))
+        {
+            break;
+        }
+        sched_yield();
+    }
+
+    munmap(file, sizeof(struct snapshot_file));
+    return len;
+}
@@ -0,0 +1,33 @@
+#include <stdint.h>
+#include "database.h"
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+enum snapshot_sizes
+{
+    /* Two screens of kapg's list */
+    SNAPSHOT_ENTRIES = 40
+};
+
+/* The newest entries' rows, kept by kapd in a file of the runtime directory
+ * that other processes map read only, so they can show the top of the
+ * history before opening the database */
+struct snapshot;
+
+/* Returns NULL if there's no runtime directory to keep it in */
+struct snapshot *snapshot_create(struct database *db);
+/* Brings the snapshot up to date with the database, only entries that
+ * weren't in it already are read */
+void snapshot_update(struct snapshot *snapshot, struct database *db);
+/* Removes the file, so clients don't use a snapshot nobody updates */
+void snapshot_close(struct snapshot *snapshot);
+
+/* Copies up to max of the newest entries of the database at filepath, NULL
+ * meaning the default one, newest first. Returns how many were read, 0 if
+ * kapd isn't keeping a snapshot of that database. The rows are freed with
+ * database_free_row() */
+uint32_t snapshot_read(const char *filepath, struct entry_row *rows,
+                       uint32_t max);
+
+#endif
@@ -5,6 +5,7 @@
 #include <string.h>
 #include <unistd.h>
 #include "clipboard.h"
+#include "detection.h"
 #include "protocol/wlr-data-control.h"
 #include "xmalloc.h"
 
@@ -20,8 +21,19 @@ data_control_source_send_handler(void *data,
     {
         if (!strcmp(mime_type, src->types[i]))
         {
-            write(fd, src->data[i], src->len[i]);
+            const void *data = src->data[i];
+            size_t len = src->len[i];
+            if (!data)
+            {
+                data = get_transcoded_image(src, i, &len);
+            }
+
+            if (data)
+            {
+                write(fd, data, len);
+            }
             close(fd);
+            src->pastes++;
 
             if (src->offer_once)
             {
@@ -35,7 +47,15 @@ static void data_control_source_cancelled_handler(
     void *data, struct zwlr_data_control_source_v1 *data_src)
 {
     clipboard *clip = (clipboard *)data;
-    clip->selection_source->expired = true;
+    source_buffer *src = clip->selection_source;
+
+    /* kapd replaces its own selection when a client hands it an entry,
+     * cancelling the old source doesn't expire the new one */
+    if (data_src == src->source)
+    {
+        src->expired = true;
+        src->source = NULL;
+    }
     zwlr_data_control_source_v1_destroy(data_src);
 }
 
@@ -72,12 +92,16 @@ source_buffer *source_init(void)
     source_buffer *src = xmalloc(sizeof(source_buffer));
     src->offer_once = false;
     src->expired = false;
+    src->password = false;
     src->num_types = 0;
     src->thumbnail = NULL;
     src->thumbnail_len = 0;
     src->source = NULL;
     src->snippet = NULL;
+    src->search_text = NULL;
     src->data_hash = NULL;
+    src->id = 0;
+    src->pastes = 0;
     return src;
 }
 
@@ -97,6 +121,10 @@ void source_destroy(source_buffer *src)
     {
         free(src->snippet);
     }
+    if (src->search_text)
+    {
+        free(src->search_text);
+    }
     if (src->data_hash)
     {
         free(src->data_hash);
@@ -143,7 +171,15 @@ void source_clear(source_buffer *src)
     }
     src->snippet = NULL;
 
+    if (src->search_text)
+    {
+        free(src->search_text);
+    }
+    src->search_text = NULL;
+
     src->num_types = 0;
+    src->id = 0;
+    src->pastes = 0;
     src->expired = false;
     src->offer_once = false;
     src->password = false;
@@ -0,0 +1,97 @@
+#include <gtk/gtk.h>
+#include <stdint.h>
+#include "texture_cache.h"
+#include "xmalloc.h"
+
+struct cached_texture
+{
+    int64_t id;
+    GdkTexture *texture;
+};
+
+struct texture_cache
+{
+    /* Most recently used first */
+    GQueue order;
+    /* Links of order by id */
+    GHashTable *links;
+    uint32_t capacity;
+};
+
+struct texture_cache *texture_cache_new(uint32_t capacity)
+{
+    struct texture_cache *cache = xmalloc(sizeof(struct texture_cache));
+    g_queue_init(&cache->order);
+    cache->links = g_hash_table_new(g_int64_hash, g_int64_equal);
+    cache->capacity = capacity;
+
+    return cache;
+}
+
+static void drop_link(struct texture_cache *cache, GList *link)
+{
+    struct cached_texture *cached = link->data;
+    g_hash_table_remove(cache->links, &cached->id);
+    g_queue_delete_link(&cache->order, link);
+    g_object_unref(cached->texture);
+    free(cached);
+}
+
+GdkTexture *texture_cache_get(struct texture_cache *cache, int64_t id)
+{
+    GList *link = g_hash_table_lookup(cache->links, &id);
+    if (!link)
+    {
+        return NULL;
+    }
+
+    g_queue_unlink(&cache->order, link);
+    g_queue_push_head_link(&cache->order, link);
+
+    return ((struct cached_texture *)link->data)->texture;
+}
+
+void texture_cache_put(struct texture_cache *cache, int64_t id,
+                       GdkTexture *texture)
+{
+    GList *link = g_hash_table_lookup(cache->links, &id);
+    if (link)
+    {
+        drop_link(cache, link);
+    }
+
+    while (cache->order.length && cache->order.length >= cache->capacity)
+    {
+        drop_link(cache, cache->order.tail);
+    }
+
+    struct cached_texture *cached = xmalloc(sizeof(struct cached_texture));
+    cached->id = id;
+    cached->texture = g_object_ref(texture);
+    g_queue_push_head(&cache->order, cached);
+    g_hash_table_insert(cache->links, &cached->id, cache->order.head);
+}
+
+void texture_cache_remove(struct texture_cache *cache, int64_t id)
+{
+    GList *link = g_hash_table_lookup(cache->links, &id);
+    if (link)
+    {
+        drop_link(cache, link);
+    }
+}
+
+void texture_cache_clear(struct texture_cache *cache)
+{
+    while (cache->order.head)
+    {
+        drop_link(cache, cache->order.head);
+    }
+}
+
+void texture_cache_free(struct texture_cache *cache)
+{
+    texture_cache_clear(cache);
+    g_hash_table_destroy(cache->links);
+    free(cache);
+}
@@ -0,0 +1,23 @@
+#include <gtk/gtk.h>
+#include <stdint.h>
+
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+/* Decoded thumbnails by entry id, so a row that's shown again doesn't have
+ * to be decoded again. Once full, the least recently used one is dropped.
+ * Only used from the main thread */
+struct texture_cache;
+
+struct texture_cache *texture_cache_new(uint32_t capacity);
+/* Returns NULL if the entry's texture isn't cached, the cache keeps its
+ * reference */
+GdkTexture *texture_cache_get(struct texture_cache *cache, int64_t id);
+/* Takes a reference of its own */
+void texture_cache_put(struct texture_cache *cache, int64_t id,
+                       GdkTexture *texture);
+void texture_cache_remove(struct texture_cache *cache, int64_t id);
+void texture_cache_clear(struct texture_cache *cache);
+void texture_cache_free(struct texture_cache *cache);
+
+#endif
@@ -0,0 +1,87 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "trigram.h"
+
+/* Bits set per trigram, three keeps false positives low at two bits per
+ * byte of text */
+#define TRIGRAM_HASHES 3
+/* Each bit position is taken from its own part of the hash */
+#define TRIGRAM_HASH_SHIFT 21
+
+static uint8_t fold_case(uint8_t c)
+{
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+/* splitmix64's finalizer, the trigram itself is far from random looking */
+static uint64_t hash_trigram(const uint8_t *trigram)
+{
+    uint64_t z = ((uint64_t)fold_case(trigram[0]) << 16 |
+                  (uint64_t)fold_case(trigram[1]) << 8 |
+                  fold_case(trigram[2])) +
+                 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+size_t trigram_filter_size(size_t len)
+{
+    if (len < MIN_TRIGRAM_TEXT_LENGTH)
+    {
+        return 0;
+    }
+
+    /* Two bits per byte of text, which usually has far fewer distinct
+     * trigrams than bytes */
+    size_t size = MIN_TRIGRAM_FILTER_SIZE;
+    while (size < len / 4 && size < MAX_TRIGRAM_FILTER_SIZE)
+    {
+        size *= 2;
+    }
+
+    return size;
+}
+
+void trigram_filter_build(const char *text, size_t len, uint8_t *filter,
+                          size_t size)
+{
+    memset(filter, 0, size);
+    uint64_t mask = size * 8 - 1;
+    for (size_t i = 0; i + 2 < len; i++)
+    {
+        uint64_t hash = hash_trigram((const uint8_t *)text + i);
+        for (int j = 0; j < TRIGRAM_HASHES; j++)
+        {
+            uint64_t bit = (hash >> (j * TRIGRAM_HASH_SHIFT)) & mask;
+            filter[bit / 8] |= 1 << (bit % 8);
+        }
+    }
+}
+
+bool trigram_filter_may_contain(const uint8_t *filter, size_t size,
+                                const char *pattern, size_t len)
+{
+    uint64_t mask = size * 8 - 1;
+    for (size_t i = 0; i + 2 < len; i++)
+    {
+        if (memchr(pattern + i, '%', 3) || memchr(pattern + i, '_', 3))
+        {
+            continue;
+        }
+
+        uint64_t hash = hash_trigram((const uint8_t *)pattern + i);
+        for (int j = 0; j < TRIGRAM_HASHES; j++)
+        {
+            uint64_t bit = (hash >> (j * TRIGRAM_HASH_SHIFT)) & mask;
+            if (!(filter[bit / 8] & (1 << (bit % 8))))
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
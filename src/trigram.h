@@ -0,0 +1,28 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef TRIGRAM_H
+#define TRIGRAM_H
+
+enum trigram_sizes
+{
+    /* Shorter text is searched about as quickly as a filter is tested */
+    MIN_TRIGRAM_TEXT_LENGTH = 4096,
+    MIN_TRIGRAM_FILTER_SIZE = 512,
+    MAX_TRIGRAM_FILTER_SIZE = 65536
+};
+
+/* The size in bytes of the filter for text of len bytes, 0 if the text is
+ * too short to need one */
+size_t trigram_filter_size(size_t len);
+/* A Bloom filter of every trigram in the text, ignoring the case of ASCII
+ * letters the same as LIKE. The size has to be a power of two */
+void trigram_filter_build(const char *text, size_t len, uint8_t *filter,
+                          size_t size);
+/* False only if the text the filter was built from can't contain the
+ * pattern. Trigrams with LIKE wildcards in them are skipped */
+bool trigram_filter_may_contain(const uint8_t *filter, size_t size,
+                                const char *pattern, size_t len);
+
+#endif